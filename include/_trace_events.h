@@ -0,0 +1,38 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Enumerate through all trace events, see trace.c. Before including this
+ * file, define
+ *   DECLARE_TRACE_EVENT(id, name, format)
+ * where format is a Python format string used by tools/trace/decode.py, with
+ * {0}, {1}, ... referring to the arguments of the event. This file is also
+ * parsed by tools/trace/decode.py, so each event must be in one line.
+ */
+
+DECLARE_TRACE_EVENT(0x0001, TRACE_VMEXIT, "VMEXIT reason={0} rip={1:#x}")
+DECLARE_TRACE_EVENT(0x0002, TRACE_SHV_TEST_ITER, "SHV test iter {0}")
+DECLARE_TRACE_EVENT(0x0003, TRACE_BENCH, "bench sample {0}")
+DECLARE_TRACE_EVENT(0x0010, TRACE_NMI_EXPERIMENT, "Experiment: {0}")
+DECLARE_TRACE_EVENT(0x0011, TRACE_NMI_ENTER_HOST, "Enter host, exp={0}, state={1}")
+DECLARE_TRACE_EVENT(0x0012, TRACE_NMI_LEAVE_HOST, "Leave host")
+DECLARE_TRACE_EVENT(0x0013, TRACE_NMI_HLT_WAIT, "hlt_wait() source={0} end={1}")
+DECLARE_TRACE_EVENT(0x0014, TRACE_NMI_IRET_WAIT, "iret_wait() source={0} end={1}")
+DECLARE_TRACE_EVENT(0x0015, TRACE_NMI_INTERRUPT, "Interrupt recorded: source={0} rip={1:#x}")
+
+#undef DECLARE_TRACE_EVENT
@@ -294,6 +294,8 @@
 #define VMX_VMEXIT_TPAUSE               68
 /* LOADIWKEY */
 #define VMX_VMEXIT_LOADIWKEY            69
+/* Number of basic exit reasons above */
+#define VMX_VMEXIT_COUNT                70
 
 #define VMX_CRX_ACCESS_FROM	0x1
 #define VMX_CRX_ACCESS_TO		0x0
@@ -514,6 +516,17 @@ enum _vmcs_encodings {
 #include "_vmx_vmcs_fields.h"
 };
 
+//Index of VMCS fields in _vmx_vmcs_fields.h, used by VMCS cache
+enum _vmcs_field_indexes {
+#define DECLARE_FIELD_16(encoding, name, ...) \
+	VMCS_INDEX_##name,
+#define DECLARE_FIELD_64(...) DECLARE_FIELD_16(__VA_ARGS__)
+#define DECLARE_FIELD_32(...) DECLARE_FIELD_16(__VA_ARGS__)
+#define DECLARE_FIELD_NW(...) DECLARE_FIELD_16(__VA_ARGS__)
+#include "_vmx_vmcs_fields.h"
+	VMCS_FIELD_COUNT
+};
+
 struct _vmx_vmcsfields {
 #define DECLARE_FIELD_16(encoding, name, ...) \
 	u16 name;
@@ -696,4 +709,15 @@ static inline u32 __vmx_invept(int invalidation_type, u64 eptp)
 	return status;
 }
 
+// VM function 0 (EPTP switching), executed by the guest
+//      Switch EPTP to entry index of the EPTP list
+// VMFUNC is encoded as hex, like INVEPT above
+
+static inline void __vmx_vmfunc_eptp_switch(u32 index)
+{
+	__asm__ __volatile__(".byte 0x0f, 0x01, 0xd4 \r\n"
+						 ::"a"(0), "c"(index)
+						 :"memory");
+}
+
 #endif
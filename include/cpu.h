@@ -209,3 +209,16 @@ static inline u64 rdtsc(void)
 	asm volatile ("rdtsc":"=a" (eax), "=d"(edx));
 	return ((u64) edx << 32) | eax;
 }
+
+static inline u64 xgetbv(u32 xcr)
+{
+	u32 eax, edx;
+	asm volatile ("xgetbv":"=a" (eax), "=d"(edx):"c"(xcr));
+	return ((u64) edx << 32) | eax;
+}
+
+static inline void xsetbv(u32 xcr, u64 val)
+{
+	asm volatile ("xsetbv"::"a" ((u32) val), "d"((u32) (val >> 32)),
+				  "c"(xcr));
+}
@@ -43,6 +43,30 @@
 #define SHV_NESTED_USER_MODE		0x0000000000000800ULL	/* Need !0x2 */
 #define SHV_USE_PS2_MOUSE			0x0000000000001000ULL
 #define SHV_NO_VGA_ART				0x0000000000002000ULL	/* Need !0x20 */
+#define SHV_BENCH_VMEXIT			0x0000000000004000ULL
+#define SHV_PRINT_EXIT_STATS		0x0000000000008000ULL
+#define SHV_VMEXIT_FAST_PATH		0x0000000000010000ULL
+#define SHV_BENCH_FAST_PATH			0x0000000000020000ULL
+#define SHV_USE_VMCS_SHADOWING		0x0000000000040000ULL
+#define SHV_BENCH_VMCS_SHADOW		0x0000000000080000ULL	/* Need 0x40000 */
+#define SHV_BENCH_VMCS_FIELDS		0x0000000000100000ULL
+#define SHV_BENCH_GET_VCPU			0x0000000000200000ULL
+#define SHV_BENCH_SPINLOCK			0x0000000000400000ULL
+#define SHV_BENCH_BARRIER			0x0000000000800000ULL
+#define SHV_USE_SERIAL_IRQ			0x0000000001000000ULL	/* Need !0x2 */
+#define SHV_BENCH_SERIAL			0x0000000002000000ULL
+#define SHV_BENCH_TRACE				0x0000000004000000ULL
+#define SHV_BENCH_LIBC				0x0000000008000000ULL
+#define SHV_BENCH_XSAVE				0x0000000010000000ULL
+#define SHV_USE_LAZY_EPT			0x0000000020000000ULL	/* Need 0x4 */
+#define SHV_EPT_4K_ONLY				0x0000000040000000ULL	/* Need 0x4 */
+#define SHV_USE_SHARED_EPT			0x0000000080000000ULL	/* Need 0x4, !0x20000000 */
+#define SHV_BENCH_EPT_SHOOTDOWN		0x0000000100000000ULL	/* Need 0x80000000 */
+#define SHV_USE_VMFUNC				0x0000000200000000ULL	/* Need 0x4 */
+#define SHV_BENCH_EPT_SWITCH		0x0000000400000000ULL	/* Need 0x4 */
+#define SHV_USE_EPT_AD				0x0000000800000000ULL	/* Need 0x4 */
+#define SHV_USE_PML					0x0000001000000000ULL	/* Need 0x800000000, !0x80000000 */
+#define SHV_BENCH_PML				0x0000002000000000ULL	/* Need 0x800000000, !0x80000000 */
 /* End of bit definitions for g_shv_opt */
 
 /*
@@ -22,6 +22,18 @@
 #ifndef _SHV_H_
 #define _SHV_H_
 
+/* VMCALL that does nothing, may be handled by VMEXIT fast path */
+#define SHV_VMCALL_NOP 50
+
+/* Offset of VCPU::vmexit_fast_mask, used by shv-vmx-asm.S */
+#ifdef __amd64__
+#define VCPU_VMEXIT_FAST_MASK 16
+#elif defined(__i386__)
+#define VCPU_VMEXIT_FAST_MASK 12
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+
 #ifndef __ASSEMBLY__
 
 typedef struct {
@@ -58,7 +70,40 @@ void mouse_init(VCPU * vcpu);
 void handle_mouse_interrupt(VCPU * vcpu, u8 vector, bool guest);
 
 /* shv-vmx.c */
+
+/* VMCALL number for guest to print VMEXIT statistics */
+#define SHV_VMCALL_EXIT_STATS 52
+
+/*
+ * EPT violations are further classified in VMEXIT statistics using the access
+ * type (read, write, instruction fetch) and whether the guest-physical address
+ * is present in EPT.
+ */
+#define VMEXIT_STATS_EPT_CLASSES 6
+
+/* Per-VCPU VMEXIT statistics, cache line aligned to avoid false sharing. */
+typedef struct vmexit_stats {
+	u64 count[VMX_VMEXIT_COUNT];
+	u64 cycles[VMX_VMEXIT_COUNT];
+	u64 ept_count[VMEXIT_STATS_EPT_CLASSES];
+	u64 ept_cycles[VMEXIT_STATS_EPT_CLASSES];
+	/* Current VMEXIT, set in vmexit_handler() */
+	u64 exit_tsc;
+	u32 exit_reason;
+	u32 ept_class;
+	flight_record_t *flight;
+} __attribute__((aligned(64))) vmexit_stats_t;
+
 void shv_vmx_main(VCPU * vcpu);
+void vmexit_stats_end(VCPU * vcpu);
+void vmexit_stats_print(VCPU * vcpu);
+void vmexit_handle_default(VCPU * vcpu, struct regs *r, vmexit_info_t * info);
+void vmexit_register(VCPU * vcpu, u32 reason, vmexit_handler_t handler);
+void vmexit_deregister(VCPU * vcpu, u32 reason, vmexit_handler_t handler);
+void vmcall_register(VCPU * vcpu, u32 number, vmexit_handler_t handler);
+void vmcall_deregister(VCPU * vcpu, u32 number, vmexit_handler_t handler);
+void vmexit_fast_path_set(VCPU * vcpu, bool enable);
+void vmcs_shadowing_set(VCPU * vcpu, bool enable);
 void vmentry_error(ulong_t is_resume, ulong_t valid);
 
 /* shv-asm.S */
@@ -75,25 +120,329 @@ extern u8 large_pages[2][PAGE_SIZE_2M] __attribute__((aligned(PAGE_SIZE_2M)));
  */
 #define SHV_EPT_COUNT 2
 
+/*
+ * Maximum of ept_count= in command line. VCPU::ept_num (u8) ranges over
+ * 0 .. (SHV_EPT_MAX << 4) - 1, so SHV_EPT_MAX must not exceed 16.
+ */
+#define SHV_EPT_MAX 16
+
+/*
+ * With SHV_USE_SHARED_EPT, guest-physical page mapped only in the shared EPT,
+ * changed by shv_ept_shared_remap(). Must not overlap identity-mapped memory.
+ */
+#define SHV_EPT_SHARED_GPA 0x40000000ULL
+
+/* Number of GPAs in the page-modification log */
+#define SHV_EPT_PML_ENTRIES 512
+
+/* Interrupt vector and VMCALL number to acknowledge EPT shootdowns */
+#define SHV_EPT_SHOOTDOWN_VECTOR 0x55
+#define SHV_VMCALL_EPT_SHOOTDOWN 57
+
 void shv_ept_init(VCPU * vcpu);
 u64 shv_build_ept(VCPU * vcpu, u8 ept_num);
+u64 shv_ept_eptp(VCPU * vcpu, spa_t root_pa);
+spa_t shv_ept_build_eptp_list(VCPU * vcpu);
+bool shv_ept_handle_violation(VCPU * vcpu, u64 paddr, ulong_t q);
+void shv_ept_shootdown_poll(VCPU * vcpu);
+void handle_ept_shootdown_interrupt(VCPU * vcpu, u8 vector, bool guest);
+u64 shv_ept_shared_remap(VCPU * vcpu, u32 which);
+spa_t shv_ept_pml_log(VCPU * vcpu);
+void shv_ept_handle_pml_full(VCPU * vcpu);
+u64 shv_ept_pml_full_exits(VCPU * vcpu);
+u64 shv_ept_harvest_dirty(VCPU * vcpu);
+void shv_ept_print_stats(VCPU * vcpu);
 
 /* shv-vmcs.c */
-void __vmx_vmwrite16(u16 encoding, u16 value);
-void __vmx_vmwrite64(u16 encoding, u64 value);
-void __vmx_vmwrite32(u16 encoding, u32 value);
-void __vmx_vmwriteNW(u16 encoding, ulong_t value);
-bool __vmx_vmread16_safe(u16 encoding, u16 * result);
-u16 __vmx_vmread16(u16 encoding);
-bool __vmx_vmread64_safe(u16 encoding, u64 * result);
-u64 __vmx_vmread64(u16 encoding);
-bool __vmx_vmread32_safe(u16 encoding, u32 * result);
-u32 __vmx_vmread32(u16 encoding);
-bool __vmx_vmreadNW_safe(u16 encoding, ulong_t * result);
-ulong_t __vmx_vmreadNW(u16 encoding);
+void __vmx_vmwrite16_checked(u16 encoding, u16 value);
+void __vmx_vmwrite64_checked(u16 encoding, u64 value);
+void __vmx_vmwrite32_checked(u16 encoding, u32 value);
+void __vmx_vmwriteNW_checked(u16 encoding, ulong_t value);
+bool __vmx_vmread16_checked(u16 encoding, u16 * result);
+bool __vmx_vmread64_checked(u16 encoding, u64 * result);
+bool __vmx_vmread32_checked(u16 encoding, u32 * result);
+bool __vmx_vmreadNW_checked(u16 encoding, ulong_t * result);
+void vmcs_cache_init(VCPU * vcpu);
+void vmcs_cache_invalidate(VCPU * vcpu);
+void vmcs_cache_fetch(VCPU * vcpu, u32 index);
+void vmcs_cache_mark_dirty(VCPU * vcpu, u32 index);
+void vmcs_cache_flush(VCPU * vcpu);
+void vmcs_cache_print(VCPU * vcpu);
 void vmcs_print_all(VCPU * vcpu);
 void vmcs_dump(VCPU * vcpu, int verbose);
 void vmcs_load(VCPU * vcpu);
+void vmcs_shadow_build_bitmaps(VCPU * vcpu, u8 * vmread_bitmap,
+							   u8 * vmwrite_bitmap);
+
+/*
+ * Inline VMCS accessors. When the encoding is an integer constant expression
+ * (e.g. VMCS_guest_RIP), its width is checked by a static assertion in the
+ * macros at the end of this section, at every optimization level. When the
+ * encoding only becomes constant after inlining (at -O1 and above), the width
+ * is checked by __vmx_vmcs_check_width() and VMREAD / VMWRITE are executed
+ * inline. Otherwise the *_checked functions in shv-vmcs.c are called, which
+ * check the width at runtime.
+ */
+
+/* Never defined, calling it causes a compile error */
+void __vmx_vmcs_width_mismatch(void)
+	__attribute__((error("VMCS encoding does not match access width")));
+
+/* Check width of constant VMCS encoding, width is bits 15:12 (0, 2, 4, 6) */
+#define __vmx_vmcs_check_width(encoding, width) \
+	do { \
+		if (((encoding) >> 12) != (width)) { \
+			__vmx_vmcs_width_mismatch(); \
+		} \
+	} while (0)
+
+/* Write 16-bit VMCS field, never fails */
+static inline __attribute__((always_inline))
+void __vmx_vmwrite16(u16 encoding, u16 value)
+{
+	if (__builtin_constant_p(encoding)) {
+		__vmx_vmcs_check_width(encoding, 0);
+		ASSERT(__vmx_vmwrite(encoding, value));
+	} else {
+		__vmx_vmwrite16_checked(encoding, value);
+	}
+}
+
+/* Write 64-bit VMCS field, never fails */
+static inline __attribute__((always_inline))
+void __vmx_vmwrite64(u16 encoding, u64 value)
+{
+	if (__builtin_constant_p(encoding)) {
+		/* Only full (not high) encoding of 64-bit field is allowed */
+		__vmx_vmcs_check_width(encoding, 2);
+		__vmx_vmcs_check_width((encoding & 0x1) << 12, 0);
+#ifdef __amd64__
+		ASSERT(__vmx_vmwrite(encoding, value));
+#elif defined(__i386__)
+		ASSERT(__vmx_vmwrite(encoding, value));
+		ASSERT(__vmx_vmwrite(encoding + 1, value >> 32));
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+	} else {
+		__vmx_vmwrite64_checked(encoding, value);
+	}
+}
+
+/* Write 32-bit VMCS field, never fails */
+static inline __attribute__((always_inline))
+void __vmx_vmwrite32(u16 encoding, u32 value)
+{
+	if (__builtin_constant_p(encoding)) {
+		__vmx_vmcs_check_width(encoding, 4);
+		ASSERT(__vmx_vmwrite(encoding, value));
+	} else {
+		__vmx_vmwrite32_checked(encoding, value);
+	}
+}
+
+/* Write natural width (NW) VMCS field, never fails */
+static inline __attribute__((always_inline))
+void __vmx_vmwriteNW(u16 encoding, ulong_t value)
+{
+	if (__builtin_constant_p(encoding)) {
+		__vmx_vmcs_check_width(encoding, 6);
+		ASSERT(__vmx_vmwrite(encoding, value));
+	} else {
+		__vmx_vmwriteNW_checked(encoding, value);
+	}
+}
+
+/* Read 16-bit VMCS field, return whether succeed */
+static inline __attribute__((always_inline))
+bool __vmx_vmread16_safe(u16 encoding, u16 * result)
+{
+	if (__builtin_constant_p(encoding)) {
+		unsigned long value;
+		__vmx_vmcs_check_width(encoding, 0);
+		if (!__vmx_vmread(encoding, &value)) {
+			return false;
+		}
+		*result = value;
+		return true;
+	} else {
+		return __vmx_vmread16_checked(encoding, result);
+	}
+}
+
+/* Read 64-bit VMCS field, return whether succeed */
+static inline __attribute__((always_inline))
+bool __vmx_vmread64_safe(u16 encoding, u64 * result)
+{
+	if (__builtin_constant_p(encoding)) {
+#ifdef __amd64__
+		unsigned long value;
+		__vmx_vmcs_check_width(encoding, 2);
+		__vmx_vmcs_check_width((encoding & 0x1) << 12, 0);
+		if (!__vmx_vmread(encoding, &value)) {
+			return false;
+		}
+		*result = value;
+		return true;
+#elif defined(__i386__)
+		unsigned long low, high;
+		__vmx_vmcs_check_width(encoding, 2);
+		__vmx_vmcs_check_width((encoding & 0x1) << 12, 0);
+		if (!__vmx_vmread(encoding, &low)) {
+			return false;
+		}
+		/* Since reading low succeeds, assume reading high will succeed. */
+		ASSERT(__vmx_vmread(encoding + 1, &high));
+		*result = ((u64) high << 32) | low;
+		return true;
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+	} else {
+		return __vmx_vmread64_checked(encoding, result);
+	}
+}
+
+/* Read 32-bit VMCS field, return whether succeed */
+static inline __attribute__((always_inline))
+bool __vmx_vmread32_safe(u16 encoding, u32 * result)
+{
+	if (__builtin_constant_p(encoding)) {
+		unsigned long value;
+		__vmx_vmcs_check_width(encoding, 4);
+		if (!__vmx_vmread(encoding, &value)) {
+			return false;
+		}
+		*result = value;
+		return true;
+	} else {
+		return __vmx_vmread32_checked(encoding, result);
+	}
+}
+
+/* Read natural width (NW) VMCS field, return whether succeed */
+static inline __attribute__((always_inline))
+bool __vmx_vmreadNW_safe(u16 encoding, ulong_t * result)
+{
+	if (__builtin_constant_p(encoding)) {
+		unsigned long value;
+		__vmx_vmcs_check_width(encoding, 6);
+		if (!__vmx_vmread(encoding, &value)) {
+			return false;
+		}
+		*result = value;
+		return true;
+	} else {
+		return __vmx_vmreadNW_checked(encoding, result);
+	}
+}
+
+/* Read 16-bit VMCS field, never fails */
+static inline __attribute__((always_inline)) u16 __vmx_vmread16(u16 encoding)
+{
+	u16 value;
+	ASSERT(__vmx_vmread16_safe(encoding, &value));
+	return value;
+}
+
+/* Read 64-bit VMCS field, never fails */
+static inline __attribute__((always_inline)) u64 __vmx_vmread64(u16 encoding)
+{
+	u64 value;
+	ASSERT(__vmx_vmread64_safe(encoding, &value));
+	return value;
+}
+
+/* Read 32-bit VMCS field, never fails */
+static inline __attribute__((always_inline)) u32 __vmx_vmread32(u16 encoding)
+{
+	u32 value;
+	ASSERT(__vmx_vmread32_safe(encoding, &value));
+	return value;
+}
+
+/* Read natural width (NW) VMCS field, never fails */
+static inline __attribute__((always_inline))
+ulong_t __vmx_vmreadNW(u16 encoding)
+{
+	ulong_t value;
+	ASSERT(__vmx_vmreadNW_safe(encoding, &value));
+	return value;
+}
+
+/* Whether x is an integer constant expression, x is not evaluated */
+#define __vmx_is_constexpr(x) \
+	(sizeof(int) == sizeof(*(8 ? ((void *)((long)(x) * 0l)) : (int *)8)))
+
+/*
+ * Check width of VMCS encoding and that it is not the high part of a 64-bit
+ * field, if the encoding is an integer constant expression. Works at -O0.
+ */
+#define __vmx_vmcs_static_width(encoding, width) \
+	((void)sizeof(struct { \
+		_Static_assert((__builtin_choose_expr(__vmx_is_constexpr(encoding), \
+											  (encoding), (width) << 12) & \
+						0xf001) == (width) << 12, \
+					   "VMCS encoding does not match access width"); \
+		int dummy; \
+	}))
+
+/*
+ * Wrap the accessors above with static width checks. The function names in
+ * the expansions are not expanded again, so they call the inline functions.
+ */
+#define __vmx_vmwrite16(encoding, value) \
+	(__vmx_vmcs_static_width(encoding, 0), __vmx_vmwrite16(encoding, value))
+#define __vmx_vmwrite64(encoding, value) \
+	(__vmx_vmcs_static_width(encoding, 2), __vmx_vmwrite64(encoding, value))
+#define __vmx_vmwrite32(encoding, value) \
+	(__vmx_vmcs_static_width(encoding, 4), __vmx_vmwrite32(encoding, value))
+#define __vmx_vmwriteNW(encoding, value) \
+	(__vmx_vmcs_static_width(encoding, 6), __vmx_vmwriteNW(encoding, value))
+#define __vmx_vmread16_safe(encoding, result) \
+	(__vmx_vmcs_static_width(encoding, 0), \
+	 __vmx_vmread16_safe(encoding, result))
+#define __vmx_vmread64_safe(encoding, result) \
+	(__vmx_vmcs_static_width(encoding, 2), \
+	 __vmx_vmread64_safe(encoding, result))
+#define __vmx_vmread32_safe(encoding, result) \
+	(__vmx_vmcs_static_width(encoding, 4), \
+	 __vmx_vmread32_safe(encoding, result))
+#define __vmx_vmreadNW_safe(encoding, result) \
+	(__vmx_vmcs_static_width(encoding, 6), \
+	 __vmx_vmreadNW_safe(encoding, result))
+#define __vmx_vmread16(encoding) \
+	(__vmx_vmcs_static_width(encoding, 0), __vmx_vmread16(encoding))
+#define __vmx_vmread64(encoding) \
+	(__vmx_vmcs_static_width(encoding, 2), __vmx_vmread64(encoding))
+#define __vmx_vmread32(encoding) \
+	(__vmx_vmcs_static_width(encoding, 4), __vmx_vmread32(encoding))
+#define __vmx_vmreadNW(encoding) \
+	(__vmx_vmcs_static_width(encoding, 6), __vmx_vmreadNW(encoding))
+
+/* Read VMCS field through VMCS cache, e.g. vmcs_cache_get(vcpu, guest_RIP) */
+#define vmcs_cache_get(vcpu, name) \
+	(vmcs_cache_fetch((vcpu), VMCS_INDEX_##name), (vcpu)->vmcs.name)
+
+/* Write VMCS field through VMCS cache, written to CPU by vmcs_cache_flush() */
+#define vmcs_cache_set(vcpu, name, value) \
+	do { \
+		(vcpu)->vmcs.name = (value); \
+		vmcs_cache_mark_dirty((vcpu), VMCS_INDEX_##name); \
+	} while (0)
+
+/* shv-bench.c */
+typedef struct bench_stats {
+	u32 n;
+	u64 min;
+	u64 med;
+	u64 p99;
+	u64 max;
+} bench_stats_t;
+void bench_compute_stats(u64 * samples, u32 n, bench_stats_t * stats);
+void bench_print_stats(VCPU * vcpu, u64 round, const char *test,
+					   const char *type, bench_stats_t * stats);
+void shv_bench_main(VCPU * vcpu);
 
 /* shv-guest-asm.S */
 void shv_guest_entry(void);
@@ -126,6 +475,7 @@ void shv_nmi_guest_main(VCPU * vcpu);
 #define IOAPIC_DEFAULT_BASE   0xfec00000
 #define LAPIC_EOI              0x0B0	/* EOI */
 #define LAPIC_SVR              0x0F0	/* Spurious Interrupt Vector */
+#define LAPIC_ICR_LOW          0x300	/* Interrupt Command [31:0] */
 #define LAPIC_LVT_TIMER        0x320	/* Local Vector Table 0 (TIMER) */
 #define LAPIC_TIMER_INIT       0x380	/* Timer Initial Count */
 #define LAPIC_TIMER_CUR        0x390	/* Timer Current Count */
@@ -85,18 +85,28 @@
 #include <_paging.h>
 #include <_multiboot.h>
 
+/* Bits of g_console_sinks, see emhfc_putchar(). Also used by shv-asm.S. */
+#define CONSOLE_SINK_SERIAL		0x1		/* 16550 UART at 0x3f8 */
+#define CONSOLE_SINK_VGA		0x2		/* VGA text memory */
+#define CONSOLE_SINK_E9			0x4		/* QEMU / Bochs debug port 0xe9 */
+
 #ifndef __ASSEMBLY__
 
 #include <cpu.h>
 
 #define __DEBUG_QEMU__
 
+/* debug.c */
+extern void emhfc_debug_halt(void) __attribute__((noreturn));
+
+#define HALT emhfc_debug_halt
+
 #define ASSERT(expr) \
 	do { \
 		if (!(expr)) { \
 			printf("Error: ASSERT(%s) @ %s:%d failed\n", #expr, __FILE__, \
 				   __LINE__); \
-			cpu_halt(); \
+			HALT(); \
 		} \
 	} while (0)
 
@@ -108,18 +118,71 @@
 #include <smp.h>
 
 /* spinlock.c */
-typedef volatile uint32_t spin_lock_t;
+
+/* Values of SPINLOCK_IMPL, configured using "./configure --with-spinlock=" */
+#define SPINLOCK_TAS	0		/* Test-and-set, unfair */
+#define SPINLOCK_TICKET	1		/* Ticket lock, FIFO */
+#define SPINLOCK_MCS	2		/* MCS queue lock, FIFO, local spinning */
+
+/* MCS queue node, see spinlock.c */
+struct spin_lock_qnode {
+	struct spin_lock_qnode *volatile tail;
+	struct spin_lock_qnode *volatile next;
+};
+
+/* Spinlock, all zero means unlocked */
+typedef struct spin_lock {
+#if SPINLOCK_IMPL == SPINLOCK_TAS
+	volatile u32 locked;
+#elif SPINLOCK_IMPL == SPINLOCK_TICKET
+	volatile u32 next;			/* Next ticket to give out */
+	volatile u32 owner;			/* Ticket of current owner */
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+	struct spin_lock_qnode q;
+#else							/* SPINLOCK_IMPL */
+#error "Unknown SPINLOCK_IMPL"
+#endif							/* SPINLOCK_IMPL */
+#if SPINLOCK_STATS
+	/* Updated by the lock owner only */
+	u64 acquired;				/* Number of acquisitions */
+	u64 contended;				/* Number of acquisitions that spin */
+	u64 spins;					/* Total number of spin iterations */
+	u64 hold_cycles;			/* Total TSC cycles the lock is held */
+	u64 acquire_tsc;			/* TSC when the lock is acquired */
+#endif							/* SPINLOCK_STATS */
+} spin_lock_t;
+
 extern void spin_lock(spin_lock_t * lock);
 extern void spin_unlock(spin_lock_t * lock);
+extern void spin_lock_print_stats(spin_lock_t * lock, const char *name);
 
 /* debug.c */
 extern void *emhfc_putchar_arg;
-extern spin_lock_t *emhfc_putchar_linelock_arg;
+extern volatile u32 *emhfc_putchar_linelock_arg;
 extern void emhfc_putchar(int c, void *arg);
-extern void emhfc_putchar_linelock(spin_lock_t * arg);
-extern void emhfc_putchar_lineunlock(spin_lock_t * arg);
+extern void emhfc_putchar_linelock(volatile u32 * arg);
+extern bool emhfc_putchar_linetrylock(volatile u32 * arg);
+extern void emhfc_putchar_lineunlock(volatile u32 * arg);
+extern void emhfc_putchar_flush(void);
+extern ulong_t emhfc_putchar_direct_begin(u64 * sinks);
+extern void emhfc_putchar_direct_end(ulong_t flags, u64 sinks);
+extern void emhfc_putbin(const void *data, size_t len);
+extern void emhfc_debug_init(void);
+
+/*
+ * Default of g_console_sinks, configured using "./configure
+ * --enable-debug-serial --enable-debug-vga".
+ */
+#define CONSOLE_SINKS_DEFAULT \
+	((DEBUG_SERIAL ? CONSOLE_SINK_SERIAL : 0) | \
+	 (DEBUG_VGA ? CONSOLE_SINK_VGA : 0))
+
+/* debug-log.c */
+extern void debug_log_drain(void);
+extern void *debug_log_begin(void);
+extern void debug_log_putchar(int c, void *arg);
+extern void debug_log_end(void *arg);
 
-#define HALT cpu_halt
 
 typedef u64 spa_t;
 typedef uintptr_t hva_t;
@@ -143,6 +206,13 @@ typedef struct {
 	u32 inst_len;
 } vmexit_info_t;
 
+/* Number of VMCALL numbers that can be registered, see vmcall_register() */
+#define SHV_VMCALL_COUNT 64
+
+struct _vcpu;
+typedef void (*vmexit_handler_t)(struct _vcpu *, struct regs *,
+								 vmexit_info_t *);
+
 #define NUM_FIXED_MTRRS 11
 #define MAX_VARIABLE_MTRR_PAIRS 10
 
@@ -179,10 +249,24 @@ struct _guestmtrrmsrs {
 	struct _guestvarmtrrmsrpair var_mtrrs[MAX_VARIABLE_MTRR_PAIRS];
 };
 
+#define VMCS_CACHE_WORDS ((VMCS_FIELD_COUNT + 31) / 32)
+
+/* State of VCPU::vmcs, see shv-vmcs.c */
+struct vmcs_cache {
+	u32 valid[VMCS_CACHE_WORDS];	/* Field in VCPU::vmcs is up to date */
+	u32 dirty[VMCS_CACHE_WORDS];	/* Field needs to be written to CPU */
+	u64 vmread;					/* Number of VMREADs performed */
+	u64 vmread_saved;			/* Number of VMREADs avoided */
+	u64 vmwrite;				/* Number of VMWRITEs performed */
+	u64 vmwrite_saved;			/* Number of VMWRITEs avoided */
+};
+
 typedef struct _vcpu {
 	uintptr_t sp;
 	u32 id;
 	u32 idx;
+	/* Offset used in shv-vmx-asm.S, see VCPU_VMEXIT_FAST_MASK */
+	u32 vmexit_fast_mask;
 	bool isbsp;
 
 	u64 vmx_msrs[IA32_VMX_MSRCOUNT];
@@ -199,6 +283,7 @@ typedef struct _vcpu {
 	u64 vmx_ept_paddrmask;
 	struct _guestmtrrmsrs vmx_guestmtrrmsrs;
 	struct _vmx_vmcsfields vmcs;
+	struct vmcs_cache vmcs_cache;
 
 	int shv_lapic_x[2];
 	int shv_pit_x[2];
@@ -207,16 +292,32 @@ typedef struct _vcpu {
 
 	void *vmxon_region;
 	void *my_vmcs;
+	void *my_shadow_vmcs;		/* Linked when VMCS shadowing is enabled */
 	void *my_stack;
 	msr_entry_t *my_vmexit_msrstore;
 	msr_entry_t *my_vmexit_msrload;
 	msr_entry_t *my_vmentry_msrload;
 	u32 ept_exit_count;
 	u8 ept_num;
-	void (*volatile vmexit_handler_override)(struct _vcpu *, struct regs *,
-											 vmexit_info_t *);
+	bool ept_vmfunc;			/* Guest switches EPT using VMFUNC */
+	bool ept_ad;				/* EPT accessed and dirty flags enabled */
+	bool ept_pml;				/* Page-modification logging enabled */
+	/* VMEXIT handlers indexed by basic exit reason, see shv-vmx.c */
+	vmexit_handler_t vmexit_handlers[VMX_VMEXIT_COUNT];
+	/* VMCALL handlers indexed by EAX */
+	vmexit_handler_t vmcall_handlers[SHV_VMCALL_COUNT];
+	bool vmexit_fast_path;
+	struct vmexit_stats *vmexit_stats;
 } VCPU;
 
+/*
+ * Per-CPU data. The base of GS (selector __PCPU) points to the entry of the
+ * current CPU in host and guest mode, see init_gdt().
+ */
+typedef struct {
+	VCPU *vcpu;					/* Must be at offset 0, see get_vcpu() */
+} PERCPU;
+
 #define SHV_STACK_SIZE (65536)
 
 /* shv-global.c */
@@ -224,6 +325,7 @@ extern u32 g_midtable_numentries;
 extern PCPU g_cpumap[MAX_PCPU_ENTRIES];
 extern MIDTAB g_midtable[MAX_VCPU_ENTRIES];
 extern VCPU g_vcpus[MAX_VCPU_ENTRIES];
+extern PERCPU g_percpu[MAX_VCPU_ENTRIES];
 extern u8 g_cpu_stack[MAX_VCPU_ENTRIES][SHV_STACK_SIZE];
 extern uintptr_t g_cr3;
 extern uintptr_t g_cr4;
@@ -271,24 +373,266 @@ extern uintptr_t g_idt_stubs_guest[IDT_NELEMS];
 extern uintptr_t g_idt_host[IDT_NELEMS][2];
 extern uintptr_t g_idt_guest[IDT_NELEMS][2];
 extern void init_idt(void);
-extern VCPU *get_vcpu(void);
+extern VCPU *get_vcpu_by_lapic_id(void);
 extern void dump_exception(VCPU * vcpu, struct regs *r, iret_info_t * info);
 extern u32 handle_idt(uintptr_t _ip, iret_info_t * info);
 
+/* Return VCPU of the current CPU, using per-CPU data (one memory load). */
+static inline VCPU *get_vcpu(void)
+{
+	VCPU *vcpu;
+	asm volatile ("mov %%gs:0, %0":"=r" (vcpu));
+	return vcpu;
+}
+
+/* barrier.c */
+#define SMP_BARRIER_FANIN 4
+#define SMP_BARRIER_LEVELS 3	/* Supports SMP_BARRIER_FANIN ** 3 CPUs */
+#define SMP_BARRIER_WIDTH \
+	((MAX_VCPU_ENTRIES + SMP_BARRIER_FANIN - 1) / SMP_BARRIER_FANIN)
+
+/* Node of the combining tree, see barrier.c */
+struct smp_barrier_node {
+	volatile u32 count;
+} __attribute__((aligned(64)));
+
+/* Per-CPU state of barrier */
+struct smp_barrier_cpu {
+	bool sense;					/* Sense of the current / last episode */
+	u64 arrive_tsc;				/* TSC when arrived, if timing */
+} __attribute__((aligned(64)));
+
+typedef struct smp_barrier {
+	u32 cpus;					/* Number of CPUs, 0 means all CPUs */
+	bool timing;				/* Whether record arrival TSC */
+	volatile bool sense;		/* Flipped when all CPUs arrive */
+	u64 release_tsc;			/* TSC when the last CPU arrives, if timing */
+	struct smp_barrier_node node[SMP_BARRIER_LEVELS][SMP_BARRIER_WIDTH];
+	struct smp_barrier_cpu cpu[MAX_VCPU_ENTRIES];
+} smp_barrier_t;
+
+void smp_barrier_init(smp_barrier_t * b, u32 cpus, bool timing);
+void smp_barrier_wait(smp_barrier_t * b, VCPU * vcpu);
+void smp_barrier_print(smp_barrier_t * b, const char *name);
+
+/* trace.c */
+#define TRACE_ARGS		3		/* Number of arguments per record */
+#define TRACE_RECORDS	1024	/* Records per CPU, must be a power of 2 */
+
+/* Bits of g_trace, configured using "trace=" on the multiboot command line */
+#define TRACE_ENABLE	0x1ULL	/* Record trace events */
+#define TRACE_STREAM	0x2ULL	/* Print records when buffer is half full */
+
+extern u64 g_trace;				/* Defined in cmdline.c */
+
+enum trace_event {
+#define DECLARE_TRACE_EVENT(id, name, format) name = id,
+#include <_trace_events.h>
+};
+
+/* Trace record, also the binary format printed to the console */
+typedef struct {
+	u64 tsc;
+	u32 seq;					/* Per-CPU sequence number, gaps are drops */
+	u16 event;					/* enum trace_event */
+	u8 cpu;						/* VCPU::idx */
+	u8 reserved;
+	u64 args[TRACE_ARGS];
+} trace_record_t;
+
+/* Per-CPU trace buffer, written by the CPU and read by trace_flush() */
+typedef struct {
+	trace_record_t rec[TRACE_RECORDS];
+	volatile u32 head;			/* Next record to print, by trace_flush() */
+	volatile u32 tail;			/* Next record to write, by the CPU */
+	u32 seq;					/* Next sequence number */
+	u32 dropped;				/* Number of records dropped */
+	volatile bool busy;			/* trace_event() in progress */
+} __attribute__((aligned(64))) trace_buf_t;
+
+extern trace_buf_t g_trace_bufs[MAX_VCPU_ENTRIES];
+extern void trace_flush(void);
+extern void trace_flush_halt(void);
+
+/*
+ * Record a trace event on the current CPU. Must be called after init_gdt().
+ * If the buffer is full, or trace_event() is interrupted by an NMI or
+ * exception handler that also calls trace_event(), the record is dropped.
+ */
+static inline void trace_event(enum trace_event event, u64 arg0, u64 arg1,
+							   u64 arg2)
+{
+	VCPU *vcpu;
+	trace_buf_t *buf;
+	trace_record_t *rec;
+	u32 tail;
+
+	if (!(g_trace & TRACE_ENABLE)) {
+		return;
+	}
+	vcpu = get_vcpu();
+	buf = &g_trace_bufs[vcpu->idx];
+	tail = buf->tail;
+	if (buf->busy || tail - buf->head >= TRACE_RECORDS) {
+		buf->seq++;
+		buf->dropped++;
+		return;
+	}
+	buf->busy = true;
+	rec = &buf->rec[tail % TRACE_RECORDS];
+	rec->tsc = rdtsc();
+	rec->seq = buf->seq++;
+	rec->event = event;
+	rec->cpu = vcpu->idx;
+	rec->args[0] = arg0;
+	rec->args[1] = arg1;
+	rec->args[2] = arg2;
+	asm volatile ("":::"memory");
+	buf->tail = tail + 1;
+	buf->busy = false;
+	if ((g_trace & TRACE_STREAM) && tail - buf->head >= TRACE_RECORDS / 2) {
+		trace_flush();
+	}
+}
+
+/* flight.c */
+#define FLIGHT_RECORDS	64		/* Records per CPU, must be a power of 2 */
+
+enum flight_kind {
+	FLIGHT_VMEXIT = 1,			/* reason = VMEXIT reason */
+	FLIGHT_INTERRUPT = 2,		/* reason = vector, 0x100 set if from guest */
+};
+
+/* Flight recorder entry, see flight.c */
+typedef struct {
+	u64 tsc;					/* TSC when the event happens */
+	u64 rip;					/* Guest RIP, or interrupted IP */
+	u64 qual;					/* Exit qualification, or error code */
+	u64 cycles;					/* Cycles in handler, 0 if not finished */
+	u32 reason;
+	u32 kind;					/* enum flight_kind */
+} flight_record_t;
+
+/* Per-CPU flight recorder, a ring that overwrites the oldest records */
+typedef struct {
+	flight_record_t rec[FLIGHT_RECORDS];
+	u32 tail;					/* Total number of records */
+	volatile bool dumping;		/* flight_dump() in progress */
+} __attribute__((aligned(64))) flight_buf_t;
+
+extern flight_buf_t g_flight_bufs[MAX_VCPU_ENTRIES];
+extern void flight_dump(void);
+
+/*
+ * Record an event in the current CPU's flight recorder. Must be called after
+ * init_gdt(). The slot is reserved with a single XADD, so an NMI or exception
+ * handler that interrupts flight_record() takes the next slot.
+ */
+static inline flight_record_t *flight_record(VCPU * vcpu, enum flight_kind kind,
+											 u32 reason, u64 rip, u64 qual,
+											 u64 tsc)
+{
+	flight_buf_t *buf = &g_flight_bufs[vcpu->idx];
+	flight_record_t *rec;
+	u32 tail = 1;
+
+	asm volatile ("xaddl %0, %1":"+r" (tail), "+m"(buf->tail)::"memory");
+	rec = &buf->rec[tail % FLIGHT_RECORDS];
+	rec->tsc = tsc;
+	rec->rip = rip;
+	rec->qual = qual;
+	rec->cycles = 0;
+	rec->reason = reason;
+	rec->kind = kind;
+	return rec;
+}
+
+/*
+ * Record the cycles spent in the handler of rec. Nothing is recorded if rec
+ * is NULL or has been overwritten by later events.
+ */
+static inline void flight_record_end(flight_record_t * rec, u64 tsc, u64 now)
+{
+	if (rec && rec->tsc == tsc) {
+		rec->cycles = now - tsc;
+	}
+}
+
+/* xsave.c */
+#define XSAVE_POLICY_NONE	0	/* Extended state not enabled or switched */
+#define XSAVE_POLICY_EAGER	1	/* Save guest state at every VMEXIT */
+#define XSAVE_POLICY_LAZY	2	/* Save guest state at first use in VMEXIT */
+#define XSAVE_POLICIES		3
+
+/* Size of per-VCPU XSAVE area, enough for x87, SSE and AVX states */
+#define XSAVE_AREA_SIZE		4096
+
+extern u64 g_xsave_policy;		/* Defined in cmdline.c */
+extern const char *g_xsave_policy_names[XSAVE_POLICIES];
+extern u64 xsave_xcr0;
+
+extern void xsave_init(VCPU * vcpu);
+extern u32 xsave_get_policy(VCPU * vcpu);
+extern void xsave_set_policy(VCPU * vcpu, u32 policy);
+extern void xsave_vmexit(VCPU * vcpu);
+extern void xsave_vmentry(void);
+extern bool xsave_fpu_begin(void);
+extern void xsave_fpu_end(void);
+extern void *simd_memset(void *str, int c, size_t len);
+extern int simd_memcmp(const void *s1, const void *s2, size_t n);
+
+typedef struct {
+	u64 bytes;					/* Bytes written to THR */
+	u64 in;						/* Number of inb from the UART */
+	u64 out;					/* Number of outb to the UART */
+} dbg_x86_uart_stats_t;
+
+extern void dbg_x86_uart_flush(bool sync);
+extern ulong_t dbg_x86_uart_direct_begin(void);
+extern void dbg_x86_uart_direct_end(ulong_t flags);
+extern u32 dbg_x86_uart_pending(void);
+extern void dbg_x86_uart_enable_irq(void);
+extern void dbg_x86_uart_disable_irq(void);
+extern bool dbg_x86_uart_irq_enabled(void);
+extern void dbg_x86_uart_set_burst(u32 burst);
+extern void dbg_x86_uart_get_stats(dbg_x86_uart_stats_t * stats);
+extern void handle_serial_interrupt(VCPU * vcpu, u8 vector, bool guest);
+
 /* gdt.c */
 #define GDT_NELEMS 10
 extern u64 g_gdt[MAX_VCPU_ENTRIES][GDT_NELEMS];
 extern u8 g_tss[MAX_VCPU_ENTRIES][PAGE_SIZE_4K] ALIGNED_PAGE;
 extern void init_gdt(VCPU * vcpu);
 
+/* libc_string.c */
+#define LIBC_STRING_BYTE	0	/* Loops of bytes */
+#define LIBC_STRING_WORD	1	/* Loops of machine words */
+#define LIBC_STRING_REP		2	/* REP MOVS / STOS of words, then of bytes */
+#define LIBC_STRING_ERMS	3	/* REP MOVSB / STOSB */
+#define LIBC_STRING_MODES	4
+
+/* Smallest size where LIBC_STRING_REP and LIBC_STRING_ERMS use REP */
+#define LIBC_STRING_REP_MIN	128
+
+extern u32 g_libc_string_mode;
+extern const char *g_libc_string_mode_names[LIBC_STRING_MODES];
+void libc_string_init(void);
+void *memcpy_mode(void *to, const void *from, size_t n, u32 mode);
+void *memset_mode(void *str, int c, size_t len, u32 mode);
+int memcmp_mode(const void *s1, const void *s2, size_t n, u32 mode);
+
 /* strtoul.c */
 unsigned long tb_strtoull(const char *nptr, const char **endptr, int base);
 
 /* cmdline.c */
+extern u64 g_console_sinks;
 extern u64 g_shv_opt;
 extern u64 g_nmi_opt;
 extern u64 g_nmi_exp;
 extern u64 g_timer_ms;
+extern u64 g_ept_prefetch;
+extern u64 g_ept_count;
+extern u64 g_pml_pages;
 void parse_cmdline(const char *cmdline);
 
 #endif							/* !__ASSEMBLY__ */
@@ -299,6 +643,7 @@ void parse_cmdline(const char *cmdline);
 #define __TRSEL	0x20			/* TSS selector (also occupies 0x28 in amd64) */
 #define __CS_R3	0x33			/* CS for user mode */
 #define __DS_R3 0x3b			/* DS for user mode */
+#define __PCPU	0x40			/* GS for per-CPU data, see PERCPU */
 
 #ifdef __amd64__
 #define __CS	__CS64
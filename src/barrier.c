@@ -0,0 +1,116 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * Reusable SMP barrier (sense-reversing combining tree). CPUs arrive at leaf
+ * nodes in groups of SMP_BARRIER_FANIN. The last CPU to arrive at a node
+ * continues to the parent node, and the last CPU to arrive at the root
+ * releases all CPUs by flipping the global sense. Each node counter is only
+ * written by up to SMP_BARRIER_FANIN CPUs. The barrier can be used in host
+ * and guest mode, and can be reused immediately after it is released.
+ *
+ * An all-zero smp_barrier_t is a valid barrier for all g_midtable_numentries
+ * CPUs, so static barriers do not need initialization.
+ */
+
+/* Number of CPUs waiting at barrier b */
+static u32 smp_barrier_cpus(smp_barrier_t * b)
+{
+	u32 n = b->cpus ? b->cpus : g_midtable_numentries;
+	ASSERT(n > 0 && n <= MAX_VCPU_ENTRIES);
+	return n;
+}
+
+/* Initialize barrier for the first cpus CPUs (0 means all CPUs). */
+void smp_barrier_init(smp_barrier_t * b, u32 cpus, bool timing)
+{
+	memset(b, 0, sizeof(*b));
+	b->cpus = cpus;
+	b->timing = timing;
+}
+
+/* Wait until all CPUs arrive at barrier b. */
+void smp_barrier_wait(smp_barrier_t * b, VCPU * vcpu)
+{
+	struct smp_barrier_cpu *cpu = &b->cpu[vcpu->idx];
+	u32 nchild = smp_barrier_cpus(b);
+	u32 index = vcpu->idx;
+	bool sense = !cpu->sense;
+
+	ASSERT(vcpu->idx < nchild);
+	cpu->sense = sense;
+	if (b->timing) {
+		cpu->arrive_tsc = rdtsc();
+	}
+	for (u32 level = 0; ; level++) {
+		struct smp_barrier_node *node;
+		u32 nnodes = (nchild + SMP_BARRIER_FANIN - 1) / SMP_BARRIER_FANIN;
+		u32 expected;
+		ASSERT(level < SMP_BARRIER_LEVELS);
+		index /= SMP_BARRIER_FANIN;
+		node = &b->node[level][index];
+		expected = nchild - index * SMP_BARRIER_FANIN;
+		if (expected > SMP_BARRIER_FANIN) {
+			expected = SMP_BARRIER_FANIN;
+		}
+		if (__sync_add_and_fetch(&node->count, 1) < expected) {
+			/* Not the last one at this node, wait for release */
+			while (b->sense != sense) {
+				cpu_relax();
+			}
+			break;
+		}
+		/* Last one at this node, no one arrives here until release */
+		node->count = 0;
+		if (nnodes == 1) {
+			/* Last one at root, release all CPUs */
+			if (b->timing) {
+				b->release_tsc = rdtsc();
+			}
+			asm volatile ("":::"memory");
+			b->sense = sense;
+			break;
+		}
+		nchild = nnodes;
+	}
+	asm volatile ("":::"memory");
+}
+
+/*
+ * Print arrival skew of the last barrier episode, requires timing. For each
+ * CPU, print the number of TSC cycles between its arrival and the arrival of
+ * the last CPU. Assume that TSC is synchronized across CPUs. Should be called
+ * by one CPU after the barrier and before the next episode.
+ */
+void smp_barrier_print(smp_barrier_t * b, const char *name)
+{
+	u32 n = smp_barrier_cpus(b);
+	u64 max = 0;
+	ASSERT(b->timing);
+	for (u32 i = 0; i < n; i++) {
+		u64 skew = b->release_tsc - b->cpu[i].arrive_tsc;
+		printf("BARRIER: name=%s cpu=0x%02x skew=%lld\n", name, g_vcpus[i].id,
+			   skew);
+		if (skew > max) {
+			max = skew;
+		}
+	}
+	printf("BARRIER: name=%s cpus=%u max_skew=%lld\n", name, n, max);
+}
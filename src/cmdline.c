@@ -17,22 +17,35 @@
  */
 
 #include <xmhf.h>
+#include <shv.h>
 
 #define _isspace(c)		((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
 
+u64 g_console_sinks = CONSOLE_SINKS_DEFAULT;
 u64 g_shv_opt = SHV_OPT;
 u64 g_nmi_opt = NMI_OPT;
 u64 g_nmi_exp = NMI_EXP;
 u64 g_timer_ms = 50;
+u64 g_ept_prefetch = 1;
+u64 g_ept_count = SHV_EPT_COUNT;
+u64 g_pml_pages = 64;
+u64 g_trace = 0;
+u64 g_xsave_policy = XSAVE_POLICY_NONE;
 
 static const struct {
 	u64 *ptr;
 	const char *prefix;
 } cmdline_vars[] = {
+	{.ptr = &g_console_sinks,.prefix = "console="},
 	{.ptr = &g_shv_opt,.prefix = "shv_opt="},
 	{.ptr = &g_nmi_opt,.prefix = "nmi_opt="},
 	{.ptr = &g_nmi_exp,.prefix = "nmi_exp="},
 	{.ptr = &g_timer_ms,.prefix = "timer_ms="},
+	{.ptr = &g_ept_prefetch,.prefix = "ept_prefetch="},
+	{.ptr = &g_ept_count,.prefix = "ept_count="},
+	{.ptr = &g_pml_pages,.prefix = "pml_pages="},
+	{.ptr = &g_trace,.prefix = "trace="},
+	{.ptr = &g_xsave_policy,.prefix = "xsave="},
 	{.ptr = NULL,.prefix = NULL},
 };
 
@@ -0,0 +1,32 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * Debug port console of QEMU ("-debugcon") and Bochs ("port_e9_hack"). Each
+ * character is a single OUTB without polling any status register. On other
+ * platforms the port is usually unused and characters are discarded.
+ */
+
+#define E9_PORT 0xe9
+
+void dbg_x86_e9_putc(char ch)
+{
+	outb(E9_PORT, (u8) ch);
+}
@@ -0,0 +1,243 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * Per-CPU log rings for printf(). A CPU formats printf() into slots of its own
+ * ring without taking any lock, with interrupts disabled. Each record is
+ * tagged with the TSC when printf() starts. After committing a record, the
+ * CPU tries to become the drainer by taking emhfc_putchar_linelock_arg. The
+ * drainer prints records of all rings to the console in TSC order until all
+ * rings are empty. Other CPUs only wait for the console when their rings are
+ * full, so a CPU printing to a slow serial port no longer stalls other CPUs.
+ *
+ * Each ring has one producer (its CPU) and one consumer (the drainer), so on
+ * x86 updating head and tail only needs compiler barriers. Before per-CPU
+ * data is set up in init_gdt(), printf() prints directly to the console.
+ */
+
+#if DEBUG_LOG_RING
+
+#define DEBUG_LOG_SLOTS			32	/* Must be a power of 2 */
+#define DEBUG_LOG_SLOT_CHARS	116
+
+struct debug_log_slot {
+	u64 tsc;					/* TSC when printf() starts */
+	u32 len;					/* Number of characters in buf */
+	char buf[DEBUG_LOG_SLOT_CHARS];
+};
+
+struct debug_log_ring {
+	struct debug_log_slot slot[DEBUG_LOG_SLOTS];
+	volatile u32 head;			/* Next slot to print, written by drainer */
+	volatile u32 tail;			/* Next slot to fill, written by producer */
+	bool busy;					/* Producer is formatting slot at tail */
+	bool drop;					/* Record being formatted is dropped */
+	volatile bool draining;		/* This CPU may hold the lock in drain */
+	ulong_t flags;				/* EFLAGS before debug_log_begin() */
+} __attribute__((aligned(64)));
+
+static struct debug_log_ring debug_log_rings[MAX_VCPU_ENTRIES];
+
+static inline struct debug_log_slot *debug_log_slot(struct debug_log_ring *ring,
+													u32 index)
+{
+	return &ring->slot[index % DEBUG_LOG_SLOTS];
+}
+
+/* Return the ring with the oldest committed record, or NULL if all empty. */
+static struct debug_log_ring *debug_log_oldest(void)
+{
+	struct debug_log_ring *ans = NULL;
+	u64 ans_tsc = 0;
+	for (u32 i = 0; i < MAX_VCPU_ENTRIES; i++) {
+		struct debug_log_ring *ring = &debug_log_rings[i];
+		u32 head = ring->head;
+		if (head != ring->tail) {
+			u64 tsc = debug_log_slot(ring, head)->tsc;
+			if (ans == NULL || tsc < ans_tsc) {
+				ans = ring;
+				ans_tsc = tsc;
+			}
+		}
+	}
+	return ans;
+}
+
+/*
+ * Print all committed records in TSC order. Return immediately if another
+ * CPU is draining, because that CPU checks the rings again after releasing
+ * the lock.
+ */
+void debug_log_drain(void)
+{
+	struct debug_log_ring *self = NULL;
+	if (read_gs() == __PCPU) {
+		self = &debug_log_rings[get_vcpu()->idx];
+		if (self->draining) {
+			/* NMI handler interrupted this CPU's drain, which continues */
+			return;
+		}
+	}
+	while (debug_log_oldest() != NULL) {
+		struct debug_log_ring *ring;
+		/*
+		 * self->draining covers the whole time this CPU may hold the lock,
+		 * so that an NMI handler never waits for this CPU.
+		 */
+		if (self) {
+			self->draining = true;
+		}
+		if (!emhfc_putchar_linetrylock(emhfc_putchar_linelock_arg)) {
+			if (self) {
+				self->draining = false;
+			}
+			return;
+		}
+		while ((ring = debug_log_oldest()) != NULL) {
+			struct debug_log_slot *slot = debug_log_slot(ring, ring->head);
+			for (u32 i = 0; i < slot->len; i++) {
+				emhfc_putchar(slot->buf[i], NULL);
+			}
+			asm volatile ("":::"memory");
+			ring->head++;
+		}
+		emhfc_putchar_flush();
+		emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+		if (self) {
+			self->draining = false;
+		}
+	}
+}
+
+/*
+ * Wait for a free slot at tail and start a record at it. Return false if the
+ * ring is full and this CPU is the drainer (printf() in an NMI handler that
+ * interrupted debug_log_drain()), because the ring cannot be drained until
+ * the handler returns. The console lock is held, so printing directly is not
+ * possible either.
+ */
+static bool debug_log_reserve(struct debug_log_ring *ring, u64 tsc)
+{
+	struct debug_log_slot *slot;
+	while (ring->tail - ring->head >= DEBUG_LOG_SLOTS) {
+		if (ring->draining) {
+			return false;
+		}
+		debug_log_drain();
+		cpu_relax();
+	}
+	slot = debug_log_slot(ring, ring->tail);
+	slot->tsc = tsc;
+	slot->len = 0;
+	return true;
+}
+
+/* Make the slot at tail visible to the drainer. */
+static void debug_log_commit(struct debug_log_ring *ring)
+{
+	asm volatile ("":::"memory");
+	ring->tail++;
+}
+
+/*
+ * Start a printf() record in the current CPU's ring. Return the argument for
+ * debug_log_putchar(), or NULL if the caller should print to the console
+ * directly (per-CPU data not set up, or nested printf() in an NMI or
+ * exception handler).
+ */
+void *debug_log_begin(void)
+{
+	struct debug_log_ring *ring;
+	ulong_t flags;
+
+	if (read_gs() != __PCPU) {
+		return NULL;
+	}
+	ring = &debug_log_rings[get_vcpu()->idx];
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	if (ring->busy) {
+		if (flags & EFLAGS_IF) {
+			asm volatile ("sti");
+		}
+		return NULL;
+	}
+	ring->busy = true;
+	ring->flags = flags;
+	ring->drop = !debug_log_reserve(ring, rdtsc());
+	return ring;
+}
+
+/* Append a character to the record, called by kvprintf(). */
+void debug_log_putchar(int c, void *arg)
+{
+	struct debug_log_ring *ring = arg;
+	struct debug_log_slot *slot = debug_log_slot(ring, ring->tail);
+	if (ring->drop) {
+		return;
+	}
+	if (slot->len == DEBUG_LOG_SLOT_CHARS) {
+		/* Continue in the next slot with the same TSC to keep the order */
+		u64 tsc = slot->tsc;
+		debug_log_commit(ring);
+		if (!debug_log_reserve(ring, tsc)) {
+			ring->drop = true;
+			return;
+		}
+		slot = debug_log_slot(ring, ring->tail);
+	}
+	slot->buf[slot->len++] = (char)c;
+}
+
+/* Commit the record started by debug_log_begin() and try to print it. */
+void debug_log_end(void *arg)
+{
+	struct debug_log_ring *ring = arg;
+	if (!ring->drop) {
+		debug_log_commit(ring);
+	}
+	ring->busy = false;
+	if (ring->flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+	debug_log_drain();
+}
+
+#else							/* !DEBUG_LOG_RING */
+
+void debug_log_drain(void)
+{
+}
+
+void *debug_log_begin(void)
+{
+	return NULL;
+}
+
+void debug_log_putchar(int c, void *arg)
+{
+	ASSERT(0);
+}
+
+void debug_log_end(void *arg)
+{
+	ASSERT(0);
+}
+
+#endif							/* DEBUG_LOG_RING */
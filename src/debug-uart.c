@@ -68,27 +68,139 @@
  */
 
 #include <xmhf.h>
+#include <shv.h>
+#include <shv-pic.h>
+
+/*
+ * Characters are queued in a software TX queue and moved to the 16550 TX FIFO
+ * in bursts of up to uart_fifo_size bytes, so the line status register is
+ * polled once per burst instead of once per character. When serial interrupts
+ * are enabled (SHV_USE_SERIAL_IRQ), the THR empty interrupt (IRQ 4, handled
+ * by the BSP) refills the FIFO and CPUs printing do not access the UART
+ * except to start transmission. Each port access is an I/O VMEXIT when the L1
+ * hypervisor intercepts the serial port, see dbg_x86_uart_get_stats().
+ */
 
 #define UART_PORT 0x3f8
+#define UART_IRQ 4
+
+/* Register offsets */
+#define UART_THR 0				/* Transmit holding register (write) */
+#define UART_IER 1				/* Interrupt enable register */
+#define UART_IIR 2				/* Interrupt identification register (read) */
+#define UART_FCR 2				/* FIFO control register (write) */
+#define UART_LCR 3				/* Line control register */
+#define UART_MCR 4				/* Modem control register */
+#define UART_LSR 5				/* Line status register */
+
+#define UART_IER_THRI		0x02	/* Enable THR empty interrupt */
+#define UART_IIR_NO_INT		0x01	/* No interrupt pending */
+#define UART_IIR_ID			0x0e	/* Interrupt ID mask */
+#define UART_IIR_THRI		0x02	/* THR empty interrupt */
+#define UART_IIR_FIFO		0xc0	/* FIFO enabled (16550A) */
+#define UART_FCR_ENABLE		0x01	/* Enable FIFOs */
+#define UART_FCR_CLEAR		0x06	/* Clear RX and TX FIFOs */
+#define UART_FCR_TRIGGER_14	0xc0	/* RX interrupt at 14 bytes */
+#define UART_MCR_DTR_RTS	0x03	/* Data terminal ready, request to send */
+#define UART_MCR_OUT2		0x08	/* Connects the IRQ line to the PIC on PCs */
+#define UART_LSR_THRE		0x20	/* THR (and TX FIFO) empty */
+
+/* Size of 16550A TX FIFO */
+#define UART_FIFO_SIZE 16
+
+/* Size of the software TX queue, must be a power of 2 */
+#define UART_TXQ_SIZE 4096
+
+static char uart_txq[UART_TXQ_SIZE];
+static volatile u32 uart_txq_head;	/* Next byte to send, protected by lock */
+static volatile u32 uart_txq_tail;	/* Next byte to queue, by console lock */
+
+/* Protects writing to the UART, uart_txq_head and uart_tx_busy */
+static volatile u32 uart_tx_lock;
+
+/* Number of bytes written per burst, 1 if the UART has no FIFO */
+static u32 uart_fifo_size = 1;
 
-//low-level UART character output
-static void dbg_x86_uart_putc_bare(char ch)
+/* Value of uart_fifo_size detected at init */
+static u32 uart_fifo_detected = 1;
+
+/* Whether THR empty interrupt is enabled */
+static volatile bool uart_irq;
+
+/* Whether a burst is sent and the THR empty interrupt will send the next */
+static bool uart_tx_busy;
+
+static dbg_x86_uart_stats_t uart_stats;
+
+static inline u8 uart_inb(u16 reg)
 {
-	//wait for xmit hold register to be empty
-	while (!(inb(UART_PORT + 0x5) & 0x20)) {
-		cpu_relax();
+	uart_stats.in++;
+	return inb(UART_PORT + reg);
+}
+
+static inline void uart_outb(u16 reg, u8 val)
+{
+	uart_stats.out++;
+	outb(UART_PORT + reg, val);
+}
+
+/* Disable interrupts and take uart_tx_lock, return old EFLAGS. */
+static ulong_t uart_lock(void)
+{
+	ulong_t flags;
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	emhfc_putchar_linelock(&uart_tx_lock);
+	return flags;
+}
+
+static void uart_unlock(ulong_t flags)
+{
+	emhfc_putchar_lineunlock(&uart_tx_lock);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
 	}
+}
 
-	//write the character
-	outb(UART_PORT, (u8) ch);
+/* Move up to one FIFO worth of bytes to the UART, THR must be empty. */
+static void uart_tx_burst(void)
+{
+	u32 head = uart_txq_head;
+	u32 n = uart_txq_tail - head;
+	if (n > uart_fifo_size) {
+		n = uart_fifo_size;
+	}
+	for (u32 i = 0; i < n; i++) {
+		uart_outb(UART_THR, (u8) uart_txq[(head + i) % UART_TXQ_SIZE]);
+	}
+	uart_stats.bytes += n;
+	asm volatile ("":::"memory");
+	uart_txq_head = head + n;
+}
 
-	return;
+/* Wait for THR empty and send a burst, lock must be held. */
+static void uart_tx_sync(void)
+{
+	while (!(uart_inb(UART_LSR) & UART_LSR_THRE)) {
+		cpu_relax();
+	}
+	uart_tx_burst();
 }
 
 // write character to serial port
 void dbg_x86_uart_putc(char ch)
 {
-	dbg_x86_uart_putc_bare(ch);
+	u32 tail = uart_txq_tail;
+	while (tail - uart_txq_head >= UART_TXQ_SIZE) {
+		/* Queue full, send a burst by polling */
+		ulong_t flags = uart_lock();
+		if (uart_txq_tail - uart_txq_head >= UART_TXQ_SIZE) {
+			uart_tx_sync();
+		}
+		uart_unlock(flags);
+	}
+	uart_txq[tail % UART_TXQ_SIZE] = ch;
+	asm volatile ("":::"memory");
+	uart_txq_tail = tail + 1;
 }
 
 // write string to serial port
@@ -98,22 +210,152 @@ void dbg_x86_uart_putstr(const char *s)
 		dbg_x86_uart_putc(*s++);
 }
 
+/*
+ * Send queued characters. If sync or serial interrupts are disabled, wait
+ * until all characters are written to the UART. Otherwise only start
+ * transmission if the THR empty interrupt is not already pending.
+ */
+void dbg_x86_uart_flush(bool sync)
+{
+	ulong_t flags = uart_lock();
+	if (sync || !uart_irq) {
+		while (uart_txq_head != uart_txq_tail) {
+			uart_tx_sync();
+		}
+	} else if (!uart_tx_busy && uart_txq_head != uart_txq_tail) {
+		uart_tx_sync();
+		uart_tx_busy = true;
+	}
+	uart_unlock(flags);
+}
+
+/* Handle THR empty interrupt (IRQ 4). */
+void handle_serial_interrupt(VCPU * vcpu, u8 vector, bool guest)
+{
+	ulong_t flags;
+	(void)vcpu;
+	(void)guest;
+	ASSERT(vector == X86_PIC_MASTER_IRQ_BASE + UART_IRQ);
+	flags = uart_lock();
+	while (1) {
+		/* Reading IIR clears THR empty interrupt */
+		u8 iir = uart_inb(UART_IIR);
+		if ((iir & (UART_IIR_NO_INT | UART_IIR_ID)) != UART_IIR_THRI) {
+			break;
+		}
+		if (uart_txq_head == uart_txq_tail) {
+			uart_tx_busy = false;
+			break;
+		}
+		uart_tx_burst();
+	}
+	uart_unlock(flags);
+	outb(INT_CTL_PORT, INT_ACK_CURRENT);
+}
+
+/*
+ * Enable THR empty interrupt, called by the BSP after the IDT and the PIC are
+ * set up. IRQ 4 is delivered to the BSP through the PIC.
+ */
+void dbg_x86_uart_enable_irq(void)
+{
+	ulong_t flags = uart_lock();
+	uart_outb(UART_MCR, UART_MCR_DTR_RTS | UART_MCR_OUT2);
+	uart_outb(UART_IER, UART_IER_THRI);
+	outb(MASTER_OCW, inb(MASTER_OCW) & ~(1 << UART_IRQ));
+	uart_irq = true;
+	uart_unlock(flags);
+}
+
+/* Disable THR empty interrupt, characters are sent by polling. */
+void dbg_x86_uart_disable_irq(void)
+{
+	ulong_t flags = uart_lock();
+	uart_outb(UART_IER, 0x00);
+	uart_irq = false;
+	uart_tx_busy = false;
+	uart_unlock(flags);
+	dbg_x86_uart_flush(true);
+}
+
+/*
+ * Set number of bytes per burst, 0 means the FIFO size detected at init.
+ * Setting 1 polls the line status register before every character.
+ */
+void dbg_x86_uart_set_burst(u32 burst)
+{
+	ulong_t flags;
+	ASSERT(burst <= uart_fifo_detected);
+	flags = uart_lock();
+	uart_fifo_size = burst ? burst : uart_fifo_detected;
+	uart_unlock(flags);
+}
+
+/*
+ * Send all queued characters and keep uart_tx_lock, so that the caller can
+ * write to the UART directly (e.g. with paging disabled). Return old EFLAGS
+ * for dbg_x86_uart_direct_end().
+ */
+ulong_t dbg_x86_uart_direct_begin(void)
+{
+	ulong_t flags = uart_lock();
+	while (uart_txq_head != uart_txq_tail) {
+		uart_tx_sync();
+	}
+	return flags;
+}
+
+void dbg_x86_uart_direct_end(ulong_t flags)
+{
+	uart_unlock(flags);
+}
+
+/* Return number of characters queued but not written to the UART. */
+u32 dbg_x86_uart_pending(void)
+{
+	return uart_txq_tail - uart_txq_head;
+}
+
+/* Return whether serial interrupts are enabled. */
+bool dbg_x86_uart_irq_enabled(void)
+{
+	return uart_irq;
+}
+
+/* Return statistics of UART accesses (cumulative since init). */
+void dbg_x86_uart_get_stats(dbg_x86_uart_stats_t * stats)
+{
+	ulong_t flags = uart_lock();
+	*stats = uart_stats;
+	uart_unlock(flags);
+}
+
 //initialize UART comms.
 void dbg_x86_uart_init(void)
 {
 	// disable UART interrupts
-	outb(UART_PORT + 0x1, (u8) 0x00);
+	uart_outb(UART_IER, (u8) 0x00);
 
 	// enable divisor latch access by writing to line control register (LCR)
-	outb(UART_PORT + 0x3, (u8) 0x80);
+	uart_outb(UART_LCR, (u8) 0x80);
 
 	// write hardcoded 1 to divisor latch data
-	outb(UART_PORT + 0x0, (u8) 0x01);
-	outb(UART_PORT + 0x1, (u8) 0x00);
+	uart_outb(0x0, (u8) 0x01);
+	uart_outb(0x1, (u8) 0x00);
 
 	// set data bits, stop bits and parity info. by writing to LCR
-	outb(UART_PORT + 0x3, (u8) 0x03);
+	uart_outb(UART_LCR, (u8) 0x03);
 
 	// signal ready by setting DTR and RTS high in modem control register
-	outb(UART_PORT + 0x4, (u8) 0x03);
+	uart_outb(UART_MCR, UART_MCR_DTR_RTS);
+
+	// enable and clear FIFOs, use them if the UART is a 16550A
+	uart_outb(UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR | UART_FCR_TRIGGER_14);
+	if ((uart_inb(UART_IIR) & UART_IIR_FIFO) == UART_IIR_FIFO) {
+		uart_fifo_detected = UART_FIFO_SIZE;
+	} else {
+		uart_outb(UART_FCR, (u8) 0x00);
+		uart_fifo_detected = 1;
+	}
+	uart_fifo_size = uart_fifo_detected;
 }
@@ -66,45 +66,171 @@
 
 // From xmhfc-putchar.c
 
-static spin_lock_t emhfc_putchar_linelock_spinlock;
-spin_lock_t *emhfc_putchar_linelock_arg = &emhfc_putchar_linelock_spinlock;
+/*
+ * Lock of the console (serial port and VGA). This is a plain test-and-set
+ * lock instead of spin_lock_t, because debug_log_drain() and trace_flush()
+ * need emhfc_putchar_linetrylock().
+ */
+static volatile u32 emhfc_putchar_linelock_word;
+volatile u32 *emhfc_putchar_linelock_arg = &emhfc_putchar_linelock_word;
 
 extern void dbg_x86_uart_init(void);
 extern void dbg_x86_uart_putc(char c);
 extern void dbg_x86_vgamem_init(void);
 extern void dbg_x86_vgamem_putc(char c);
+extern void dbg_x86_e9_putc(char c);
+
+/*
+ * Console sinks. emhfc_putchar() writes to every sink whose bit is set in
+ * g_console_sinks, configured using "console=" on the multiboot command line.
+ * When g_console_sinks is 0, all output is discarded. Binary data (e.g. trace
+ * frames) is only written to sinks that are byte streams.
+ */
+static const struct {
+	u64 bit;
+	bool binary;
+	void (*init)(void);
+	void (*putc)(char c);
+	void (*flush)(bool sync);
+} emhfc_sinks[] = {
+	{CONSOLE_SINK_SERIAL, true, dbg_x86_uart_init, dbg_x86_uart_putc,
+	 dbg_x86_uart_flush},
+	{CONSOLE_SINK_VGA, false, dbg_x86_vgamem_init, dbg_x86_vgamem_putc, NULL},
+	{CONSOLE_SINK_E9, true, NULL, dbg_x86_e9_putc, NULL},
+};
 
+#define EMHFC_NSINKS (sizeof(emhfc_sinks) / sizeof(emhfc_sinks[0]))
+
+/* Sinks that are initialized */
+static u64 emhfc_sinks_initialized;
+
+/*
+ * Initialize sinks in g_console_sinks. Called at boot and again after parsing
+ * the command line, each sink is only initialized once.
+ */
 void emhfc_debug_init(void)
 {
-#if DEBUG_SERIAL
-	dbg_x86_uart_init();
-#endif							/* DEBUG_SERIAL */
-
-#if DEBUG_VGA
-	dbg_x86_vgamem_init();
-#endif							/* DEBUG_VGA */
+	for (u32 i = 0; i < EMHFC_NSINKS; i++) {
+		u64 bit = emhfc_sinks[i].bit;
+		if ((g_console_sinks & bit) && !(emhfc_sinks_initialized & bit)) {
+			if (emhfc_sinks[i].init) {
+				emhfc_sinks[i].init();
+			}
+			emhfc_sinks_initialized |= bit;
+		}
+	}
 }
 
 void emhfc_putchar(int c, void *arg)
 {
 	char ch = (char)c;
+	u64 sinks = g_console_sinks & emhfc_sinks_initialized;
 	(void)arg;
 
-#if DEBUG_SERIAL
-	dbg_x86_uart_putc(ch);
-#endif							/* DEBUG_SERIAL */
+	for (u32 i = 0; i < EMHFC_NSINKS; i++) {
+		if (sinks & emhfc_sinks[i].bit) {
+			emhfc_sinks[i].putc(ch);
+		}
+	}
+}
 
-#if DEBUG_VGA
-	dbg_x86_vgamem_putc(ch);
-#endif							/* DEBUG_VGA */
+/* Write binary data to sinks, the console lock must be held. */
+void emhfc_putbin(const void *data, size_t len)
+{
+	const char *p = data;
+	u64 sinks = g_console_sinks & emhfc_sinks_initialized;
+
+	for (u32 i = 0; i < EMHFC_NSINKS; i++) {
+		if ((sinks & emhfc_sinks[i].bit) && emhfc_sinks[i].binary) {
+			for (size_t j = 0; j < len; j++) {
+				emhfc_sinks[i].putc(p[j]);
+			}
+		}
+	}
 }
 
-void emhfc_putchar_linelock(spin_lock_t * arg)
+/* Flush all sinks, wait for completion if sync. */
+static void emhfc_sinks_flush(bool sync)
+{
+	u64 sinks = g_console_sinks & emhfc_sinks_initialized;
+	for (u32 i = 0; i < EMHFC_NSINKS; i++) {
+		if ((sinks & emhfc_sinks[i].bit) && emhfc_sinks[i].flush) {
+			emhfc_sinks[i].flush(sync);
+		}
+	}
+}
+
+/* Start sending characters buffered by emhfc_putchar(). */
+void emhfc_putchar_flush(void)
+{
+	emhfc_sinks_flush(false);
+}
+
+/*
+ * Prepare for writing to port I/O sinks directly without emhfc_putchar(),
+ * see shv_disable_enable_paging(). Print buffered output, disable interrupts,
+ * take the console lock and empty the UART TX queue. Set *sinks to the
+ * enabled sinks that can be written directly (serial and port 0xe9). Return
+ * old EFLAGS for emhfc_putchar_direct_end().
+ */
+ulong_t emhfc_putchar_direct_begin(u64 * sinks)
+{
+	ulong_t flags;
+	debug_log_drain();
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	emhfc_putchar_linelock(emhfc_putchar_linelock_arg);
+	*sinks = g_console_sinks & emhfc_sinks_initialized &
+		(CONSOLE_SINK_SERIAL | CONSOLE_SINK_E9);
+	if (*sinks & CONSOLE_SINK_SERIAL) {
+		dbg_x86_uart_direct_begin();
+	}
+	return flags;
+}
+
+void emhfc_putchar_direct_end(ulong_t flags, u64 sinks)
+{
+	if (sinks & CONSOLE_SINK_SERIAL) {
+		/* Interrupts were already disabled at dbg_x86_uart_direct_begin() */
+		dbg_x86_uart_direct_end(0);
+	}
+	emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+}
+
+/* Print all buffered output and halt the current CPU, see HALT(). */
+void emhfc_debug_halt(void)
+{
+	debug_log_drain();
+	flight_dump();
+	trace_flush_halt();
+	emhfc_sinks_flush(true);
+	cpu_halt();
+}
+
+void emhfc_putchar_linelock(volatile u32 * arg)
+{
+	while (!emhfc_putchar_linetrylock(arg)) {
+		while (*arg) {
+			cpu_relax();
+		}
+	}
+}
+
+/*
+ * Always use a locked instruction, even if the lock looks taken. This orders
+ * the caller's earlier stores before the check, see debug_log_drain().
+ */
+bool emhfc_putchar_linetrylock(volatile u32 * arg)
 {
-	spin_lock(arg);
+	u32 val = 1;
+	asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(*arg)::"memory");
+	return val == 0;
 }
 
-void emhfc_putchar_lineunlock(spin_lock_t * arg)
+void emhfc_putchar_lineunlock(volatile u32 * arg)
 {
-	spin_unlock(arg);
+	u32 val = 0;
+	asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(*arg)::"memory");
 }
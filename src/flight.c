@@ -0,0 +1,80 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * VMEXIT flight recorder. Every CPU always records its last FLIGHT_RECORDS
+ * VMEXITs (in vmexit_handler()) and interrupts (in handle_idt()), at the cost
+ * of a few stores per event. HALT() (hence ASSERT() and TEST_ASSERT()) prints
+ * the records of the halting CPU, so a rare failure can be diagnosed without
+ * re-running with printf() enabled, which changes timing. VMEXITs handled by
+ * the fast path in vmexit_asm are not recorded.
+ */
+
+flight_buf_t g_flight_bufs[MAX_VCPU_ENTRIES];
+
+static const char *flight_kind_names[] = {
+	[FLIGHT_VMEXIT] = "exit",
+	[FLIGHT_INTERRUPT] = "intr",
+};
+
+#define FLIGHT_NKINDS (sizeof(flight_kind_names) / sizeof(flight_kind_names[0]))
+
+/*
+ * Print the flight recorder of the current CPU, oldest first. TSC is printed
+ * relative to the latest record. Records whose handler has not finished
+ * (including the one that calls HALT()) have cycles = 0.
+ */
+void flight_dump(void)
+{
+	VCPU *vcpu;
+	flight_buf_t *buf;
+	u32 tail;
+	u32 n;
+	u64 last_tsc;
+
+	if (read_gs() != __PCPU) {
+		return;
+	}
+	vcpu = get_vcpu();
+	buf = &g_flight_bufs[vcpu->idx];
+	if (buf->dumping) {
+		return;
+	}
+	buf->dumping = true;
+	tail = buf->tail;
+	n = tail < FLIGHT_RECORDS ? tail : FLIGHT_RECORDS;
+	if (n == 0) {
+		return;
+	}
+	last_tsc = buf->rec[(tail - 1) % FLIGHT_RECORDS].tsc;
+	printf("CPU(0x%02x): V Flight recorder, %u of %u records\n", vcpu->id, n,
+		   tail);
+	for (u32 i = tail - n; i != tail; i++) {
+		flight_record_t *rec = &buf->rec[i % FLIGHT_RECORDS];
+		const char *kind = "?";
+		if (rec->kind < FLIGHT_NKINDS && flight_kind_names[rec->kind]) {
+			kind = flight_kind_names[rec->kind];
+		}
+		printf("CPU(0x%02x): %s 0x%04x rip=0x%016llx qual=0x%llx "
+			   "tsc=-%llu cycles=%llu\n", vcpu->id, kind, rec->reason,
+			   rec->rip, rec->qual, last_tsc - rec->tsc, rec->cycles);
+	}
+	printf("CPU(0x%02x): ^ Flight recorder\n", vcpu->id);
+}
@@ -36,7 +36,7 @@ void init_gdt(VCPU * vcpu)
 	g_gdt[vcpu->idx][6] = 0x00cffa000000ffffULL;	// CS Ring 3, 32-bit
 #endif							/* __amd64__ */
 	g_gdt[vcpu->idx][7] = 0x00cff2000000ffffULL;	// DS Ring 3
-	g_gdt[vcpu->idx][8] = 0x0000000000000000ULL;
+	g_gdt[vcpu->idx][8] = 0x00cf92000000ffffULL;	// Per-CPU data (GS)
 	g_gdt[vcpu->idx][9] = 0x0000000000000000ULL;
 
 	/* Modify GDT entries for TSS. */
@@ -55,6 +55,15 @@ void init_gdt(VCPU * vcpu)
 		t->limit0_15 = 0x67;
 	}
 
+	/* Modify GDT entry for per-CPU data, base is &g_percpu[vcpu->idx]. */
+	{
+		uintptr_t base = (uintptr_t) & g_percpu[vcpu->idx];
+		ASSERT(base == (u32) base);
+		g_percpu[vcpu->idx].vcpu = vcpu;
+		g_gdt[vcpu->idx][8] |= (u64) (base & 0x00FFFFFF) << 16;
+		g_gdt[vcpu->idx][8] |= (u64) ((base & 0xFF000000) >> 24) << 56;
+	}
+
 	/* Load GDT. */
 	{
 		struct {
@@ -72,4 +81,11 @@ void init_gdt(VCPU * vcpu)
 		u16 trsel = __TRSEL;
 		asm volatile ("ltr %0"::"m" (trsel));
 	}
+
+	/* Load GS for per-CPU data. */
+	{
+		u16 gssel = __PCPU;
+		asm volatile ("movw %0, %%gs"::"m" (gssel));
+		ASSERT(get_vcpu() == vcpu);
+	}
 }
@@ -94,8 +94,11 @@ void init_idt(void)
 	}
 }
 
-/* From XMHF64 _svm_and_vmx_getvcpu(). */
-VCPU *get_vcpu(void)
+/*
+ * Find VCPU of the current CPU using LAPIC ID, from XMHF64
+ * _svm_and_vmx_getvcpu(). Slow, use get_vcpu() instead.
+ */
+VCPU *get_vcpu_by_lapic_id(void)
 {
 	u64 msr_val;
 	u32 lapic_id;
@@ -164,6 +167,9 @@ u32 handle_idt(uintptr_t _ip, iret_info_t * info)
 	struct regs *r = &info->r;
 	u8 vector = info->vector;
 	bool guest = !!(info->vector & 0x100);
+	u64 tsc = rdtsc();
+	flight_record_t *rec = flight_record(vcpu, FLIGHT_INTERRUPT, info->vector,
+										 info->ip, info->error_code, tsc);
 
 	ASSERT(_ip == info->ip);
 
@@ -193,6 +199,10 @@ u32 handle_idt(uintptr_t _ip, iret_info_t * info)
 		handle_shv_syscall(vcpu, vector, r);
 		break;
 
+	case 0x24:
+		handle_serial_interrupt(vcpu, vector, guest);
+		break;
+
 	case 0x27:
 		/*
 		 * We encountered the Mysterious IRQ 7. This has been observed on Bochs
@@ -221,6 +231,10 @@ u32 handle_idt(uintptr_t _ip, iret_info_t * info)
 		handle_ipi_interrupt(vcpu, vector, guest, info->ip);
 		break;
 
+	case SHV_EPT_SHOOTDOWN_VECTOR:
+		handle_ept_shootdown_interrupt(vcpu, vector, guest);
+		break;
+
 	default:
 		/* Try to recover using xcph_table. */
 		{
@@ -253,6 +267,8 @@ u32 handle_idt(uintptr_t _ip, iret_info_t * info)
 		break;
 	}
 
+	flight_record_end(rec, tsc, rdtsc());
+
 	if (g_nmi_opt & SHV_NMI_ENABLE) {
 		if (vcpu->idx == 1 &&
 			(vector == 0x02 || vector == 0x21 || vector == 0x54)) {
@@ -25,7 +25,6 @@ void kernel_main(multiboot_info_t * mbi)
 {
 	/* Initialize terminal interface. */
 	{
-		extern void emhfc_debug_init(void);
 		emhfc_debug_init();
 	}
 
@@ -48,12 +47,21 @@ void kernel_main(multiboot_info_t * mbi)
 		const char *cmdline = (const char *)(uintptr_t) mbi->cmdline;
 		printf("Multiboot command line: %s\n", cmdline);
 		parse_cmdline(cmdline);
+		emhfc_debug_init();
 	} else {
 		printf("No multiboot command line\n");
 	}
 
+	/* Select memcpy() and memset() implementation. */
+	{
+		libc_string_init();
+		printf("libc string: %s\n",
+			   g_libc_string_mode_names[g_libc_string_mode]);
+	}
+
 	/* Print options. */
 	{
+		printf("g_console_sinks: 0x%llx\n", g_console_sinks);
 		printf("g_shv_opt: 0x%llx\n", g_shv_opt);
 		printf("g_nmi_opt: 0x%llx\n", g_nmi_opt);
 		printf("g_nmi_exp: 0x%llx\n", g_nmi_exp);
@@ -101,11 +109,8 @@ void kernel_main_smp(VCPU * vcpu)
 
 	/* Barrier */
 	{
-		static u32 count = 0;
-		lock_incl(&count);
-		while (count < g_midtable_numentries) {
-			cpu_relax();
-		}
+		static smp_barrier_t barrier;
+		smp_barrier_wait(&barrier, vcpu);
 	}
 
 	/* Initialize GDT, IDT, etc. */
@@ -114,6 +119,11 @@ void kernel_main_smp(VCPU * vcpu)
 		init_idt();
 	}
 
+	/* Enable extended state if requested, before setting up VMCS. */
+	{
+		xsave_init(vcpu);
+	}
+
 	/* Transfer control to SHV */
 	{
 		extern void shv_main(VCPU * vcpu);
@@ -164,10 +164,17 @@ int puts(const char *s)
 int vprintf(const char *fmt, va_list ap)
 {
 	int retval;
-
-	emhfc_putchar_linelock(emhfc_putchar_linelock_arg);
-	retval = kvprintf(fmt, emhfc_putchar, NULL, 10, ap);
-	emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+	void *log = debug_log_begin();
+
+	if (log != NULL) {
+		retval = kvprintf(fmt, debug_log_putchar, log, 10, ap);
+		debug_log_end(log);
+	} else {
+		emhfc_putchar_linelock(emhfc_putchar_linelock_arg);
+		retval = kvprintf(fmt, emhfc_putchar, NULL, 10, ap);
+		emhfc_putchar_flush();
+		emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+	}
 
 	return (retval);
 }
@@ -62,29 +62,182 @@
  * @XMHF_LICENSE_HEADER_END@
  */
 
+#include <xmhf.h>
 #include <stdint.h>
 #include <string.h>
 
-/* From xmhf/src/libbaremetal/libxmhfc/string.c */
-void *memmove(void *dst_void, const void *src_void, size_t length)
+/*
+ * memcpy(), memset(), memmove() and memcmp() work on machine words, and use
+ * string instructions for large sizes. libc_string_init() selects REP MOVSB /
+ * STOSB if the CPU supports ERMS (Enhanced REP MOVSB/STOSB), or REP MOVS /
+ * STOS of machine words otherwise. String instructions have a startup cost of
+ * tens of cycles, so sizes below LIBC_STRING_REP_MIN use loops of words. Only
+ * general purpose registers are used (SHV is compiled with -mno-sse).
+ *
+ * The loops must not be compiled to calls to memcpy() or memset().
+ */
+
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+
+/* Unaligned machine word */
+typedef uintptr_t __attribute__((may_alias, aligned(1))) libc_word_t;
+
+#define LIBC_WORD_SIZE	sizeof(uintptr_t)
+
+#ifdef __amd64__
+#define LIBC_REP_MOVSW	"rep movsq"
+#define LIBC_REP_STOSW	"rep stosq"
+#elif defined(__i386__)
+#define LIBC_REP_MOVSW	"rep movsl"
+#define LIBC_REP_STOSW	"rep stosl"
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+
+/* Loops of words are used before libc_string_init() */
+u32 g_libc_string_mode = LIBC_STRING_WORD;
+
+const char *g_libc_string_mode_names[LIBC_STRING_MODES] = {
+	[LIBC_STRING_BYTE] = "byte",
+	[LIBC_STRING_WORD] = "word",
+	[LIBC_STRING_REP] = "rep",
+	[LIBC_STRING_ERMS] = "erms",
+};
+
+/* Select implementation using CPUID, called by BSP. */
+void libc_string_init(void)
 {
-	char *dst = dst_void;
-	const char *src = src_void;
+	/* CPUID.(EAX=07H, ECX=0H):EBX.ERMS[bit 9] */
+	if (cpuid_eax(0, 0) >= 7 && (cpuid_ebx(7, 0) & (1U << 9))) {
+		g_libc_string_mode = LIBC_STRING_ERMS;
+	} else {
+		g_libc_string_mode = LIBC_STRING_REP;
+	}
+}
 
-	if (src < dst && dst < src + length) {
-		// Have to copy backwards
-		src += length;
-		dst += length;
-		while (length--) {
-			*--dst = *--src;
+static void libc_copy_bytes(u8 * dst, const u8 * src, size_t n)
+{
+	while (n--) {
+		*dst++ = *src++;
+	}
+}
+
+static void libc_copy_words(u8 * dst, const u8 * src, size_t n)
+{
+	for (; n >= LIBC_WORD_SIZE; n -= LIBC_WORD_SIZE) {
+		*(libc_word_t *) dst = *(const libc_word_t *)src;
+		dst += LIBC_WORD_SIZE;
+		src += LIBC_WORD_SIZE;
+	}
+	libc_copy_bytes(dst, src, n);
+}
+
+/* Copy backwards for memmove() */
+static void libc_copy_words_backward(u8 * dst, const u8 * src, size_t n)
+{
+	dst += n;
+	src += n;
+	for (; n >= LIBC_WORD_SIZE; n -= LIBC_WORD_SIZE) {
+		dst -= LIBC_WORD_SIZE;
+		src -= LIBC_WORD_SIZE;
+		*(libc_word_t *) dst = *(const libc_word_t *)src;
+	}
+	while (n--) {
+		*--dst = *--src;
+	}
+}
+
+/* Copy forwards, also correct when to < from and the buffers overlap. */
+void *memcpy_mode(void *to, const void *from, size_t n, u32 mode)
+{
+	if (mode == LIBC_STRING_BYTE) {
+		libc_copy_bytes(to, from, n);
+	} else if (mode == LIBC_STRING_WORD || n < LIBC_STRING_REP_MIN) {
+		libc_copy_words(to, from, n);
+	} else if (mode == LIBC_STRING_ERMS) {
+		void *dst = to;
+		asm volatile ("rep movsb":"+D" (dst), "+S"(from), "+c"(n)::"memory");
+	} else {
+		void *dst = to;
+		size_t words = n / LIBC_WORD_SIZE;
+		size_t bytes = n % LIBC_WORD_SIZE;
+		asm volatile (LIBC_REP_MOVSW "\n\t"
+					  "mov %3, %2\n\t"
+					  "rep movsb":"+D" (dst), "+S"(from), "+c"(words)
+					  :"r"(bytes):"memory");
+	}
+	return to;
+}
+
+void *memset_mode(void *str, int c, size_t len, u32 mode)
+{
+	u8 *st = str;
+	if (mode == LIBC_STRING_BYTE) {
+		while (len--) {
+			*st++ = (u8) c;
+		}
+	} else if (mode == LIBC_STRING_WORD || len < LIBC_STRING_REP_MIN) {
+		uintptr_t word = (u8) c * (UINTPTR_MAX / 0xff);
+		for (; len >= LIBC_WORD_SIZE; len -= LIBC_WORD_SIZE) {
+			*(libc_word_t *) st = word;
+			st += LIBC_WORD_SIZE;
+		}
+		while (len--) {
+			*st++ = (u8) c;
 		}
+	} else if (mode == LIBC_STRING_ERMS) {
+		asm volatile ("rep stosb":"+D" (st), "+c"(len):"a"(c):"memory");
 	} else {
-		while (length--) {
-			*dst++ = *src++;
+		uintptr_t word = (u8) c * (UINTPTR_MAX / 0xff);
+		size_t words = len / LIBC_WORD_SIZE;
+		size_t bytes = len % LIBC_WORD_SIZE;
+		asm volatile (LIBC_REP_STOSW "\n\t"
+					  "mov %3, %1\n\t"
+					  "rep stosb":"+D" (st), "+c"(words), "+a"(word)
+					  :"r"(bytes):"memory");
+	}
+	return str;
+}
+
+/*
+ * Compare words until they differ, then find the first different byte. There
+ * is no string instruction version because REPE CMPSB is not fast.
+ */
+int memcmp_mode(const void *s1, const void *s2, size_t n, u32 mode)
+{
+	const u8 *p1 = s1;
+	const u8 *p2 = s2;
+	if (mode != LIBC_STRING_BYTE) {
+		for (; n >= LIBC_WORD_SIZE; n -= LIBC_WORD_SIZE) {
+			if (*(const libc_word_t *)p1 != *(const libc_word_t *)p2) {
+				break;
+			}
+			p1 += LIBC_WORD_SIZE;
+			p2 += LIBC_WORD_SIZE;
 		}
 	}
+	for (; n; n--) {
+		if (*p1 != *p2) {
+			return *p1 - *p2;
+		}
+		p1++;
+		p2++;
+	}
+	return 0;
+}
+
+/* Based on xmhf/src/libbaremetal/libxmhfc/string.c */
+void *memmove(void *dst_void, const void *src_void, size_t length)
+{
+	u8 *dst = dst_void;
+	const u8 *src = src_void;
 
-	return dst_void;
+	if (src < dst && dst < src + length) {
+		// Have to copy backwards
+		libc_copy_words_backward(dst, src, length);
+		return dst_void;
+	}
+	return memcpy_mode(dst_void, src_void, length, g_libc_string_mode);
 }
 
 size_t strnlen(const char *s, size_t count)
@@ -97,34 +250,18 @@ size_t strnlen(const char *s, size_t count)
 
 void *memcpy(void *to, const void *from, size_t n)
 {
-	size_t i;
-	for (i = 0; i < n; i++) {
-		((uint8_t *) to)[i] = ((const uint8_t *)from)[i];
-	}
-	return to;
+	return memcpy_mode(to, from, n, g_libc_string_mode);
 }
 
 void *memset(void *str, int c, size_t len)
 {
-	register uint8_t *st = str;
-
-	while (len-- > 0)
-		*st++ = (uint8_t) c;
-	return str;
+	return memset_mode(str, c, len, g_libc_string_mode);
 }
 
 #ifndef HAVE_MEMCMP
 int memcmp(const void *s1, const void *s2, size_t n)
 {
-	if (n != 0) {
-		const unsigned char *p1 = s1, *p2 = s2;
-
-		do {
-			if (*p1++ != *p2++)
-				return (*--p1 - *--p2);
-		} while (--n != 0);
-	}
-	return (0);
+	return memcmp_mode(s1, s2, n, g_libc_string_mode);
 }
 #endif							/* HAVE_MEMCMP */
 
@@ -0,0 +1,1314 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+#include <shv.h>
+
+/*
+ * Benchmarks run by the guest when SHV_BENCH_* bits are set in g_shv_opt.
+ *
+ * Each benchmark collects BENCH_SAMPLES samples (in TSC cycles) per CPU and
+ * prints one line per sample set, in the format
+ *   BENCH: cpu=0x00 round=1 test=vmexit type=cpuid n=1024 min=... med=...
+ *          p99=... max=...
+ * (in a single line). Tools can grep for "BENCH: " in the serial output.
+ *
+ * The VMCS field sweep prints one line per field and access type instead,
+ * summarizing all CPUs, in the format
+ *   BENCH_VMCS_FIELD: round=1 field=0x0800 name=guest_ES_selector
+ *                     type=vmread cpus=4 min=... max=... max_cpu=0x02
+ * (in a single line).
+ *
+ * The serial benchmark prints one line per UART mode, in the format
+ *   BENCH_SERIAL: round=1 mode=fifo bytes=4096 cycles=... in=... out=...
+ *                 io_per_byte=0.062 bytes_per_sec=...
+ * (in a single line). bytes_per_sec is 0 when the TSC frequency is unknown.
+ *
+ * The libc benchmark prints one line per function, implementation, size and
+ * alignment, in the format
+ *   BENCH_LIBC: round=1 func=memcpy mode=erms size=4096 align=1 n=64
+ *               min=... med=... bytes_per_kcycle=...
+ * (in a single line).
+ */
+
+#define BENCH_SAMPLES 1024
+
+/* VMCALL numbers used by benchmarks, see also SHV_VMCALL_NOP */
+#define BENCH_VMCALL_SETUP	51
+#define BENCH_VMCALL_SHADOW	53
+#define BENCH_VMCALL_VMCS_FIELDS	54
+#define BENCH_VMCALL_XSAVE	55
+#define BENCH_VMCALL_XSAVE_EXIT	56
+#define BENCH_VMCALL_EPT_SHOOTDOWN	58
+#define BENCH_VMCALL_EPT_SWITCH	59
+#define BENCH_VMCALL_PML_HARVEST	60
+
+/* Synthetic MSR and I/O port, emulated by SHV without touching hardware */
+#define BENCH_MSR			0x400000f0U
+#define BENCH_IO_PORT		0x80
+
+/* VMCS field accessed by the VMCS shadowing benchmark */
+#define BENCH_VMCS_FIELD	VMCS_guest_ES_limit
+
+/* Number of VMREADs / VMWRITEs timed together in one sample */
+#define BENCH_VMCS_BATCH	16
+
+/*
+ * Number of samples per field in the VMCS field sweep. The minimum is kept,
+ * each sample times BENCH_VMCS_BATCH accesses.
+ */
+#define BENCH_VMCS_FIELD_SAMPLES	8
+
+/* Cycles per access in the VMCS field sweep when the field is not measured */
+#define BENCH_VMCS_FIELD_NONE	0xffffffffU
+
+static u64 bench_samples[MAX_VCPU_ENTRIES][BENCH_SAMPLES];
+
+/* Barrier for benchmarks that need all CPUs to run together */
+static smp_barrier_t bench_barrier;
+
+/* Barrier measured by the barrier benchmark, records arrival skew */
+static smp_barrier_t bench_barrier_timed = {.timing = true };
+
+/* Value of BENCH_VMCS_FIELD when VMREAD / VMWRITE are emulated by SHV */
+static ulong_t bench_vmcs12_field[MAX_VCPU_ENTRIES];
+
+/* Read TSC, making sure that it is not reordered with surrounding code. */
+static inline u64 bench_rdtsc(void)
+{
+	u32 eax, edx;
+	asm volatile ("lfence; rdtsc; lfence":"=a" (eax), "=d"(edx)::"memory");
+	return ((u64) edx << 32) | eax;
+}
+
+/* Sort samples in ascending order (shell sort, no recursion). */
+static void bench_sort(u64 * a, u32 n)
+{
+	for (u32 gap = n / 2; gap > 0; gap /= 2) {
+		for (u32 i = gap; i < n; i++) {
+			u64 t = a[i];
+			u32 j;
+			for (j = i; j >= gap && a[j - gap] > t; j -= gap) {
+				a[j] = a[j - gap];
+			}
+			a[j] = t;
+		}
+	}
+}
+
+/* Sort samples and compute statistics. */
+void bench_compute_stats(u64 * samples, u32 n, bench_stats_t * stats)
+{
+	ASSERT(n > 0);
+	bench_sort(samples, n);
+	stats->n = n;
+	stats->min = samples[0];
+	stats->med = samples[n / 2];
+	stats->p99 = samples[(n * 99) / 100];
+	stats->max = samples[n - 1];
+}
+
+/* Print statistics in machine-readable format. */
+void bench_print_stats(VCPU * vcpu, u64 round, const char *test,
+					   const char *type, bench_stats_t * stats)
+{
+	printf("BENCH: cpu=0x%02x round=%lld test=%s type=%s n=%u min=%lld "
+		   "med=%lld p99=%lld max=%lld\n", vcpu->id, round, test, type,
+		   stats->n, stats->min, stats->med, stats->p99, stats->max);
+}
+
+/* Return pointer to general purpose register in r, using VMX encoding. */
+static uintptr_t *bench_get_gpr(struct regs *r, u32 index)
+{
+	const u32 ngprs = sizeof(*r) / sizeof(uintptr_t);
+	ASSERT(index < ngprs);
+	/* RSP is stored in VMCS */
+	ASSERT(index != 4);
+	return &((uintptr_t *) r)[ngprs - 1 - index];
+}
+
+/* Exit types measured by the VMEXIT benchmark */
+enum bench_vmexit_type {
+	BENCH_VMEXIT_BASELINE,
+	BENCH_VMEXIT_CPUID,
+	BENCH_VMEXIT_VMCALL,
+	BENCH_VMEXIT_RDMSR,
+	BENCH_VMEXIT_WRMSR,
+	BENCH_VMEXIT_IN,
+	BENCH_VMEXIT_OUT,
+	BENCH_VMEXIT_CR,
+	BENCH_VMEXIT_TYPES
+};
+
+static const char *bench_vmexit_names[BENCH_VMEXIT_TYPES] = {
+	"baseline", "cpuid", "vmcall", "rdmsr", "wrmsr", "in", "out", "cr",
+};
+
+/* Enable / disable I/O and CR3 load exiting, argument in EBX */
+static void bench_vmcall_setup(VCPU * vcpu, struct regs *r,
+							   vmexit_info_t * info)
+{
+	u32 mask = ((1U << VMX_PROCBASED_UNCONDITIONAL_IO_EXITING) |
+				(1U << VMX_PROCBASED_CR3_LOAD_EXITING));
+	u32 val = __vmx_vmread32(VMCS_control_VMX_cpu_based);
+	if (r->ebx) {
+		ASSERT(_vmx_hasctl_unconditional_io_exiting(&vcpu->vmx_caps));
+		ASSERT(_vmx_hasctl_cr3_load_exiting(&vcpu->vmx_caps));
+		val |= mask;
+	} else {
+		val &= ~mask;
+	}
+	__vmx_vmwrite32(VMCS_control_VMX_cpu_based, val);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Emulate RDMSR and WRMSR of BENCH_MSR */
+static void bench_handle_msr(VCPU * vcpu, struct regs *r, vmexit_info_t * info)
+{
+	if (r->ecx != BENCH_MSR) {
+		vmexit_handle_default(vcpu, r, info);
+		return;
+	}
+	if (info->vmexit_reason == VMX_VMEXIT_RDMSR) {
+		r->eax = 0;
+		r->edx = 0;
+	}
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Emulate IN and OUT of BENCH_IO_PORT */
+static void bench_handle_io(VCPU * vcpu, struct regs *r, vmexit_info_t * info)
+{
+	ulong_t q = __vmx_vmreadNW(VMCS_info_exit_qualification);
+	(void)vcpu;
+	/* Only support 1-byte non-string access to BENCH_IO_PORT */
+	ASSERT((q >> 16) == BENCH_IO_PORT);
+	ASSERT((q & 0x37UL) == 0);
+	if (q & 0x8UL) {
+		r->eax = (r->eax & ~0xffU) | 0xffU;
+	}
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Emulate MOV to CR3 */
+static void bench_handle_cr(VCPU * vcpu, struct regs *r, vmexit_info_t * info)
+{
+	ulong_t q = __vmx_vmreadNW(VMCS_info_exit_qualification);
+	uintptr_t *gpr = bench_get_gpr(r, (q >> 8) & 0xf);
+	(void)vcpu;
+	ASSERT((q & 0x3fUL) == 0x3UL);
+	__vmx_vmwriteNW(VMCS_guest_CR3, *gpr);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Cause one VMEXIT of the given type. */
+static inline void bench_vmexit_once(u32 type, ulong_t cr3)
+{
+	u32 eax, ebx, ecx, edx;
+	switch (type) {
+	case BENCH_VMEXIT_BASELINE:
+		break;
+	case BENCH_VMEXIT_CPUID:
+		asm volatile ("cpuid":"=a" (eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+					  :"a"(0), "c"(0));
+		break;
+	case BENCH_VMEXIT_VMCALL:
+		asm volatile ("vmcall"::"a" (SHV_VMCALL_NOP));
+		break;
+	case BENCH_VMEXIT_RDMSR:
+		asm volatile ("rdmsr":"=a" (eax), "=d"(edx):"c"(BENCH_MSR));
+		break;
+	case BENCH_VMEXIT_WRMSR:
+		asm volatile ("wrmsr"::"c" (BENCH_MSR), "a"(0), "d"(0));
+		break;
+	case BENCH_VMEXIT_IN:
+		(void)inb(BENCH_IO_PORT);
+		break;
+	case BENCH_VMEXIT_OUT:
+		outb(BENCH_IO_PORT, 0);
+		break;
+	case BENCH_VMEXIT_CR:
+		write_cr3(cr3);
+		break;
+	default:
+		ASSERT(0 && "Unknown VMEXIT type");
+		break;
+	}
+}
+
+/* Number of exit types that can be handled by the fast path */
+#define BENCH_FAST_PATH_TYPES 3
+
+/*
+ * Cause one VMEXIT that can be handled by the fast path. RDMSR reads an MSR
+ * that SHV passes through to hardware.
+ */
+static inline void bench_fast_path_once(u32 type)
+{
+	u32 eax, ebx, ecx, edx;
+	switch (type) {
+	case BENCH_VMEXIT_CPUID:
+		asm volatile ("cpuid":"=a" (eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+					  :"a"(0), "c"(0));
+		break;
+	case BENCH_VMEXIT_VMCALL:
+		asm volatile ("vmcall"::"a" (SHV_VMCALL_NOP));
+		break;
+	case BENCH_VMEXIT_RDMSR:
+		asm volatile ("rdmsr":"=a" (eax), "=d"(edx)
+					  :"c"(IA32_SYSENTER_CS_MSR));
+		break;
+	default:
+		ASSERT(0 && "Unknown VMEXIT type");
+		break;
+	}
+}
+
+/* Measure round trip time of different types of VMEXITs */
+static void shv_bench_vmexit(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats[BENCH_VMEXIT_TYPES];
+	ulong_t cr3 = read_cr3();
+	ulong_t flags;
+
+	/*
+	 * Disable interrupts to avoid noise from interrupt handlers. Nothing can
+	 * be printed while I/O exiting is enabled, because the serial port is
+	 * accessed using I/O instructions.
+	 */
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	vmcall_register(vcpu, BENCH_VMCALL_SETUP, bench_vmcall_setup);
+	vmexit_register(vcpu, VMX_VMEXIT_RDMSR, bench_handle_msr);
+	vmexit_register(vcpu, VMX_VMEXIT_WRMSR, bench_handle_msr);
+	vmexit_register(vcpu, VMX_VMEXIT_IOIO, bench_handle_io);
+	vmexit_register(vcpu, VMX_VMEXIT_CRX_ACCESS, bench_handle_cr);
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_SETUP), "b"(1));
+	for (u32 type = 0; type < BENCH_VMEXIT_TYPES; type++) {
+		/* Warm up caches and TLBs */
+		for (u32 i = 0; i < 16; i++) {
+			bench_vmexit_once(type, cr3);
+		}
+		for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+			u64 t0 = bench_rdtsc();
+			bench_vmexit_once(type, cr3);
+			samples[i] = bench_rdtsc() - t0;
+		}
+		bench_compute_stats(samples, BENCH_SAMPLES, &stats[type]);
+	}
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_SETUP), "b"(0));
+	vmexit_deregister(vcpu, VMX_VMEXIT_CRX_ACCESS, bench_handle_cr);
+	vmexit_deregister(vcpu, VMX_VMEXIT_IOIO, bench_handle_io);
+	vmexit_deregister(vcpu, VMX_VMEXIT_WRMSR, bench_handle_msr);
+	vmexit_deregister(vcpu, VMX_VMEXIT_RDMSR, bench_handle_msr);
+	vmcall_deregister(vcpu, BENCH_VMCALL_SETUP, bench_vmcall_setup);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	for (u32 type = 0; type < BENCH_VMEXIT_TYPES; type++) {
+		bench_print_stats(vcpu, round, "vmexit", bench_vmexit_names[type],
+						  &stats[type]);
+	}
+}
+
+/*
+ * Measure round trip time of VMEXITs handled by the fast path in vmexit_asm
+ * and by vmexit_handler(). The difference is SHV's handler overhead.
+ */
+static void shv_bench_fast_path(VCPU * vcpu, u64 round)
+{
+	static const u32 types[BENCH_FAST_PATH_TYPES] = {
+		BENCH_VMEXIT_CPUID, BENCH_VMEXIT_VMCALL, BENCH_VMEXIT_RDMSR,
+	};
+	static const char *paths[2] = { "vmexit-slow", "vmexit-fast" };
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats[2][BENCH_FAST_PATH_TYPES];
+	bool old_fast_path = vcpu->vmexit_fast_path;
+	ulong_t flags;
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	for (u32 fast = 0; fast < 2; fast++) {
+		vmexit_fast_path_set(vcpu, fast);
+		for (u32 t = 0; t < BENCH_FAST_PATH_TYPES; t++) {
+			/* Warm up caches and TLBs */
+			for (u32 i = 0; i < 16; i++) {
+				bench_fast_path_once(types[t]);
+			}
+			for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+				u64 t0 = bench_rdtsc();
+				bench_fast_path_once(types[t]);
+				samples[i] = bench_rdtsc() - t0;
+			}
+			bench_compute_stats(samples, BENCH_SAMPLES, &stats[fast][t]);
+		}
+	}
+	vmexit_fast_path_set(vcpu, old_fast_path);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	for (u32 fast = 0; fast < 2; fast++) {
+		for (u32 t = 0; t < BENCH_FAST_PATH_TYPES; t++) {
+			bench_print_stats(vcpu, round, paths[fast],
+							  bench_vmexit_names[types[t]], &stats[fast][t]);
+		}
+	}
+}
+
+/* Enable / disable VMCS shadowing, argument in EBX */
+static void bench_vmcall_shadow(VCPU * vcpu, struct regs *r,
+								vmexit_info_t * info)
+{
+	vmcs_shadowing_set(vcpu, r->ebx);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Emulate VMREAD and VMWRITE of BENCH_VMCS_FIELD with register operands, like
+ * an L1 hypervisor accessing its in-memory copy of the VMCS.
+ */
+static void bench_handle_vmcs(VCPU * vcpu, struct regs *r,
+							  vmexit_info_t * info)
+{
+	u32 inst_info = __vmx_vmread32(VMCS_info_vmx_instruction_information);
+	uintptr_t *reg1 = bench_get_gpr(r, (inst_info >> 3) & 0xf);
+	uintptr_t *reg2 = bench_get_gpr(r, (inst_info >> 28) & 0xf);
+	ulong_t rflags = __vmx_vmreadNW(VMCS_guest_RFLAGS);
+	/* Bit 10 set means register operand */
+	ASSERT(inst_info & (1U << 10));
+	ASSERT(*reg2 == BENCH_VMCS_FIELD);
+	if (info->vmexit_reason == VMX_VMEXIT_VMREAD) {
+		*reg1 = bench_vmcs12_field[vcpu->idx];
+	} else {
+		bench_vmcs12_field[vcpu->idx] = *reg1 & 0xffffffffUL;
+	}
+	/* VMsucceed: clear CF, PF, AF, ZF, SF and OF */
+	__vmx_vmwriteNW(VMCS_guest_RFLAGS, rflags & ~0x8d5UL);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* VMREAD with register operands, so that the VMEXIT is easy to emulate */
+static inline ulong_t bench_vmread(ulong_t encoding)
+{
+	ulong_t value;
+	asm volatile ("vmread %1, %0":"=r" (value):"r"(encoding):"cc");
+	return value;
+}
+
+/* VMWRITE with register operands */
+static inline void bench_vmwrite(ulong_t encoding, ulong_t value)
+{
+	asm volatile ("vmwrite %1, %0"::"r" (encoding), "r"(value):"cc");
+}
+
+/* Time VMREADs or VMWRITEs of BENCH_VMCS_FIELD, in cycles per access. */
+static void bench_vmcs_access(u64 * samples, bool write, bench_stats_t * stats)
+{
+	for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		for (u32 j = 0; j < BENCH_VMCS_BATCH; j++) {
+			if (write) {
+				bench_vmwrite(BENCH_VMCS_FIELD, j);
+			} else {
+				(void)bench_vmread(BENCH_VMCS_FIELD);
+			}
+		}
+		samples[i] = (bench_rdtsc() - t0) / BENCH_VMCS_BATCH;
+	}
+	bench_compute_stats(samples, BENCH_SAMPLES, stats);
+}
+
+/*
+ * Measure guest VMREAD / VMWRITE throughput with VMCS shadowing disabled
+ * (every access causes VMEXIT and is emulated) and enabled (accesses go to the
+ * shadow VMCS without VMEXIT).
+ */
+static void shv_bench_vmcs_shadow(VCPU * vcpu, u64 round)
+{
+	static const char *modes[2] = { "vmcs-exit", "vmcs-shadow" };
+	static const char *types[2] = { "vmread", "vmwrite" };
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats[2][2];
+	ulong_t flags;
+
+	ASSERT(g_shv_opt & SHV_USE_VMCS_SHADOWING);
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	vmcall_register(vcpu, BENCH_VMCALL_SHADOW, bench_vmcall_shadow);
+	vmexit_register(vcpu, VMX_VMEXIT_VMREAD, bench_handle_vmcs);
+	vmexit_register(vcpu, VMX_VMEXIT_VMWRITE, bench_handle_vmcs);
+	for (u32 shadow = 0; shadow < 2; shadow++) {
+		asm volatile ("vmcall"::"a" (BENCH_VMCALL_SHADOW), "b"(shadow));
+		/* Warm up and check that VMWRITE / VMREAD work */
+		for (u32 i = 0; i < 16; i++) {
+			bench_vmwrite(BENCH_VMCS_FIELD, 0x5a5a0000U | i);
+			ASSERT(bench_vmread(BENCH_VMCS_FIELD) == (0x5a5a0000U | i));
+		}
+		for (u32 write = 0; write < 2; write++) {
+			bench_vmcs_access(samples, write, &stats[shadow][write]);
+		}
+	}
+	vmexit_deregister(vcpu, VMX_VMEXIT_VMWRITE, bench_handle_vmcs);
+	vmexit_deregister(vcpu, VMX_VMEXIT_VMREAD, bench_handle_vmcs);
+	vmcall_deregister(vcpu, BENCH_VMCALL_SHADOW, bench_vmcall_shadow);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	for (u32 shadow = 0; shadow < 2; shadow++) {
+		for (u32 write = 0; write < 2; write++) {
+			bench_print_stats(vcpu, round, modes[shadow], types[write],
+							  &stats[shadow][write]);
+		}
+	}
+}
+
+/* VMCS fields in _vmx_vmcs_fields.h, indexed by VMCS_INDEX_* */
+static const struct {
+	u16 encoding;
+	bool ro;
+	const char *name;
+} bench_vmcs_fields[VMCS_FIELD_COUNT] = {
+#define DECLARE_FIELD_16_RW(encoding, name, ...) { encoding, false, #name },
+#define DECLARE_FIELD_16_RO(encoding, name, ...) { encoding, true, #name },
+#define DECLARE_FIELD_64_RW(...) DECLARE_FIELD_16_RW(__VA_ARGS__)
+#define DECLARE_FIELD_64_RO(...) DECLARE_FIELD_16_RO(__VA_ARGS__)
+#define DECLARE_FIELD_32_RW(...) DECLARE_FIELD_16_RW(__VA_ARGS__)
+#define DECLARE_FIELD_32_RO(...) DECLARE_FIELD_16_RO(__VA_ARGS__)
+#define DECLARE_FIELD_NW_RW(...) DECLARE_FIELD_16_RW(__VA_ARGS__)
+#define DECLARE_FIELD_NW_RO(...) DECLARE_FIELD_16_RO(__VA_ARGS__)
+#include <_vmx_vmcs_fields.h>
+#undef DECLARE_FIELD_16_RO
+#undef DECLARE_FIELD_64_RO
+#undef DECLARE_FIELD_32_RO
+#undef DECLARE_FIELD_NW_RO
+#undef DECLARE_FIELD_16_RW
+#undef DECLARE_FIELD_64_RW
+#undef DECLARE_FIELD_32_RW
+#undef DECLARE_FIELD_NW_RW
+};
+
+/* Cycles per VMREAD ([0]) and VMWRITE ([1]) of each field on each CPU */
+static u32 bench_vmcs_field_cycles[MAX_VCPU_ENTRIES][VMCS_FIELD_COUNT][2];
+
+/*
+ * Read or write a whole VMCS field with VMREAD / VMWRITE. In i386, 64-bit
+ * fields are accessed in two halves, like __vmx_vmread64().
+ */
+static inline void bench_vmcs_field_access(u16 encoding, bool write,
+										   ulong_t * value)
+{
+	u32 n = 1;
+#ifdef __i386__
+	if (((encoding >> 13) & 3) == 1) {
+		n = 2;
+	}
+#endif							/* __i386__ */
+	for (u32 i = 0; i < n; i++) {
+		if (write) {
+			bench_vmwrite(encoding + i, value[i]);
+		} else {
+			value[i] = bench_vmread(encoding + i);
+		}
+	}
+}
+
+/* Return minimum cycles per VMREAD or VMWRITE of a field. */
+static u32 bench_vmcs_field_time(u16 encoding, bool write, ulong_t * value)
+{
+	u64 ans = (u64)-1;
+	for (u32 i = 0; i < BENCH_VMCS_FIELD_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		u64 t;
+		for (u32 j = 0; j < BENCH_VMCS_BATCH; j++) {
+			bench_vmcs_field_access(encoding, write, value);
+		}
+		t = (bench_rdtsc() - t0) / BENCH_VMCS_BATCH;
+		if (t < ans) {
+			ans = t;
+		}
+	}
+	ASSERT(ans < BENCH_VMCS_FIELD_NONE);
+	return ans;
+}
+
+/*
+ * Time VMREAD and VMWRITE of every VMCS field that exists in the CPU. Fields
+ * are written with their current value, so the VMCS is not changed. VMWRITE
+ * to read-only fields is only timed when the CPU allows it (IA32_VMX_MISC
+ * bit 29). Called in host mode, argument in EBX is ignored.
+ */
+static void bench_vmcall_vmcs_fields(VCPU * vcpu, struct regs *r,
+									 vmexit_info_t * info)
+{
+	u32 (*cycles)[2] = bench_vmcs_field_cycles[vcpu->idx];
+	bool write_ro = vcpu->vmx_msrs[INDEX_IA32_VMX_MISC_MSR] & (1ULL << 29);
+	bool exist[VMCS_FIELD_COUNT];
+	(void)r;
+#define FIELD_CTLS_ARG (&vcpu->vmx_caps)
+#define DECLARE_FIELD_16(encoding, name, exist_expr, ...) \
+	exist[VMCS_INDEX_##name] = (exist_expr);
+#define DECLARE_FIELD_64(...) DECLARE_FIELD_16(__VA_ARGS__)
+#define DECLARE_FIELD_32(...) DECLARE_FIELD_16(__VA_ARGS__)
+#define DECLARE_FIELD_NW(...) DECLARE_FIELD_16(__VA_ARGS__)
+#include <_vmx_vmcs_fields.h>
+#undef DECLARE_FIELD_16
+#undef DECLARE_FIELD_64
+#undef DECLARE_FIELD_32
+#undef DECLARE_FIELD_NW
+	for (u32 i = 0; i < VMCS_FIELD_COUNT; i++) {
+		u16 encoding = bench_vmcs_fields[i].encoding;
+		ulong_t value[2];
+		cycles[i][0] = BENCH_VMCS_FIELD_NONE;
+		cycles[i][1] = BENCH_VMCS_FIELD_NONE;
+		if (!exist[i]) {
+			continue;
+		}
+		cycles[i][0] = bench_vmcs_field_time(encoding, false, value);
+		if (!bench_vmcs_fields[i].ro || write_ro) {
+			cycles[i][1] = bench_vmcs_field_time(encoding, true, value);
+		}
+	}
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Print minimum and maximum cycles per access of each field across CPUs. */
+static void bench_vmcs_field_print(u64 round)
+{
+	static const char *types[2] = { "vmread", "vmwrite" };
+	for (u32 i = 0; i < VMCS_FIELD_COUNT; i++) {
+		for (u32 write = 0; write < 2; write++) {
+			u32 cpus = 0;
+			u32 min = BENCH_VMCS_FIELD_NONE;
+			u32 max = 0;
+			u32 max_cpu = 0;
+			for (u32 j = 0; j < g_midtable_numentries; j++) {
+				u32 c = bench_vmcs_field_cycles[j][i][write];
+				if (c == BENCH_VMCS_FIELD_NONE) {
+					continue;
+				}
+				cpus++;
+				if (c < min) {
+					min = c;
+				}
+				if (c >= max) {
+					max = c;
+					max_cpu = g_vcpus[j].id;
+				}
+			}
+			if (cpus == 0) {
+				continue;
+			}
+			printf("BENCH_VMCS_FIELD: round=%lld field=0x%04x name=%s "
+				   "type=%s cpus=%u min=%u max=%u max_cpu=0x%02x\n", round,
+				   bench_vmcs_fields[i].encoding, bench_vmcs_fields[i].name,
+				   types[write], cpus, min, max, max_cpu);
+		}
+	}
+}
+
+/*
+ * Measure cycles per VMREAD / VMWRITE of every VMCS field in SHV (host mode)
+ * on all CPUs. When SHV runs in an L1 hypervisor, this shows how the L1
+ * handles each field (e.g. emulated, shadowed, cached). The BSP prints the
+ * summary after all CPUs finish.
+ */
+static void shv_bench_vmcs_fields(VCPU * vcpu, u64 round)
+{
+	vmcall_register(vcpu, BENCH_VMCALL_VMCS_FIELDS, bench_vmcall_vmcs_fields);
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_VMCS_FIELDS));
+	vmcall_deregister(vcpu, BENCH_VMCALL_VMCS_FIELDS,
+					  bench_vmcall_vmcs_fields);
+	smp_barrier_wait(&bench_barrier, vcpu);
+	if (vcpu->isbsp) {
+		bench_vmcs_field_print(round);
+	}
+	/* Results must not be overwritten by the next round before printing */
+	smp_barrier_wait(&bench_barrier, vcpu);
+}
+
+/*
+ * Measure the cost of finding the current VCPU using per-CPU data (GS) and
+ * using LAPIC ID. get_vcpu() is called at every VMEXIT and interrupt. In the
+ * guest, reading MSR_APIC_BASE for LAPIC ID causes a VMEXIT.
+ */
+static void shv_bench_get_vcpu(VCPU * vcpu, u64 round)
+{
+	static const char *types[2] = { "gs", "lapic" };
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats[2];
+	ulong_t flags;
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	for (u32 lapic = 0; lapic < 2; lapic++) {
+		for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+			u64 t0 = bench_rdtsc();
+			if (lapic) {
+				ASSERT(get_vcpu_by_lapic_id() == vcpu);
+			} else {
+				ASSERT(get_vcpu() == vcpu);
+			}
+			samples[i] = bench_rdtsc() - t0;
+		}
+		bench_compute_stats(samples, BENCH_SAMPLES, &stats[lapic]);
+	}
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	for (u32 lapic = 0; lapic < 2; lapic++) {
+		bench_print_stats(vcpu, round, "get-vcpu", types[lapic],
+						  &stats[lapic]);
+	}
+}
+
+/* Number of cpu_relax() in the critical section of the spinlock benchmark */
+#define BENCH_SPINLOCK_HOLD	16
+
+/* Lock and data shared by all CPUs in the spinlock benchmark */
+static spin_lock_t bench_spinlock;
+static volatile u64 bench_spinlock_count;
+
+/*
+ * Measure spinlock acquisition latency when all CPUs contend for the same
+ * lock. The spread between min and max shows the fairness of the spinlock
+ * implementation (SPINLOCK_IMPL).
+ */
+static void shv_bench_spinlock(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats;
+	ulong_t flags;
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	smp_barrier_wait(&bench_barrier, vcpu);
+	for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		spin_lock(&bench_spinlock);
+		samples[i] = bench_rdtsc() - t0;
+		bench_spinlock_count++;
+		for (u32 j = 0; j < BENCH_SPINLOCK_HOLD; j++) {
+			cpu_relax();
+		}
+		spin_unlock(&bench_spinlock);
+	}
+	smp_barrier_wait(&bench_barrier, vcpu);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	ASSERT(bench_spinlock_count ==
+		   round * BENCH_SAMPLES * g_midtable_numentries);
+	bench_compute_stats(samples, BENCH_SAMPLES, &stats);
+	bench_print_stats(vcpu, round, "spinlock", "acquire", &stats);
+	if (vcpu->isbsp) {
+		spin_lock_print_stats(&bench_spinlock, "bench");
+	}
+}
+
+/*
+ * Measure latency of smp_barrier_wait() when all CPUs call it back-to-back.
+ * The BSP prints the arrival skew of the last episode, which shows how far
+ * apart CPUs arrive (e.g. due to VMEXITs in L0 or vCPU preemption).
+ */
+static void shv_bench_barrier(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats;
+	ulong_t flags;
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	smp_barrier_wait(&bench_barrier, vcpu);
+	for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		smp_barrier_wait(&bench_barrier_timed, vcpu);
+		samples[i] = bench_rdtsc() - t0;
+	}
+	smp_barrier_wait(&bench_barrier, vcpu);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	bench_compute_stats(samples, BENCH_SAMPLES, &stats);
+	bench_print_stats(vcpu, round, "barrier", "wait", &stats);
+	if (vcpu->isbsp) {
+		smp_barrier_print(&bench_barrier_timed, "bench");
+	}
+	/* Arrival TSCs must not be overwritten by the next round before printing */
+	smp_barrier_wait(&bench_barrier, vcpu);
+}
+
+/* Number of lines printed by the serial benchmark, each line is 64 bytes */
+#define BENCH_SERIAL_LINES	64
+
+/* Return TSC frequency in Hz from CPUID, or 0 if unknown. */
+static u64 bench_tsc_hz(void)
+{
+	u32 max_leaf = cpuid_eax(0, 0);
+	if (max_leaf >= 0x15) {
+		u32 eax, ebx, ecx, edx;
+		cpuid(0x15, &eax, &ebx, &ecx, &edx);
+		if (eax != 0 && ebx != 0 && ecx != 0) {
+			return (u64) ecx * ebx / eax;
+		}
+	}
+	if (max_leaf >= 0x16) {
+		return (u64) (cpuid_eax(0x16, 0) & 0xffff) * 1000000;
+	}
+	return 0;
+}
+
+/*
+ * Print BENCH_SERIAL_LINES lines using the given UART mode and report
+ * throughput and UART accesses per byte. Each UART access is an I/O VMEXIT
+ * when the L1 hypervisor intercepts the serial port.
+ */
+static void bench_serial_mode(u64 round, const char *mode, u32 burst, bool irq)
+{
+	dbg_x86_uart_stats_t s0, s1;
+	u64 t0, t1, io, hz;
+
+	dbg_x86_uart_set_burst(burst);
+	if (irq) {
+		dbg_x86_uart_enable_irq();
+	}
+	dbg_x86_uart_get_stats(&s0);
+	t0 = bench_rdtsc();
+	for (u32 i = 0; i < BENCH_SERIAL_LINES; i++) {
+		printf("BENCH_SERIAL_FILL: %044d\n", i);
+	}
+	debug_log_drain();
+	if (irq) {
+		while (dbg_x86_uart_pending()) {
+			cpu_relax();
+		}
+	} else {
+		dbg_x86_uart_flush(true);
+	}
+	t1 = bench_rdtsc();
+	dbg_x86_uart_get_stats(&s1);
+	if (irq) {
+		dbg_x86_uart_disable_irq();
+	}
+
+	s1.bytes -= s0.bytes;
+	if (s1.bytes == 0) {
+		/* Serial port not in g_console_sinks */
+		return;
+	}
+	io = (s1.in - s0.in) + (s1.out - s0.out);
+	hz = bench_tsc_hz();
+	printf("BENCH_SERIAL: round=%lld mode=%s bytes=%lld cycles=%lld in=%lld "
+		   "out=%lld io_per_byte=%lld.%03lld bytes_per_sec=%lld\n", round,
+		   mode, s1.bytes, t1 - t0, s1.in - s0.in, s1.out - s0.out,
+		   io / s1.bytes, io * 1000 / s1.bytes % 1000,
+		   hz ? s1.bytes * hz / (t1 - t0) : 0ULL);
+}
+
+/*
+ * Measure serial output throughput when polling the UART for every byte
+ * (mode=byte), when writing a FIFO worth of bytes per poll (mode=fifo), and
+ * when the FIFO is refilled by the THR empty interrupt (mode=irq, requires
+ * SHV_USE_SERIAL_IRQ). Runs on the BSP while other CPUs wait.
+ */
+static void shv_bench_serial(VCPU * vcpu, u64 round)
+{
+	smp_barrier_wait(&bench_barrier, vcpu);
+	if (vcpu->isbsp) {
+		bool irq = dbg_x86_uart_irq_enabled();
+		if (irq) {
+			dbg_x86_uart_disable_irq();
+		}
+		bench_serial_mode(round, "byte", 1, false);
+		bench_serial_mode(round, "fifo", 0, false);
+		if (irq) {
+			bench_serial_mode(round, "irq", 0, true);
+			dbg_x86_uart_enable_irq();
+		}
+	}
+	smp_barrier_wait(&bench_barrier, vcpu);
+}
+
+/*
+ * Number of samples of the trace benchmark. The buffer is emptied before
+ * measuring, and must not become half full (TRACE_STREAM) or full during the
+ * measurement.
+ */
+#define BENCH_TRACE_SAMPLES (TRACE_RECORDS / 4)
+
+/*
+ * Measure the cost of recording a trace event (type=event, or type=disabled
+ * when "trace=" is not set) and of formatting a similar line as text
+ * (type=format), which is a lower bound of printf().
+ */
+static void shv_bench_trace(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	trace_buf_t *buf = &g_trace_bufs[vcpu->idx];
+	bench_stats_t stats[2];
+	ulong_t flags;
+	char line[64];
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	/* Print earlier records (e.g. VMEXITs), another CPU may be printing */
+	while (buf->head != buf->tail) {
+		trace_flush();
+		cpu_relax();
+	}
+	for (u32 i = 0; i < BENCH_TRACE_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		trace_event(TRACE_BENCH, i, 0, 0);
+		samples[i] = bench_rdtsc() - t0;
+	}
+	bench_compute_stats(samples, BENCH_TRACE_SAMPLES, &stats[0]);
+	for (u32 i = 0; i < BENCH_TRACE_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		snprintf(line, sizeof(line), "CPU(0x%02x): bench sample %d\n",
+				 vcpu->id, i);
+		samples[i] = bench_rdtsc() - t0;
+	}
+	bench_compute_stats(samples, BENCH_TRACE_SAMPLES, &stats[1]);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	bench_print_stats(vcpu, round, "trace",
+					  (g_trace & TRACE_ENABLE) ? "event" : "disabled",
+					  &stats[0]);
+	bench_print_stats(vcpu, round, "trace", "format", &stats[1]);
+	trace_flush();
+}
+
+/* Sizes and alignments (offset of destination) swept by the libc benchmark */
+static const u32 bench_libc_sizes[] = { 8, 64, 256, 1024, 4096, 16384 };
+static const u32 bench_libc_aligns[] = { 0, 1, 7 };
+
+#define BENCH_LIBC_MAX		16384
+#define BENCH_LIBC_SAMPLES	64
+
+static u8 bench_libc_buf[2][BENCH_LIBC_MAX + PAGE_SIZE_4K]
+	__attribute__((aligned(PAGE_SIZE_4K)));
+
+/* Measure one function (0 = memcpy, 1 = memset, 2 = memcmp). */
+static void bench_libc_func(u64 round, u32 func, u32 mode, u32 size,
+							u32 align)
+{
+	static const char *funcs[3] = { "memcpy", "memset", "memcmp" };
+	u64 *samples = bench_samples[get_vcpu()->idx];
+	u8 *dst = bench_libc_buf[0] + align;
+	u8 *src = bench_libc_buf[1];
+	bench_stats_t stats;
+
+	/* Warm up caches and TLB, and make memcmp() compare all bytes */
+	memset_mode(src, 0x5a, size, mode);
+	memcpy_mode(dst, src, size, mode);
+	for (u32 i = 0; i < BENCH_LIBC_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		switch (func) {
+		case 0:
+			memcpy_mode(dst, src, size, mode);
+			break;
+		case 1:
+			memset_mode(dst, 0x5a, size, mode);
+			break;
+		case 2:
+			ASSERT(memcmp_mode(dst, src, size, mode) == 0);
+			break;
+		default:
+			ASSERT(0);
+		}
+		samples[i] = bench_rdtsc() - t0;
+	}
+	bench_compute_stats(samples, BENCH_LIBC_SAMPLES, &stats);
+	printf("BENCH_LIBC: round=%lld func=%s mode=%s size=%u align=%u n=%u "
+		   "min=%lld med=%lld bytes_per_kcycle=%lld\n", round, funcs[func],
+		   g_libc_string_mode_names[mode], size, align, stats.n, stats.min,
+		   stats.med, (u64) size * 1000 / (stats.med ? stats.med : 1));
+}
+
+/*
+ * Sweep memcpy(), memset() and memcmp() over implementations, sizes and
+ * destination alignments. memcmp() has no string instruction version, so
+ * mode=rep and mode=erms are the same as mode=word for it. Runs on the BSP
+ * with interrupts disabled while other CPUs wait.
+ */
+static void shv_bench_libc(VCPU * vcpu, u64 round)
+{
+	smp_barrier_wait(&bench_barrier, vcpu);
+	if (vcpu->isbsp) {
+		const u32 nsizes = sizeof(bench_libc_sizes) / sizeof(u32);
+		const u32 naligns = sizeof(bench_libc_aligns) / sizeof(u32);
+		ulong_t flags;
+		asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+		printf("CPU(0x%02x): libc string default mode=%s\n", vcpu->id,
+			   g_libc_string_mode_names[g_libc_string_mode]);
+		for (u32 func = 0; func < 3; func++) {
+			for (u32 mode = 0; mode < LIBC_STRING_MODES; mode++) {
+				for (u32 s = 0; s < nsizes; s++) {
+					for (u32 a = 0; a < naligns; a++) {
+						bench_libc_func(round, func, mode, bench_libc_sizes[s],
+										bench_libc_aligns[a]);
+					}
+				}
+			}
+		}
+		if (flags & EFLAGS_IF) {
+			asm volatile ("sti");
+		}
+	}
+	smp_barrier_wait(&bench_barrier, vcpu);
+}
+
+/* Bytes written by simd_memset() in the VMEXIT handler of the xsave benchmark */
+#define BENCH_XSAVE_SIMD_BYTES	64
+
+static u8 bench_xsave_buf[MAX_VCPU_ENTRIES][BENCH_XSAVE_SIMD_BYTES];
+
+/* Set xsave policy of the current VCPU to EBX */
+static void bench_vmcall_xsave(VCPU * vcpu, struct regs *r,
+							   vmexit_info_t * info)
+{
+	xsave_set_policy(vcpu, r->ebx);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/* Empty VMEXIT handler, uses SIMD registers if EBX is not 0 */
+static void bench_vmcall_xsave_exit(VCPU * vcpu, struct regs *r,
+									vmexit_info_t * info)
+{
+	if (r->ebx) {
+		simd_memset(bench_xsave_buf[vcpu->idx], 0, BENCH_XSAVE_SIMD_BYTES);
+	}
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Measure VMEXIT round trip time with each xsave policy, when the handler
+ * does not use SIMD registers (type=<policy>) and when it does (type=
+ * <policy>-simd). With policy none, simd_memset() falls back to memset(). The
+ * difference between policies is the cost of XSAVE / XRSTOR per VMEXIT.
+ * Requires "xsave=" on the multiboot command line.
+ */
+static void shv_bench_xsave(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	bench_stats_t stats[XSAVE_POLICIES][2];
+	ulong_t flags;
+	u32 policy;
+
+	if (g_xsave_policy == XSAVE_POLICY_NONE) {
+		if (vcpu->isbsp) {
+			printf("CPU(0x%02x): xsave benchmark needs xsave=1 or xsave=2\n",
+				   vcpu->id);
+		}
+		return;
+	}
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	policy = xsave_get_policy(vcpu);
+	vmcall_register(vcpu, BENCH_VMCALL_XSAVE, bench_vmcall_xsave);
+	vmcall_register(vcpu, BENCH_VMCALL_XSAVE_EXIT, bench_vmcall_xsave_exit);
+	for (u32 p = 0; p < XSAVE_POLICIES; p++) {
+		asm volatile ("vmcall"::"a" (BENCH_VMCALL_XSAVE), "b"(p));
+		for (u32 simd = 0; simd < 2; simd++) {
+			for (u32 i = 0; i < 16; i++) {
+				asm volatile ("vmcall"::"a" (BENCH_VMCALL_XSAVE_EXIT),
+							  "b"(simd));
+			}
+			for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+				u64 t0 = bench_rdtsc();
+				asm volatile ("vmcall"::"a" (BENCH_VMCALL_XSAVE_EXIT),
+							  "b"(simd));
+				samples[i] = bench_rdtsc() - t0;
+			}
+			bench_compute_stats(samples, BENCH_SAMPLES, &stats[p][simd]);
+		}
+	}
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_XSAVE), "b"(policy));
+	vmcall_deregister(vcpu, BENCH_VMCALL_XSAVE_EXIT, bench_vmcall_xsave_exit);
+	vmcall_deregister(vcpu, BENCH_VMCALL_XSAVE, bench_vmcall_xsave);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	for (u32 p = 0; p < XSAVE_POLICIES; p++) {
+		char type[16];
+		bench_print_stats(vcpu, round, "xsave", g_xsave_policy_names[p],
+						  &stats[p][0]);
+		snprintf(type, sizeof(type), "%s-simd", g_xsave_policy_names[p]);
+		bench_print_stats(vcpu, round, "xsave", type, &stats[p][1]);
+	}
+}
+
+/* Remap SHV_EPT_SHARED_GPA to page EBX, save shootdown cycles to sample ECX */
+static void bench_vmcall_ept_shootdown(VCPU * vcpu, struct regs *r,
+									   vmexit_info_t * info)
+{
+	ASSERT(r->ecx < BENCH_SAMPLES);
+	bench_samples[vcpu->idx][r->ecx] = shv_ept_shared_remap(vcpu, r->ebx);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Measure EPT shootdown latency with SHV_USE_SHARED_EPT. For each sample, the
+ * BSP remaps SHV_EPT_SHARED_GPA in the shared EPT, sends IPIs and waits until
+ * all CPUs execute INVEPT. Other CPUs wait in the guest with interrupts
+ * enabled. Then all CPUs check that they see the new mapping.
+ */
+static void shv_bench_ept_shootdown(VCPU * vcpu, u64 round)
+{
+	bench_stats_t stats;
+
+	if (!(g_shv_opt & SHV_USE_SHARED_EPT) ||
+		(g_shv_opt & SHV_NO_EFLAGS_IF)) {
+		if (vcpu->isbsp) {
+			printf("CPU(0x%02x): EPT shootdown benchmark needs shared EPT "
+				   "and interrupts\n", vcpu->id);
+		}
+		return;
+	}
+
+	vmcall_register(vcpu, BENCH_VMCALL_EPT_SHOOTDOWN,
+					bench_vmcall_ept_shootdown);
+	for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+		u32 which = (i + 1) % 2;
+		smp_barrier_wait(&bench_barrier, vcpu);
+		if (vcpu->isbsp) {
+			asm volatile ("vmcall"::"a" (BENCH_VMCALL_EPT_SHOOTDOWN),
+						  "b"(which), "c"(i));
+		}
+		smp_barrier_wait(&bench_barrier, vcpu);
+		ASSERT(*(volatile u8 *)(uintptr_t) SHV_EPT_SHARED_GPA == which + 1);
+	}
+	vmcall_deregister(vcpu, BENCH_VMCALL_EPT_SHOOTDOWN,
+					  bench_vmcall_ept_shootdown);
+	if (vcpu->isbsp) {
+		char type[16];
+		bench_compute_stats(bench_samples[vcpu->idx], BENCH_SAMPLES, &stats);
+		snprintf(type, sizeof(type), "cpus-%u", g_midtable_numentries);
+		bench_print_stats(vcpu, round, "ept_shootdown", type, &stats);
+	}
+}
+
+/* Switch to EPT number EBX, like shv_guest_switch_ept_vmexit_handler() */
+static void bench_vmcall_ept_switch(VCPU * vcpu, struct regs *r,
+									vmexit_info_t * info)
+{
+	u64 eptp;
+	vcpu->ept_num = r->ebx;
+	eptp = shv_build_ept(vcpu, vcpu->ept_num);
+	__vmx_vmwrite64(VMCS_control_EPT_pointer, shv_ept_eptp(vcpu, eptp));
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Measure latency of switching between EPT numbers 0x00 and 0x10 using VMCALL
+ * (type=vmcall: VMEXIT, shv_build_ept() and INVEPT) and using VMFUNC EPTP
+ * switching (type=vmfunc, needs SHV_USE_VMFUNC and hardware support).
+ */
+static void shv_bench_ept_switch(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	u8 ept_num = vcpu->ept_num;
+	bench_stats_t stats;
+	ulong_t flags;
+
+	if (!(g_shv_opt & SHV_USE_EPT) || g_ept_count < 2) {
+		if (vcpu->isbsp) {
+			printf("CPU(0x%02x): EPT switch benchmark needs EPT and "
+				   "ept_count >= 2\n", vcpu->id);
+		}
+		return;
+	}
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	vmcall_register(vcpu, BENCH_VMCALL_EPT_SWITCH, bench_vmcall_ept_switch);
+	for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+		u64 t0 = bench_rdtsc();
+		asm volatile ("vmcall"::"a" (BENCH_VMCALL_EPT_SWITCH),
+					  "b"(((i + 1) % 2) << 4));
+		samples[i] = bench_rdtsc() - t0;
+	}
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_EPT_SWITCH), "b"(ept_num));
+	vmcall_deregister(vcpu, BENCH_VMCALL_EPT_SWITCH, bench_vmcall_ept_switch);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+	bench_compute_stats(samples, BENCH_SAMPLES, &stats);
+	bench_print_stats(vcpu, round, "ept_switch", "vmcall", &stats);
+
+	if (vcpu->ept_vmfunc) {
+		asm volatile ("cli":::"memory");
+		for (u32 i = 0; i < BENCH_SAMPLES; i++) {
+			u64 t0 = bench_rdtsc();
+			__vmx_vmfunc_eptp_switch((i + 1) % 2);
+			samples[i] = bench_rdtsc() - t0;
+		}
+		__vmx_vmfunc_eptp_switch(ept_num >> 4);
+		vcpu->ept_num = ept_num;
+		if (flags & EFLAGS_IF) {
+			asm volatile ("sti");
+		}
+		bench_compute_stats(samples, BENCH_SAMPLES, &stats);
+		bench_print_stats(vcpu, round, "ept_switch", "vmfunc", &stats);
+	}
+}
+
+/* Maximum of pml_pages= in command line */
+#define BENCH_PML_MAX_PAGES	512
+
+/* Number of harvests per round of the PML benchmark */
+#define BENCH_PML_HARVESTS	64
+
+/* Working set of the PML benchmark, each CPU writes to its own cache line */
+static u8 bench_pml_buf[BENCH_PML_MAX_PAGES][PAGE_SIZE_4K]
+ ALIGNED_PAGE;
+
+static u64 bench_pml_harvested[MAX_VCPU_ENTRIES];
+
+/* Harvest dirty pages of the current EPT */
+static void bench_vmcall_pml_harvest(VCPU * vcpu, struct regs *r,
+									 vmexit_info_t * info)
+{
+	(void)r;
+	bench_pml_harvested[vcpu->idx] += shv_ept_harvest_dirty(vcpu);
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Measure dirty page tracking: the guest writes to each page of a working set
+ * of pml_pages= pages, then asks the hypervisor to harvest dirty pages, for
+ * BENCH_PML_HARVESTS times. Harvesting uses PML with SHV_USE_PML (mode=pml)
+ * and scans EPT dirty flags otherwise (mode=scan). Reports dirty pages
+ * harvested per second and VMEXITs (harvest VMCALLs and PML full VMEXITs) per
+ * harvest. The harvest latency is printed as test=pml_harvest. With 2M EPT
+ * pages, each dirty 2M page is reported once; use SHV_EPT_4K_ONLY to track
+ * 4K pages.
+ */
+static void shv_bench_pml(VCPU * vcpu, u64 round)
+{
+	u64 *samples = bench_samples[vcpu->idx];
+	const char *mode = vcpu->ept_pml ? "pml" : "scan";
+	u32 pages = g_pml_pages;
+	u64 t0, t1, exits, hz;
+	bench_stats_t stats;
+	ulong_t flags;
+
+	if (!vcpu->ept_ad || (g_shv_opt & SHV_USE_SHARED_EPT) ||
+		g_pml_pages == 0 || g_pml_pages > BENCH_PML_MAX_PAGES) {
+		if (vcpu->isbsp) {
+			printf("CPU(0x%02x): PML benchmark needs EPT A/D flags, no shared "
+				   "EPT and 1 <= pml_pages <= %d\n", vcpu->id,
+				   BENCH_PML_MAX_PAGES);
+		}
+		return;
+	}
+
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	vmcall_register(vcpu, BENCH_VMCALL_PML_HARVEST, bench_vmcall_pml_harvest);
+	/* Start from a clean state */
+	asm volatile ("vmcall"::"a" (BENCH_VMCALL_PML_HARVEST));
+	bench_pml_harvested[vcpu->idx] = 0;
+	exits = shv_ept_pml_full_exits(vcpu);
+	t0 = bench_rdtsc();
+	for (u32 i = 0; i < BENCH_PML_HARVESTS; i++) {
+		u64 t;
+		for (u32 p = 0; p < pages; p++) {
+			*(volatile u8 *)&bench_pml_buf[p][vcpu->idx * 64] = (u8) i;
+		}
+		t = bench_rdtsc();
+		asm volatile ("vmcall"::"a" (BENCH_VMCALL_PML_HARVEST));
+		samples[i] = bench_rdtsc() - t;
+	}
+	t1 = bench_rdtsc();
+	exits = shv_ept_pml_full_exits(vcpu) - exits + BENCH_PML_HARVESTS;
+	vmcall_deregister(vcpu, BENCH_VMCALL_PML_HARVEST,
+					  bench_vmcall_pml_harvest);
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+
+	hz = bench_tsc_hz();
+	printf("BENCH_PML: cpu=0x%02x round=%lld mode=%s pages=%u harvests=%d "
+		   "harvested=%lld cycles=%lld exits=%lld exits_per_harvest=%lld.%02lld "
+		   "pages_per_sec=%lld\n", vcpu->id, round, mode, pages,
+		   BENCH_PML_HARVESTS, bench_pml_harvested[vcpu->idx], t1 - t0, exits,
+		   exits / BENCH_PML_HARVESTS, exits * 100 / BENCH_PML_HARVESTS % 100,
+		   hz ? bench_pml_harvested[vcpu->idx] * hz / (t1 - t0) : 0ULL);
+	bench_compute_stats(samples, BENCH_PML_HARVESTS, &stats);
+	bench_print_stats(vcpu, round, "pml_harvest", mode, &stats);
+}
+
+/* Main logic to call benchmarks, never returns */
+void shv_bench_main(VCPU * vcpu)
+{
+	u64 round = 0;
+	while (1) {
+		/* Assume that round never wraps around */
+		ASSERT(++round > 0);
+		printf("CPU(0x%02x): SHV bench round %lld\n", vcpu->id, round);
+		if (g_shv_opt & SHV_BENCH_VMEXIT) {
+			shv_bench_vmexit(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_FAST_PATH) {
+			shv_bench_fast_path(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_VMCS_SHADOW) {
+			shv_bench_vmcs_shadow(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_VMCS_FIELDS) {
+			shv_bench_vmcs_fields(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_GET_VCPU) {
+			shv_bench_get_vcpu(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_SPINLOCK) {
+			shv_bench_spinlock(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_BARRIER) {
+			shv_bench_barrier(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_SERIAL) {
+			shv_bench_serial(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_TRACE) {
+			shv_bench_trace(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_LIBC) {
+			shv_bench_libc(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_XSAVE) {
+			shv_bench_xsave(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_EPT_SHOOTDOWN) {
+			shv_bench_ept_shootdown(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_EPT_SWITCH) {
+			shv_bench_ept_switch(vcpu, round);
+		}
+		if (g_shv_opt & SHV_BENCH_PML) {
+			shv_bench_pml(vcpu, round);
+		}
+		if (g_shv_opt & SHV_PRINT_EXIT_STATS) {
+			asm volatile ("vmcall"::"a" (SHV_VMCALL_EXIT_STATS));
+		}
+		if (!(g_shv_opt & (SHV_NO_EFLAGS_IF | SHV_NO_INTERRUPT))) {
+			asm volatile ("hlt");
+		}
+	}
+}
@@ -19,38 +19,109 @@
 #include <xmhf.h>
 #include <shv.h>
 
-#define EPT_POOL_SIZE 128
+/*
+ * Number of 4K pages in the EPT page pool. The pool is shared by all CPUs.
+ * Except pages of the shared EPT, each CPU may use an equal share of it.
+ */
+#define EPT_POOL_PAGES 1024
 
 extern u8 _shv_ept_low[];
 extern u8 _shv_ept_high[];
 
-/* Whether the EPT is already built. If so, store EPTP */
-static u8 ept_valid[MAX_VCPU_ENTRIES][SHV_EPT_COUNT];
+/* Root EPT page of each EPT, 0 if the EPT is not built */
+static spa_t ept_root_pa[MAX_VCPU_ENTRIES][SHV_EPT_MAX];
+
+/* TSC when each EPT is last switched to, used to select EPTs to reclaim */
+static u64 ept_last_use[MAX_VCPU_ENTRIES][SHV_EPT_MAX];
 
-/* Root EPT pages */
-static u8 ept_root[MAX_VCPU_ENTRIES][SHV_EPT_COUNT][PAGE_SIZE_4K]
+/*
+ * EPTP list for VMFUNC EPTP switching, entry i is the EPTP of EPT number
+ * (i << 4). EPTs in the list are never reclaimed.
+ */
+static u64 ept_eptp_list[MAX_VCPU_ENTRIES][PAGE_SIZE_4K / sizeof(u64)]
  ALIGNED_PAGE;
 
-/* Physical memory for storing more  */
-static u8 ept_pool[MAX_VCPU_ENTRIES][SHV_EPT_COUNT][EPT_POOL_SIZE][PAGE_SIZE_4K]
+/* Physical memory for storing EPT paging structures (including roots) */
+static u8 ept_pool[EPT_POOL_PAGES][PAGE_SIZE_4K]
  ALIGNED_PAGE;
 
-/* Indicate whether the page in ept_pool is free */
-static u8 ept_alloc[MAX_VCPU_ENTRIES][SHV_EPT_COUNT][EPT_POOL_SIZE];
+/* Bit i is set when ept_pool[i] is allocated, protected by ept_pool_lock */
+static u64 ept_pool_bitmap[EPT_POOL_PAGES / 64];
+static spin_lock_t ept_pool_lock;
+static u32 ept_pool_used;			/* Number of allocated pages */
+static u32 ept_pool_peak;			/* High-water mark of ept_pool_used */
+
+/* Bit i is set when ept_pool[i] belongs to the shared EPT */
+static u64 ept_pool_shared[EPT_POOL_PAGES / 64];
+static u32 ept_shared_pages;		/* Number of pages in the shared EPT */
+
+/*
+ * With SHV_USE_SHARED_EPT, the identity mappings are built once in the shared
+ * EPT. The EPT of each CPU starts as a copy of the shared root page, and
+ * paging structures are copied from the shared EPT only when a CPU changes
+ * them (e.g. to map 0x12340000).
+ */
+static spin_lock_t ept_shared_lock;
+static spa_t ept_shared_root_pa;
+
+/* Pages that SHV_EPT_SHARED_GPA can be mapped to in the shared EPT */
+static u8 ept_shared_target[2][PAGE_SIZE_4K]
+ ALIGNED_PAGE;
+
+/*
+ * EPT shootdown: after changing the shared EPT, a CPU increments
+ * ept_shootdown_gen and sends SHV_EPT_SHOOTDOWN_VECTOR to other CPUs. Each
+ * CPU invalidates its EPTs using INVEPT, then sets ept_shootdown_seen to the
+ * generation. ept_shootdown_busy serializes CPUs changing the shared EPT.
+ */
+static volatile u32 ept_shootdown_gen;
+static volatile u32 ept_shootdown_seen[MAX_VCPU_ENTRIES];
+static volatile u32 ept_shootdown_busy;
 
 /* Memory to be mapped */
 static u8 ept_target[256][PAGE_SIZE_4K]
  ALIGNED_PAGE;
 
+/* Dirty flag in EPT leaf entries, used when vcpu->ept_ad */
+#define EPT_PME_DIRTY		(1ULL << 9)
+
+/* Page-modification log of each CPU, used when vcpu->ept_pml */
+static u64 ept_pml_log[MAX_VCPU_ENTRIES][SHV_EPT_PML_ENTRIES]
+ ALIGNED_PAGE;
+
 /* Large pages to be swapped */
 u8 large_pages[2][PAGE_SIZE_2M] __attribute__((aligned(PAGE_SIZE_2M)));
 
 typedef struct {
 	hptw_ctx_t ctx;
-	 u8(*page_pool)[PAGE_SIZE_4K];
-	u8 *page_alloc;
+	VCPU *vcpu;
+	u32 index;					/* ept_num >> 4, not reclaimed when allocating */
 } shv_ept_ctx_t;
 
+/* Number of guest-physical ranges identity-mapped in EPT */
+#define EPT_ID_MAP_RANGES 4
+
+/*
+ * EPT build statistics of each CPU. With SHV_USE_LAZY_EPT, pages are mapped
+ * when EPT violations happen, so faults and cycles grow as the guest runs.
+ */
+static struct {
+	u64 faults;					/* EPT violations handled by lazy mapping */
+	u64 leaves[3];				/* 4K, 2M and 1G pages identity-mapped */
+	u64 cycles;					/* TSC cycles spent mapping pages */
+	u64 reclaims;				/* EPTs destroyed to free pages */
+	u32 pages;					/* Pages allocated from ept_pool */
+	u32 peak;					/* High-water mark of pages */
+	u64 shootdowns;				/* Shootdowns sent */
+	u64 shootdown_cycles;		/* TSC cycles spent sending shootdowns */
+	u64 flushes;				/* Shootdowns received */
+	u64 pml_full_exits;			/* PML full VMEXITs */
+	u64 pml_pending;			/* GPAs drained from PML log, not harvested */
+	u64 harvests;				/* Calls to shv_ept_harvest_dirty() */
+	u64 harvested;				/* Dirty pages returned by harvests */
+	u64 harvest_cycles;			/* TSC cycles spent in harvests */
+} ept_stats[MAX_VCPU_ENTRIES];
+
 // Structure that captures fixed MTRR properties
 struct _fixed_mtrr_prop_t {
 	u32 msr;					/* MSR register address (ECX in RDMSR / WRMSR) */
@@ -71,19 +142,210 @@ struct _fixed_mtrr_prop_t {
 	{IA32_MTRR_FIX4K_F8000, 0x000F8000, 0x00001000, 0x00100000},
 };
 
+/* Number of pages each CPU may allocate from ept_pool. */
+static u32 ept_pool_quota(void)
+{
+	return (EPT_POOL_PAGES - ept_shared_pages) / g_midtable_numentries;
+}
+
+/*
+ * Allocate a zeroed page from ept_pool. Return NULL if the pool is full or the
+ * current CPU has used up its quota. If vcpu is NULL, allocate a page for the
+ * shared EPT.
+ */
+static void *ept_page_alloc(VCPU * vcpu)
+{
+	void *ans = NULL;
+	if (vcpu && ept_stats[vcpu->idx].pages >= ept_pool_quota()) {
+		return NULL;
+	}
+	spin_lock(&ept_pool_lock);
+	for (u32 i = 0; i < EPT_POOL_PAGES / 64; i++) {
+		if (~ept_pool_bitmap[i]) {
+			u32 bit = __builtin_ctzll(~ept_pool_bitmap[i]);
+			ept_pool_bitmap[i] |= 1ULL << bit;
+			if (!vcpu) {
+				ept_pool_shared[i] |= 1ULL << bit;
+				ept_shared_pages++;
+			}
+			ans = ept_pool[i * 64 + bit];
+			if (++ept_pool_used > ept_pool_peak) {
+				ept_pool_peak = ept_pool_used;
+			}
+			break;
+		}
+	}
+	spin_unlock(&ept_pool_lock);
+	if (ans) {
+		if (vcpu &&
+			++ept_stats[vcpu->idx].pages > ept_stats[vcpu->idx].peak) {
+			ept_stats[vcpu->idx].peak = ept_stats[vcpu->idx].pages;
+		}
+		memset(ans, 0, PAGE_SIZE_4K);
+	}
+	return ans;
+}
+
+/* Return a page allocated by ept_page_alloc() to ept_pool. */
+static void ept_page_free(VCPU * vcpu, void *page)
+{
+	u32 i = ((u8 *) page - ept_pool[0]) / PAGE_SIZE_4K;
+	ASSERT(i < EPT_POOL_PAGES);
+	spin_lock(&ept_pool_lock);
+	ASSERT(ept_pool_bitmap[i / 64] & (1ULL << (i % 64)));
+	ASSERT(!!(ept_pool_shared[i / 64] & (1ULL << (i % 64))) == !vcpu);
+	ept_pool_bitmap[i / 64] &= ~(1ULL << (i % 64));
+	if (!vcpu) {
+		ept_pool_shared[i / 64] &= ~(1ULL << (i % 64));
+		ept_shared_pages--;
+	}
+	ept_pool_used--;
+	spin_unlock(&ept_pool_lock);
+	if (vcpu) {
+		ASSERT(ept_stats[vcpu->idx].pages);
+		ept_stats[vcpu->idx].pages--;
+	}
+}
+
+/* Return whether the paging structure at pa belongs to the shared EPT. */
+static bool ept_page_is_shared(hpt_pa_t pa)
+{
+	u32 i = ((u8 *) spa2hva(pa) - ept_pool[0]) / PAGE_SIZE_4K;
+	ASSERT(i < EPT_POOL_PAGES);
+	return !!(ept_pool_shared[i / 64] & (1ULL << (i % 64)));
+}
+
+/*
+ * Free the paging structure at pa of level lvl and all tables below it.
+ * Paging structures of the shared EPT are only freed when vcpu is NULL.
+ */
+static void ept_free_table(VCPU * vcpu, hpt_pa_t pa, int lvl)
+{
+	hpt_pme_t *pm = (hpt_pme_t *) spa2hva(pa);
+	if (vcpu && ept_page_is_shared(pa)) {
+		return;
+	}
+	if (lvl > 1) {
+		size_t n = hpt_pm_size(HPT_TYPE_EPT, lvl) / sizeof(hpt_pme_t);
+		for (size_t i = 0; i < n; i++) {
+			hpt_pmeo_t pmeo = {.pme = pm[i],.t = HPT_TYPE_EPT,.lvl = lvl };
+			if (hpt_pmeo_is_present(&pmeo) && !hpt_pmeo_is_page(&pmeo)) {
+				ept_free_table(vcpu, hpt_pmeo_get_address(&pmeo), lvl - 1);
+			}
+		}
+	}
+	ept_page_free(vcpu, pm);
+}
+
+/* Tear down EPT number index (ept_num >> 4) and free its paging structures. */
+static void ept_destroy(VCPU * vcpu, u32 index)
+{
+	spa_t root_pa = ept_root_pa[vcpu->idx][index];
+	ASSERT(root_pa);
+	ept_free_table(vcpu, root_pa, hpt_root_lvl(HPT_TYPE_EPT));
+	ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT, shv_ept_eptp(vcpu, root_pa)));
+	ept_root_pa[vcpu->idx][index] = 0;
+}
+
+/*
+ * Destroy the least recently used EPT of the current CPU other than keep.
+ * Return false if there is no such EPT.
+ */
+static bool ept_reclaim(VCPU * vcpu, u32 keep)
+{
+	u32 victim = SHV_EPT_MAX;
+	for (u32 i = 0; i < SHV_EPT_MAX; i++) {
+		if (i == keep || !ept_root_pa[vcpu->idx][i] ||
+			ept_eptp_list[vcpu->idx][i]) {
+			continue;
+		}
+		if (victim == SHV_EPT_MAX ||
+			ept_last_use[vcpu->idx][i] < ept_last_use[vcpu->idx][victim]) {
+			victim = i;
+		}
+	}
+	if (victim == SHV_EPT_MAX) {
+		return false;
+	}
+	ept_destroy(vcpu, victim);
+	ept_stats[vcpu->idx].reclaims++;
+	return true;
+}
+
+/* Allocate a page for EPT index, reclaiming other EPTs of this CPU if needed */
+static void *ept_page_alloc_reclaim(VCPU * vcpu, u32 index)
+{
+	void *ans;
+	while (!(ans = ept_page_alloc(vcpu))) {
+		if (!vcpu || !ept_reclaim(vcpu, index)) {
+			break;
+		}
+	}
+	return ans;
+}
+
 static void *shv_ept_gzp(void *vctx, size_t alignment, size_t sz)
 {
 	shv_ept_ctx_t *ept_ctx = (shv_ept_ctx_t *) vctx;
-	u32 i;
 	ASSERT(alignment == PAGE_SIZE_4K);
 	ASSERT(sz == PAGE_SIZE_4K);
-	for (i = 0; i < EPT_POOL_SIZE; i++) {
-		if (!ept_ctx->page_alloc[i]) {
-			ept_ctx->page_alloc[i] = 1;
-			return ept_ctx->page_pool[i];
+	return ept_page_alloc_reclaim(ept_ctx->vcpu, ept_ctx->index);
+}
+
+/*
+ * Make paging structures above level lvl for addr private to the EPT of
+ * ept_ctx, copying paging structures of the shared EPT on the way.
+ */
+static void ept_unshare_path(shv_ept_ctx_t * ept_ctx, int lvl, u64 addr)
+{
+	hpt_pmo_t pmo = {
+		.t = HPT_TYPE_EPT,
+		.lvl = hpt_root_lvl(HPT_TYPE_EPT),
+		.pm = (hpt_pm_t) spa2hva(ept_ctx->ctx.root_pa),
+	};
+	ASSERT(!ept_page_is_shared(ept_ctx->ctx.root_pa));
+	while (pmo.lvl > lvl) {
+		hpt_pmeo_t pmeo;
+		hpt_pm_get_pmeo_by_va(&pmeo, &pmo, addr);
+		if (!hpt_pmeo_is_present(&pmeo) || hpt_pmeo_is_page(&pmeo)) {
+			break;
+		}
+		if (ept_page_is_shared(hpt_pmeo_get_address(&pmeo))) {
+			void *copy = ept_page_alloc_reclaim(ept_ctx->vcpu, ept_ctx->index);
+			ASSERT(copy);
+			memcpy(copy, spa2hva(hpt_pmeo_get_address(&pmeo)), PAGE_SIZE_4K);
+			hpt_pmeo_set_address(&pmeo, hva2spa(copy));
+			hpt_pmo_set_pme_by_va(&pmo, &pmeo, addr);
+		}
+		ASSERT(hptw_next_lvl(&ept_ctx->ctx, &pmo, addr));
+	}
+}
+
+/*
+ * Insert pmeo for guest-physical address addr. If a large page replaces a
+ * paging structure, free the paging structure and flush cached translations
+ * that may still reference it.
+ */
+static void ept_insert_pmeo(shv_ept_ctx_t * ept_ctx, hpt_pmeo_t * pmeo,
+							u64 addr)
+{
+	if (ept_ctx->vcpu && (g_shv_opt & SHV_USE_SHARED_EPT)) {
+		ept_unshare_path(ept_ctx, pmeo->lvl, addr);
+	}
+	if (pmeo->lvl > 1) {
+		hpt_pmeo_t old;
+		hptw_get_pmeo(&old, &ept_ctx->ctx, pmeo->lvl, addr);
+		if (old.lvl == pmeo->lvl && hpt_pmeo_is_present(&old) &&
+			!hpt_pmeo_is_page(&old)) {
+			/* The shared EPT has no vcpu, use the current CPU's EPTP format */
+			VCPU *vcpu = ept_ctx->vcpu ? ept_ctx->vcpu : get_vcpu();
+			ept_free_table(ept_ctx->vcpu, hpt_pmeo_get_address(&old),
+						   old.lvl - 1);
+			ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT,
+								shv_ept_eptp(vcpu, ept_ctx->ctx.root_pa)));
 		}
 	}
-	return NULL;
+	ASSERT(hptw_insert_pmeo_alloc(&ept_ctx->ctx, pmeo, addr) == 0);
 }
 
 static hpt_pa_t shv_ept_ptr2pa(void *vctx, void *ptr)
@@ -103,7 +365,10 @@ static void *shv_ept_pa2ptr(void *vctx, hpt_pa_t spa, size_t sz,
 	return spa2hva(spa);
 }
 
-/* Get memory type from MTRR, similar to _vmx_getmemorytypeforphysicalpage() */
+/*
+ * Get memory type from MTRR, similar to _vmx_getmemorytypeforphysicalpage().
+ * This is slow, EPT construction uses ept_mtrr_lookup() instead.
+ */
 static u8 ept_get_mem_type(VCPU * vcpu, u64 pagebaseaddr)
 {
 	u32 prev_type = MTRR_TYPE_RESV;
@@ -118,7 +383,7 @@ static u8 ept_get_mem_type(VCPU * vcpu, u64 pagebaseaddr)
 		for (i = 0; i < NUM_FIXED_MTRRS; i++) {
 			struct _fixed_mtrr_prop_t *prop = &fixed_mtrr_prop[i];
 			if (pagebaseaddr < prop->end) {
-				u32 index = (prop->start - pagebaseaddr) / prop->step;
+				u32 index = (pagebaseaddr - prop->start) / prop->step;
 				u64 msrval = vcpu->vmx_guestmtrrmsrs.fix_mtrrs[i];
 				return (u8) (msrval >> (index * 8));
 			}
@@ -153,9 +418,10 @@ static u8 ept_get_mem_type(VCPU * vcpu, u64 pagebaseaddr)
 		} else if (prev_type == MTRR_TYPE_WT && cur_type == MTRR_TYPE_WB) {
 			prev_type = MTRR_TYPE_WT;
 		} else {
-			printf("Conflicting MTRR types (%u, %u), HALT!\n", prev_type,
-				   cur_type);
-			HALT();
+			/* Undefined by the SDM, be conservative */
+			printf("Conflicting MTRR types (%u, %u) at 0x%08llx, use UC\n",
+				   prev_type, cur_type, pagebaseaddr);
+			prev_type = MTRR_TYPE_UC;
 		}
 	}
 	/* If not covered by any MTRR, use default type */
@@ -165,21 +431,329 @@ static u8 ept_get_mem_type(VCPU * vcpu, u64 pagebaseaddr)
 	return prev_type;
 }
 
+/* Maximum number of intervals: fixed MTRR ranges, 2 per variable MTRR, 1 */
+#define EPT_MTRR_MAX_INTERVALS (88 + 2 * MAX_VARIABLE_MTRR_PAIRS + 1)
+
+/*
+ * Memory type interval map of each CPU, computed by ept_mtrr_map_init(). The
+ * intervals [start[i], start[i + 1]) (the last one ends at MAXPHYADDR) are
+ * sorted, cover all physical memory and have type[i]. Adjacent intervals have
+ * different types. n = 0 means the map could not be built (non-contiguous
+ * variable MTRR mask), and ept_mtrr_lookup() falls back to
+ * ept_get_mem_type() for every 4K page.
+ */
+static struct {
+	u32 n;
+	u64 start[EPT_MTRR_MAX_INTERVALS];
+	u8 type[EPT_MTRR_MAX_INTERVALS];
+} ept_mtrr_map[MAX_VCPU_ENTRIES];
+
+/* Add a boundary to the sorted array bounds of size *n, ignoring duplicates */
+static void ept_mtrr_add_bound(u64 * bounds, u32 * n, u64 addr)
+{
+	u32 i = *n;
+	while (i > 0 && bounds[i - 1] > addr) {
+		i--;
+	}
+	if (i > 0 && bounds[i - 1] == addr) {
+		return;
+	}
+	ASSERT(*n < EPT_MTRR_MAX_INTERVALS);
+	for (u32 j = *n; j > i; j--) {
+		bounds[j] = bounds[j - 1];
+	}
+	bounds[i] = addr;
+	(*n)++;
+}
+
+/*
+ * Build the memory type interval map of the current CPU from the MTRR MSRs
+ * saved in vcpu. The type of each interval is computed by ept_get_mem_type()
+ * at its start, so the map follows the same policy.
+ */
+static void ept_mtrr_map_init(VCPU * vcpu)
+{
+	u64 top = vcpu->vmx_ept_paddrmask + PA_PAGE_SIZE_4K;
+	u64 bounds[EPT_MTRR_MAX_INTERVALS];
+	u32 nbounds = 0;
+	u32 n = 0;
+
+	ept_mtrr_map[vcpu->idx].n = 0;
+	ept_mtrr_add_bound(bounds, &nbounds, 0);
+	if (vcpu->vmx_ept_mtrr_enable) {
+		if (vcpu->vmx_ept_fixmtrr_enable) {
+			for (u32 i = 0; i < NUM_FIXED_MTRRS; i++) {
+				struct _fixed_mtrr_prop_t *prop = &fixed_mtrr_prop[i];
+				for (u32 addr = prop->start; addr < prop->end;
+					 addr += prop->step) {
+					ept_mtrr_add_bound(bounds, &nbounds, addr);
+				}
+			}
+			ept_mtrr_add_bound(bounds, &nbounds, 0x100000ULL);
+		}
+		for (u32 i = 0; i < vcpu->vmx_guestmtrrmsrs.var_count; i++) {
+			u64 base = vcpu->vmx_guestmtrrmsrs.var_mtrrs[i].base;
+			u64 mask = vcpu->vmx_guestmtrrmsrs.var_mtrrs[i].mask;
+			u64 size;
+			/* Check valid bit */
+			if (!(mask & (1ULL << 11))) {
+				continue;
+			}
+			size = (~mask & vcpu->vmx_ept_paddrmask) + PA_PAGE_SIZE_4K;
+			if (size & (size - 1)) {
+				printf("CPU(0x%02x): non-contiguous MTRR mask 0x%llx\n",
+					   vcpu->id, mask);
+				return;
+			}
+			base &= vcpu->vmx_ept_paddrmask & ~(size - 1);
+			ept_mtrr_add_bound(bounds, &nbounds, base);
+			if (base + size < top) {
+				ept_mtrr_add_bound(bounds, &nbounds, base + size);
+			}
+		}
+	}
+
+	/* Compute types and merge adjacent intervals with the same type */
+	for (u32 i = 0; i < nbounds; i++) {
+		u8 type = ept_get_mem_type(vcpu, bounds[i]);
+		if (n > 0 && ept_mtrr_map[vcpu->idx].type[n - 1] == type) {
+			continue;
+		}
+		ept_mtrr_map[vcpu->idx].start[n] = bounds[i];
+		ept_mtrr_map[vcpu->idx].type[n] = type;
+		n++;
+	}
+	ept_mtrr_map[vcpu->idx].n = n;
+}
+
+/*
+ * Return the memory type of paddr, and set *end to the end of the run of
+ * addresses with the same type that starts at paddr. O(log n).
+ */
+static u8 ept_mtrr_lookup(VCPU * vcpu, u64 paddr, u64 * end)
+{
+	u32 n = ept_mtrr_map[vcpu->idx].n;
+	u64 *start = ept_mtrr_map[vcpu->idx].start;
+	u32 lo = 0;
+	u32 hi = n;
+
+	if (n == 0) {
+		*end = (paddr & ~(PA_PAGE_SIZE_4K - 1)) + PA_PAGE_SIZE_4K;
+		return ept_get_mem_type(vcpu, paddr);
+	}
+	/* Find the last interval with start <= paddr, start[0] is 0 */
+	while (hi - lo > 1) {
+		u32 mid = (lo + hi) / 2;
+		if (start[mid] <= paddr) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*end = (lo + 1 < n) ? start[lo + 1] :
+		vcpu->vmx_ept_paddrmask + PA_PAGE_SIZE_4K;
+	return ept_mtrr_map[vcpu->idx].type[lo];
+}
+
+/*
+ * Return the largest EPT level (1 = 4K, 2 = 2M, 3 = 1G) that can identity-map
+ * paddr without exceeding high, given that the memory type is uniform until
+ * type_end.
+ */
+static int ept_map_level(VCPU * vcpu, u64 paddr, u64 high, u64 type_end)
+{
+	u64 cap = vcpu->vmx_msrs[INDEX_IA32_VMX_EPT_VPID_CAP_MSR];
+	if (type_end < high) {
+		high = type_end;
+	}
+	if (g_shv_opt & SHV_EPT_4K_ONLY) {
+		return 1;
+	}
+	/* IA32_VMX_EPT_VPID_CAP bit 17: 1G pages; bit 16: 2M pages */
+	if ((cap & (1ULL << 17)) && PA_PAGE_ALIGNED_1G(paddr) &&
+		high - paddr >= PA_PAGE_SIZE_1G) {
+		return 3;
+	}
+	if ((cap & (1ULL << 16)) && PA_PAGE_ALIGNED_2M(paddr) &&
+		high - paddr >= PA_PAGE_SIZE_2M) {
+		return 2;
+	}
+	return 1;
+}
+
+/*
+ * Identity-map [low, high) using the largest pages with uniform memory type,
+ * unless SHV_EPT_4K_ONLY. If skip_present, addresses that are already mapped
+ * (e.g. swapped large_pages) are left unchanged, and smaller pages are used
+ * where paging structures already exist.
+ */
 static void ept_map_continuous_addr(VCPU * vcpu, shv_ept_ctx_t * ept_ctx,
-									hpt_pmeo_t * pmeo, u64 low, u64 high)
+									u64 low, u64 high, bool skip_present)
+{
+	u64 paddr = low;
+	while (paddr < high) {
+		hpt_pmeo_t pmeo = {.t = HPT_TYPE_EPT };
+		u64 type_end;
+		u8 type = ept_mtrr_lookup(vcpu, paddr, &type_end);
+		pmeo.lvl = ept_map_level(vcpu, paddr, high, type_end);
+		if (skip_present) {
+			hpt_pmeo_t old;
+			/* Do not replace existing paging structures by a large page */
+			for (;;) {
+				hptw_get_pmeo(&old, &ept_ctx->ctx, pmeo.lvl, paddr);
+				if (old.lvl != pmeo.lvl || !hpt_pmeo_is_present(&old) ||
+					hpt_pmeo_is_page(&old)) {
+					break;
+				}
+				pmeo.lvl--;
+			}
+			if (hpt_pmeo_is_present(&old)) {
+				/* Keep the existing mapping */
+				u64 size = hpt_pmeo_page_size(&old);
+				paddr = (paddr & ~(size - 1)) + size;
+				continue;
+			}
+		}
+		if (pmeo.lvl > 1) {
+			hpt_pmeo_set_page(&pmeo, true);
+		}
+		hpt_pmeo_setuser(&pmeo, true);
+		hpt_pmeo_setprot(&pmeo, HPT_PROTS_RWX);
+		hpt_pmeo_setcache(&pmeo, type);
+		hpt_pmeo_set_address(&pmeo, paddr);
+		ept_insert_pmeo(ept_ctx, &pmeo, paddr);
+		ept_stats[vcpu->idx].leaves[pmeo.lvl - 1]++;
+		paddr += hpt_pmeo_page_size(&pmeo);
+	}
+}
+
+/* Guest-physical ranges [ranges[i][0], ranges[i][1]) identity-mapped in EPT */
+static void ept_get_id_map(u64 ranges[EPT_ID_MAP_RANGES][2])
+{
+	/* Regular memory */
+	ranges[0][0] = (uintptr_t) _shv_ept_low;
+	ranges[0][1] = (uintptr_t) _shv_ept_high;
+	/* LAPIC */
+	ranges[1][0] = 0xfee00000;
+	ranges[1][1] = 0xfee01000;
+	/* Console */
+	ranges[2][0] = 0x000b8000;
+	ranges[2][1] = 0x000b9000;
+	/* Real mode */
+	ranges[3][0] = 0x00000000;
+	ranges[3][1] = 0x00100000;
+}
+
+/*
+ * Set up context to modify the EPT at root_pa. vcpu and index select the CPU
+ * and EPT that new pages are allocated for (vcpu is NULL for the shared EPT).
+ */
+static void ept_ctx_init_root(shv_ept_ctx_t * ept_ctx, VCPU * vcpu, u32 index,
+							  spa_t root_pa)
+{
+	ASSERT(root_pa);
+	ept_ctx->ctx.gzp = shv_ept_gzp;
+	ept_ctx->ctx.pa2ptr = shv_ept_pa2ptr;
+	ept_ctx->ctx.ptr2pa = shv_ept_ptr2pa;
+	ept_ctx->ctx.root_pa = root_pa;
+	ept_ctx->ctx.t = HPT_TYPE_EPT;
+	ept_ctx->vcpu = vcpu;
+	ept_ctx->index = index;
+}
+
+/* Set up context to modify the EPT of the given CPU and EPT number. */
+static void ept_ctx_init(VCPU * vcpu, u8 ept_num, shv_ept_ctx_t * ept_ctx)
 {
-	u64 paddr;
-	printf("CPU(0x%02x): EPT 0x%08llx id-map 0x%08llx - 0x%08llx\n",
-		   vcpu->id, ept_ctx->ctx.root_pa, low, high);
-	for (paddr = low; paddr < high; paddr += PA_PAGE_SIZE_4K) {
-		hpt_pmeo_setcache(pmeo, ept_get_mem_type(vcpu, paddr));
-		hpt_pmeo_set_address(pmeo, paddr);
-		ASSERT(hptw_insert_pmeo_alloc(&ept_ctx->ctx, pmeo, paddr) == 0);
+	ept_ctx_init_root(ept_ctx, vcpu, ept_num >> 4,
+					  ept_root_pa[vcpu->idx][ept_num >> 4]);
+}
+
+/*
+ * Set up context to modify the EPT the guest is using, found from the EPTP in
+ * the current VMCS. vcpu->ept_num cannot be used at VMEXIT, because with
+ * VMFUNC the guest switches EPT first and updates vcpu->ept_num afterwards.
+ */
+static void ept_ctx_init_current(VCPU * vcpu, shv_ept_ctx_t * ept_ctx)
+{
+	u64 root_pa = __vmx_vmread64(VMCS_control_EPT_pointer) &
+		ADDR64_PAGE_MASK_4K;
+	for (u32 i = 0; i < SHV_EPT_MAX; i++) {
+		if (ept_root_pa[vcpu->idx][i] == root_pa) {
+			ept_ctx_init_root(ept_ctx, vcpu, i, root_pa);
+			return;
+		}
 	}
+	ASSERT(0 && "EPTP not built by shv_build_ept()");
+}
+
+/* Identity-map all ranges in ept_get_id_map() */
+static void ept_map_id_ranges(VCPU * vcpu, shv_ept_ctx_t * ept_ctx)
+{
+	u64 ranges[EPT_ID_MAP_RANGES][2];
+	u64 t0 = rdtsc();
+	ept_get_id_map(ranges);
+	for (u32 i = 0; i < EPT_ID_MAP_RANGES; i++) {
+		printf("CPU(0x%02x): EPT 0x%08llx id-map 0x%08llx - 0x%08llx\n",
+			   vcpu->id, ept_ctx->ctx.root_pa, ranges[i][0], ranges[i][1]);
+		ept_map_continuous_addr(vcpu, ept_ctx, ranges[i][0], ranges[i][1],
+								false);
+	}
+	ept_stats[vcpu->idx].cycles += rdtsc() - t0;
+}
+
+/* Map SHV_EPT_SHARED_GPA to ept_shared_target[which] in the shared EPT. */
+static void ept_shared_map_target(shv_ept_ctx_t * ept_ctx, u32 which)
+{
+	hpt_pmeo_t pmeo = {.t = HPT_TYPE_EPT,.lvl = 1 };
+	ASSERT(which < 2);
+	hpt_pmeo_setuser(&pmeo, true);
+	hpt_pmeo_setprot(&pmeo, HPT_PROTS_RWX);
+	hpt_pmeo_setcache(&pmeo, HPT_PMT_WB);
+	hpt_pmeo_set_address(&pmeo, hva2spa(ept_shared_target[which]));
+	ASSERT(hptw_insert_pmeo_alloc(&ept_ctx->ctx, &pmeo,
+								  SHV_EPT_SHARED_GPA) == 0);
 }
 
+/* Build the shared EPT if no CPU has built it yet. */
+static void ept_shared_build(VCPU * vcpu)
+{
+	spin_lock(&ept_shared_lock);
+	if (!ept_shared_root_pa) {
+		shv_ept_ctx_t ept_ctx;
+		void *root = ept_page_alloc(NULL);
+		ASSERT(root);
+		ept_ctx_init_root(&ept_ctx, NULL, 0, hva2spa(root));
+		ASSERT((uintptr_t) _shv_ept_high <= SHV_EPT_SHARED_GPA);
+		ept_map_id_ranges(vcpu, &ept_ctx);
+		for (u32 i = 0; i < 2; i++) {
+			memset(ept_shared_target[i], i + 1, PAGE_SIZE_4K);
+		}
+		ept_shared_map_target(&ept_ctx, 0);
+		printf("CPU(0x%02x): shared EPT 0x%08llx built, %u pages\n",
+			   vcpu->id, ept_ctx.ctx.root_pa, ept_shared_pages);
+		ept_shared_root_pa = ept_ctx.ctx.root_pa;
+	}
+	spin_unlock(&ept_shared_lock);
+}
+
+_Static_assert((SHV_EPT_MAX << 4) - 1 <= 0xff, "ept_num must fit in u8");
+
 void shv_ept_init(VCPU * vcpu)
 {
+	ASSERT(g_ept_count >= 1 && g_ept_count <= SHV_EPT_MAX);
+	/* Lazy mapping would change the shared EPT without shootdowns */
+	ASSERT(!((g_shv_opt & SHV_USE_SHARED_EPT) &&
+			 (g_shv_opt & SHV_USE_LAZY_EPT)));
+	/* Draining the PML log would clear dirty flags without shootdowns */
+	ASSERT(!((g_shv_opt & SHV_USE_SHARED_EPT) && (g_shv_opt & SHV_USE_PML)));
+	if (g_shv_opt & SHV_USE_EPT_AD) {
+		/* IA32_VMX_EPT_VPID_CAP bit 21: accessed and dirty flags */
+		if (vcpu->vmx_msrs[INDEX_IA32_VMX_EPT_VPID_CAP_MSR] & (1ULL << 21)) {
+			vcpu->ept_ad = true;
+		} else {
+			printf("CPU(0x%02x): EPT A/D flags not supported\n", vcpu->id);
+		}
+	}
 	/* Obtain MAXPHYADDR and compute paddrmask */
 	{
 		u32 eax, ebx, ecx, edx;
@@ -229,23 +803,30 @@ void shv_ept_init(VCPU * vcpu)
 			vcpu->vmx_guestmtrrmsrs.var_mtrrs[i].mask = maskval;
 		}
 	}
+	ept_mtrr_map_init(vcpu);
+}
+
+/* Return EPTP of the EPT with root page root_pa. */
+u64 shv_ept_eptp(VCPU * vcpu, spa_t root_pa)
+{
+	/* WB memory type, 4-level page walk, bit 6 enables A/D flags */
+	return root_pa | 0x1eULL | (vcpu->ept_ad ? 0x40ULL : 0ULL);
 }
 
 u64 shv_build_ept(VCPU * vcpu, u8 ept_num)
 {
-	u64 low = (uintptr_t) _shv_ept_low;
-	u64 high = (uintptr_t) _shv_ept_high;
 	shv_ept_ctx_t ept_ctx;
 	hpt_pmeo_t pmeo;
+	bool built = !!ept_root_pa[vcpu->idx][ept_num >> 4];
 
-	/* Assuming that ept_pool and ept_alloc are initialized to 0 by bss */
-	ept_ctx.ctx.gzp = shv_ept_gzp;
-	ept_ctx.ctx.pa2ptr = shv_ept_pa2ptr;
-	ept_ctx.ctx.ptr2pa = shv_ept_ptr2pa;
-	ept_ctx.ctx.root_pa = hva2spa(ept_root[vcpu->idx][ept_num >> 4]);
-	ept_ctx.ctx.t = HPT_TYPE_EPT;
-	ept_ctx.page_pool = ept_pool[vcpu->idx][ept_num >> 4];
-	ept_ctx.page_alloc = ept_alloc[vcpu->idx][ept_num >> 4];
+	ASSERT((ept_num >> 4) < g_ept_count);
+	ept_last_use[vcpu->idx][ept_num >> 4] = rdtsc();
+	if (!built) {
+		void *root = ept_page_alloc_reclaim(vcpu, ept_num >> 4);
+		ASSERT(root);
+		ept_root_pa[vcpu->idx][ept_num >> 4] = hva2spa(root);
+	}
+	ept_ctx_init(vcpu, ept_num, &ept_ctx);
 	pmeo.pme = 0;
 	pmeo.t = HPT_TYPE_EPT;
 	pmeo.lvl = 1;
@@ -253,19 +834,20 @@ u64 shv_build_ept(VCPU * vcpu, u8 ept_num)
 	hpt_pmeo_setprot(&pmeo, HPT_PROTS_RWX);
 	/* hpt_pmeo_setcache() and hpt_pmeo_set_address() will be called later */
 	/* Skip building most of the EPT if already built */
-	if (!ept_valid[vcpu->idx][ept_num >> 4]) {
-		ept_valid[vcpu->idx][ept_num >> 4] = 1;
-		/* Regular memory */
-		ept_map_continuous_addr(vcpu, &ept_ctx, &pmeo, low, high);
-		/* LAPIC */
-		ept_map_continuous_addr(vcpu, &ept_ctx, &pmeo, 0xfee00000, 0xfee01000);
-		/* Console */
-		ept_map_continuous_addr(vcpu, &ept_ctx, &pmeo, 0x000b8000, 0x000b9000);
-		/* Real mode */
-		ept_map_continuous_addr(vcpu, &ept_ctx, &pmeo, 0x00000000, 0x00100000);
+	if (!built) {
+		if (g_shv_opt & SHV_USE_SHARED_EPT) {
+			/* Start from the root page of the shared EPT */
+			ept_shared_build(vcpu);
+			memcpy(spa2hva(ept_ctx.ctx.root_pa), spa2hva(ept_shared_root_pa),
+				   PAGE_SIZE_4K);
+		} else if (!(g_shv_opt & SHV_USE_LAZY_EPT)) {
+			/* With SHV_USE_LAZY_EPT, start from an empty EPT */
+			ept_map_id_ranges(vcpu, &ept_ctx);
+			shv_ept_print_stats(vcpu);
+		}
 	} else {
 		ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT,
-							ept_ctx.ctx.root_pa | 0x1eULL));
+							shv_ept_eptp(vcpu, ept_ctx.ctx.root_pa)));
 		// ASSERT(__vmx_invept(VMX_INVEPT_GLOBAL, 0));
 	}
 
@@ -278,7 +860,7 @@ u64 shv_build_ept(VCPU * vcpu, u8 ept_num)
 		} else {
 			pmeo.pme = 0;
 		}
-		ASSERT(hptw_insert_pmeo_alloc(&ept_ctx.ctx, &pmeo, 0x12340000ULL) == 0);
+		ept_insert_pmeo(&ept_ctx, &pmeo, 0x12340000ULL);
 	}
 
 	/* Swap large_pages using 2M pages */
@@ -295,13 +877,277 @@ u64 shv_build_ept(VCPU * vcpu, u8 ept_num)
 		hpt_pmeo_setcache(&pmeo, HPT_PMT_WB);
 		/* lage_pages[1] -> lage_pages[0] */
 		hpt_pmeo_set_address(&pmeo, addr0);
-		ASSERT(hptw_insert_pmeo_alloc(&ept_ctx.ctx, &pmeo, addr1) == 0);
+		ept_insert_pmeo(&ept_ctx, &pmeo, addr1);
 		/* lage_pages[1] -> lage_pages[1] */
 		hpt_pmeo_set_address(&pmeo, addr1);
-		ASSERT(hptw_insert_pmeo_alloc(&ept_ctx.ctx, &pmeo, addr0) == 0);
+		ept_insert_pmeo(&ept_ctx, &pmeo, addr0);
 		memset(large_pages[0], 'A', 16);
 		memset(large_pages[1], 'B', 16);
 	}
 
 	return ept_ctx.ctx.root_pa;
 }
+
+/*
+ * Build EPTs 0 to g_ept_count - 1 (EPT numbers 0x00, 0x10, ...) and return the
+ * address of the EPTP list containing them, for VMFUNC EPTP switching.
+ */
+spa_t shv_ept_build_eptp_list(VCPU * vcpu)
+{
+	for (u32 i = 0; i < g_ept_count; i++) {
+		u64 eptp = shv_ept_eptp(vcpu, shv_build_ept(vcpu, i << 4));
+		ept_eptp_list[vcpu->idx][i] = eptp;
+	}
+	return hva2spa(ept_eptp_list[vcpu->idx]);
+}
+
+/*
+ * Handle an EPT violation with SHV_USE_LAZY_EPT. If paddr is not present in
+ * EPT and is in an identity-mapped range, map the not-present pages of the
+ * aligned window of g_ept_prefetch pages around it (within the range) and
+ * return true. The guest then retries the access.
+ */
+bool shv_ept_handle_violation(VCPU * vcpu, u64 paddr, ulong_t q)
+{
+	u64 ranges[EPT_ID_MAP_RANGES][2];
+	u64 window = g_ept_prefetch * PA_PAGE_SIZE_4K;
+	u64 t0 = rdtsc();
+
+	/* Bits 3 - 5: permissions in EPT, all 0 means not present */
+	if (!(g_shv_opt & SHV_USE_LAZY_EPT) || (q & 0x38UL)) {
+		return false;
+	}
+	ASSERT(g_ept_prefetch && !(g_ept_prefetch & (g_ept_prefetch - 1)));
+	ept_get_id_map(ranges);
+	for (u32 i = 0; i < EPT_ID_MAP_RANGES; i++) {
+		if (paddr >= ranges[i][0] && paddr < ranges[i][1]) {
+			shv_ept_ctx_t ept_ctx;
+			u64 low = paddr & ~(window - 1);
+			u64 high = low + window;
+			if (low < ranges[i][0]) {
+				low = ranges[i][0];
+			}
+			if (high > ranges[i][1]) {
+				high = ranges[i][1];
+			}
+			ept_ctx_init_current(vcpu, &ept_ctx);
+			ept_stats[vcpu->idx].faults++;
+			ept_map_continuous_addr(vcpu, &ept_ctx, low, high, true);
+			ept_stats[vcpu->idx].cycles += rdtsc() - t0;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Invalidate EPTs of the current CPU if a shootdown is pending. */
+void shv_ept_shootdown_poll(VCPU * vcpu)
+{
+	u32 gen = ept_shootdown_gen;
+	if (ept_shootdown_seen[vcpu->idx] != gen) {
+		for (u32 i = 0; i < SHV_EPT_MAX; i++) {
+			spa_t root_pa = ept_root_pa[vcpu->idx][i];
+			if (root_pa) {
+				ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT,
+									shv_ept_eptp(vcpu, root_pa)));
+			}
+		}
+		ept_stats[vcpu->idx].flushes++;
+		ept_shootdown_seen[vcpu->idx] = gen;
+	}
+}
+
+/*
+ * Handle SHV_EPT_SHOOTDOWN_VECTOR. The guest cannot execute INVEPT, so it
+ * causes a VMEXIT and vmexit_handler() calls shv_ept_shootdown_poll().
+ */
+void handle_ept_shootdown_interrupt(VCPU * vcpu, u8 vector, bool guest)
+{
+	ASSERT(vector == SHV_EPT_SHOOTDOWN_VECTOR);
+	if (guest) {
+		asm volatile ("vmcall"::"a" (SHV_VMCALL_EPT_SHOOTDOWN));
+	} else {
+		shv_ept_shootdown_poll(vcpu);
+	}
+	write_lapic(LAPIC_EOI, 0);
+}
+
+/*
+ * Make all CPUs stop using translations from the shared EPT before its last
+ * change. Other CPUs acknowledge in their SHV_EPT_SHOOTDOWN_VECTOR handlers,
+ * or at their next VMEXIT if interrupts are disabled in the guest.
+ */
+static void ept_shootdown(VCPU * vcpu)
+{
+	u64 t0 = rdtsc();
+	u32 gen;
+	/* Keep acknowledging shootdowns while another CPU is sending one */
+	while (!__sync_bool_compare_and_swap(&ept_shootdown_busy, 0, 1)) {
+		shv_ept_shootdown_poll(vcpu);
+		cpu_relax();
+	}
+	gen = __sync_add_and_fetch(&ept_shootdown_gen, 1);
+	shv_ept_shootdown_poll(vcpu);
+	/* Fixed delivery, assert, all excluding self */
+	while (read_lapic(LAPIC_ICR_LOW) & 0x1000U) {
+		cpu_relax();
+	}
+	write_lapic(LAPIC_ICR_LOW, 0x000c4000U | SHV_EPT_SHOOTDOWN_VECTOR);
+	for (u32 i = 0; i < g_midtable_numentries; i++) {
+		while ((s32) (ept_shootdown_seen[i] - gen) < 0) {
+			cpu_relax();
+		}
+	}
+	__sync_lock_release(&ept_shootdown_busy);
+	ept_stats[vcpu->idx].shootdowns++;
+	ept_stats[vcpu->idx].shootdown_cycles += rdtsc() - t0;
+}
+
+/*
+ * Map SHV_EPT_SHARED_GPA to the page filled with (which + 1) in the shared
+ * EPT, and perform a shootdown. Return TSC cycles spent in the shootdown.
+ */
+u64 shv_ept_shared_remap(VCPU * vcpu, u32 which)
+{
+	shv_ept_ctx_t ept_ctx;
+	u64 t0;
+	ASSERT(g_shv_opt & SHV_USE_SHARED_EPT);
+	ASSERT(ept_shared_root_pa);
+	ept_ctx_init_root(&ept_ctx, NULL, 0, ept_shared_root_pa);
+	spin_lock(&ept_shared_lock);
+	ept_shared_map_target(&ept_ctx, which);
+	spin_unlock(&ept_shared_lock);
+	t0 = rdtsc();
+	ept_shootdown(vcpu);
+	return rdtsc() - t0;
+}
+
+/* Return address of the page-modification log of the current CPU. */
+spa_t shv_ept_pml_log(VCPU * vcpu)
+{
+	return hva2spa(ept_pml_log[vcpu->idx]);
+}
+
+/* Clear the dirty flag of the EPT leaf entry mapping gpa. */
+static void ept_clear_dirty(shv_ept_ctx_t * ept_ctx, u64 gpa)
+{
+	hpt_pmo_t pmo;
+	hpt_pmeo_t pmeo;
+	hptw_get_pmo(&pmo, &ept_ctx->ctx, 1, gpa);
+	hpt_pm_get_pmeo_by_va(&pmeo, &pmo, gpa);
+	if (hpt_pmeo_is_present(&pmeo) && (pmeo.pme & EPT_PME_DIRTY)) {
+		pmeo.pme &= ~EPT_PME_DIRTY;
+		hpt_pmo_set_pme_by_va(&pmo, &pmeo, gpa);
+	}
+}
+
+/*
+ * Count GPAs in the page-modification log as pending, clear their dirty flags
+ * so that they are logged again when written again, and empty the log.
+ */
+static void ept_pml_drain(VCPU * vcpu, shv_ept_ctx_t * ept_ctx)
+{
+	/* Index of the next entry to write, wraps to 0xffff when the log is full */
+	u16 index = __vmx_vmread16(VMCS_guest_PML_index);
+	u32 first = index < SHV_EPT_PML_ENTRIES ? index + 1U : 0U;
+	for (u32 i = first; i < SHV_EPT_PML_ENTRIES; i++) {
+		ept_clear_dirty(ept_ctx, ept_pml_log[vcpu->idx][i]);
+	}
+	ept_stats[vcpu->idx].pml_pending += SHV_EPT_PML_ENTRIES - first;
+	__vmx_vmwrite16(VMCS_guest_PML_index, SHV_EPT_PML_ENTRIES - 1);
+}
+
+/* Handle a PML full VMEXIT, the guest retries the write afterwards. */
+void shv_ept_handle_pml_full(VCPU * vcpu)
+{
+	shv_ept_ctx_t ept_ctx;
+	ASSERT(vcpu->ept_pml);
+	ept_ctx_init_current(vcpu, &ept_ctx);
+	ept_pml_drain(vcpu, &ept_ctx);
+	ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT,
+						shv_ept_eptp(vcpu, ept_ctx.ctx.root_pa)));
+	ept_stats[vcpu->idx].pml_full_exits++;
+}
+
+/* Return number of PML full VMEXITs of the current CPU. */
+u64 shv_ept_pml_full_exits(VCPU * vcpu)
+{
+	return ept_stats[vcpu->idx].pml_full_exits;
+}
+
+/*
+ * Clear dirty flags of leaf entries below the paging structure at pa of level
+ * lvl. Return the number of leaf entries that were dirty.
+ */
+static u64 ept_scan_dirty(hpt_pa_t pa, int lvl)
+{
+	hpt_pme_t *pm = (hpt_pme_t *) spa2hva(pa);
+	size_t n = hpt_pm_size(HPT_TYPE_EPT, lvl) / sizeof(hpt_pme_t);
+	u64 ans = 0;
+	for (size_t i = 0; i < n; i++) {
+		hpt_pmeo_t pmeo = {.pme = pm[i],.t = HPT_TYPE_EPT,.lvl = lvl };
+		if (!hpt_pmeo_is_present(&pmeo)) {
+			continue;
+		}
+		if (!hpt_pmeo_is_page(&pmeo)) {
+			ans += ept_scan_dirty(hpt_pmeo_get_address(&pmeo), lvl - 1);
+		} else if (pm[i] & EPT_PME_DIRTY) {
+			pm[i] &= ~EPT_PME_DIRTY;
+			ans++;
+		}
+	}
+	return ans;
+}
+
+/*
+ * Harvest dirty pages of the current EPT, as a live migration would. With
+ * PML, return the number of GPAs logged since the last harvest. Otherwise
+ * scan all EPT leaf entries and return the number of dirty ones. Dirty flags
+ * are cleared, so pages are reported again after they are written again.
+ */
+u64 shv_ept_harvest_dirty(VCPU * vcpu)
+{
+	shv_ept_ctx_t ept_ctx;
+	u64 t0 = rdtsc();
+	u64 ans;
+	ASSERT(vcpu->ept_ad);
+	/* Dirty flags of the shared EPT would need a shootdown */
+	ASSERT(!(g_shv_opt & SHV_USE_SHARED_EPT));
+	ept_ctx_init_current(vcpu, &ept_ctx);
+	if (vcpu->ept_pml) {
+		ept_pml_drain(vcpu, &ept_ctx);
+		ans = ept_stats[vcpu->idx].pml_pending;
+		ept_stats[vcpu->idx].pml_pending = 0;
+	} else {
+		ans = ept_scan_dirty(ept_ctx.ctx.root_pa, hpt_root_lvl(HPT_TYPE_EPT));
+	}
+	ASSERT(__vmx_invept(VMX_INVEPT_SINGLECONTEXT,
+						shv_ept_eptp(vcpu, ept_ctx.ctx.root_pa)));
+	ept_stats[vcpu->idx].harvests++;
+	ept_stats[vcpu->idx].harvested += ans;
+	ept_stats[vcpu->idx].harvest_cycles += rdtsc() - t0;
+	return ans;
+}
+
+/* Print EPT build statistics of the current CPU. */
+void shv_ept_print_stats(VCPU * vcpu)
+{
+	printf("EPT_STATS: cpu=0x%02x lazy=%d faults=%lld pages_4k=%lld "
+		   "pages_2m=%lld pages_1g=%lld cycles=%lld table_pages=%u "
+		   "table_peak=%u quota=%u reclaims=%lld pool_used=%u pool_peak=%u "
+		   "shared_pages=%u shootdowns=%lld shootdown_cycles=%lld "
+		   "flushes=%lld ad=%d pml=%d pml_full_exits=%lld harvests=%lld "
+		   "harvested=%lld harvest_cycles=%lld\n",
+		   vcpu->id, !!(g_shv_opt & SHV_USE_LAZY_EPT),
+		   ept_stats[vcpu->idx].faults, ept_stats[vcpu->idx].leaves[0],
+		   ept_stats[vcpu->idx].leaves[1], ept_stats[vcpu->idx].leaves[2],
+		   ept_stats[vcpu->idx].cycles, ept_stats[vcpu->idx].pages,
+		   ept_stats[vcpu->idx].peak, ept_pool_quota(),
+		   ept_stats[vcpu->idx].reclaims, ept_pool_used, ept_pool_peak,
+		   ept_shared_pages, ept_stats[vcpu->idx].shootdowns,
+		   ept_stats[vcpu->idx].shootdown_cycles,
+		   ept_stats[vcpu->idx].flushes, vcpu->ept_ad, vcpu->ept_pml,
+		   ept_stats[vcpu->idx].pml_full_exits, ept_stats[vcpu->idx].harvests,
+		   ept_stats[vcpu->idx].harvested,
+		   ept_stats[vcpu->idx].harvest_cycles);
+}
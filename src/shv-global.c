@@ -23,6 +23,7 @@ u32 g_midtable_numentries;
 PCPU g_cpumap[MAX_PCPU_ENTRIES];
 MIDTAB g_midtable[MAX_VCPU_ENTRIES];
 VCPU g_vcpus[MAX_VCPU_ENTRIES];
+PERCPU g_percpu[MAX_VCPU_ENTRIES];
 u8 g_cpu_stack[MAX_VCPU_ENTRIES][SHV_STACK_SIZE];
 uintptr_t g_cr3;
 uintptr_t g_cr4;
@@ -102,11 +102,7 @@ typedef struct shv_guest_test_msr_ls_data {
 static void shv_guest_test_msr_ls_vmexit_handler(VCPU * vcpu, struct regs *r,
 												 vmexit_info_t * info)
 {
-	shv_guest_test_msr_ls_data_t *data;
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
-	data = (void *)r->bx;
+	shv_guest_test_msr_ls_data_t *data = (void *)r->bx;
 	switch (r->eax) {
 	case 12:
 		/*
@@ -216,17 +212,18 @@ static void shv_guest_test_msr_ls_vmexit_handler(VCPU * vcpu, struct regs *r,
 		break;
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void shv_guest_test_msr_ls(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_USE_MSR_LOAD) {
 		shv_guest_test_msr_ls_data_t data;
-		vcpu->vmexit_handler_override = shv_guest_test_msr_ls_vmexit_handler;
+		vmcall_register(vcpu, 12, shv_guest_test_msr_ls_vmexit_handler);
+		vmcall_register(vcpu, 16, shv_guest_test_msr_ls_vmexit_handler);
 		asm volatile ("vmcall"::"a" (12), "b"(&data));
 		asm volatile ("vmcall"::"a" (16), "b"(&data));
-		vcpu->vmexit_handler_override = NULL;
+		vmcall_deregister(vcpu, 12, shv_guest_test_msr_ls_vmexit_handler);
+		vmcall_deregister(vcpu, 16, shv_guest_test_msr_ls_vmexit_handler);
 	}
 }
 
@@ -234,15 +231,13 @@ static void shv_guest_test_msr_ls(VCPU * vcpu)
 static void shv_guest_test_ept_vmexit_handler(VCPU * vcpu, struct regs *r,
 											  vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_EPT_VIOLATION) {
-		return;
-	}
 	{
 		ulong_t q = __vmx_vmreadNW(VMCS_info_exit_qualification);
 		u64 paddr = __vmx_vmread64(VMCS_guest_paddr);
 		ulong_t vaddr = __vmx_vmreadNW(VMCS_info_guest_linear_address);
 		if (paddr != 0x12340000 || vaddr != 0x12340000) {
 			/* Let the default handler report the error */
+			vmexit_handle_default(vcpu, r, info);
 			return;
 		}
 		/* On older machines: q = 0x181; on Dell 7050: q = 0x581 */
@@ -253,7 +248,6 @@ static void shv_guest_test_ept_vmexit_handler(VCPU * vcpu, struct regs *r,
 		vcpu->ept_exit_count++;
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void shv_guest_test_ept(VCPU * vcpu)
@@ -261,7 +255,8 @@ static void shv_guest_test_ept(VCPU * vcpu)
 	if (g_shv_opt & SHV_USE_EPT) {
 		u32 expected_ept_count;
 		ASSERT(vcpu->ept_exit_count == 0);
-		vcpu->vmexit_handler_override = shv_guest_test_ept_vmexit_handler;
+		vmexit_register(vcpu, VMX_VMEXIT_EPT_VIOLATION,
+						shv_guest_test_ept_vmexit_handler);
 		{
 			u32 a = 0xdeadbeef;
 			u32 *p = (u32 *) 0x12340000;
@@ -281,7 +276,8 @@ static void shv_guest_test_ept(VCPU * vcpu)
 				expected_ept_count = 0;
 			}
 		}
-		vcpu->vmexit_handler_override = NULL;
+		vmexit_deregister(vcpu, VMX_VMEXIT_EPT_VIOLATION,
+						  shv_guest_test_ept_vmexit_handler);
 		ASSERT(vcpu->ept_exit_count == expected_ept_count);
 		vcpu->ept_exit_count = 0;
 	}
@@ -291,9 +287,6 @@ static void shv_guest_test_ept(VCPU * vcpu)
 static void shv_guest_switch_ept_vmexit_handler(VCPU * vcpu, struct regs *r,
 												vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	ASSERT(r->eax == 17);
 	{
 		u64 eptp;
@@ -301,21 +294,27 @@ static void shv_guest_switch_ept_vmexit_handler(VCPU * vcpu, struct regs *r,
 		ASSERT(g_shv_opt & SHV_USE_EPT);
 		/* Swap EPT */
 		vcpu->ept_num++;
-		vcpu->ept_num %= (SHV_EPT_COUNT << 4);
+		vcpu->ept_num %= (g_ept_count << 4);
 		eptp = shv_build_ept(vcpu, vcpu->ept_num);
-		__vmx_vmwrite64(VMCS_control_EPT_pointer, eptp | 0x1eULL);
+		__vmx_vmwrite64(VMCS_control_EPT_pointer, shv_ept_eptp(vcpu, eptp));
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void shv_guest_switch_ept(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_USE_SWITCH_EPT) {
 		ASSERT(g_shv_opt & SHV_USE_EPT);
-		vcpu->vmexit_handler_override = shv_guest_switch_ept_vmexit_handler;
+		if (vcpu->ept_vmfunc) {
+			/* Switch to the next prebuilt EPT without VMEXIT */
+			u32 index = ((vcpu->ept_num >> 4) + 1) % g_ept_count;
+			__vmx_vmfunc_eptp_switch(index);
+			vcpu->ept_num = index << 4;
+			return;
+		}
+		vmcall_register(vcpu, 17, shv_guest_switch_ept_vmexit_handler);
 		asm volatile ("vmcall"::"a" (17));
-		vcpu->vmexit_handler_override = NULL;
+		vmcall_deregister(vcpu, 17, shv_guest_switch_ept_vmexit_handler);
 	}
 }
 
@@ -323,9 +322,6 @@ static void shv_guest_switch_ept(VCPU * vcpu)
 static void shv_guest_test_vmxoff_vmexit_handler(VCPU * vcpu, struct regs *r,
 												 vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	ASSERT(r->eax == 22);
 	{
 		bool test_vmxoff = r->ebx;
@@ -337,7 +333,8 @@ static void shv_guest_test_vmxoff_vmexit_handler(VCPU * vcpu, struct regs *r,
 		vmcs_dump(vcpu, 0);
 		/* Set ES access right */
 		if (test_modify_vmcs) {
-			old_es_limit = __vmx_vmread32(VMCS_guest_ES_limit);
+			old_es_limit = vmcs_cache_get(vcpu, guest_ES_limit);
+			/* Bypass VMCS cache, the copy in vcpu->vmcs is compared later */
 			__vmx_vmwrite32(VMCS_guest_ES_limit, new_es_limit);
 		}
 		/* Test VMPTRST */
@@ -346,6 +343,10 @@ static void shv_guest_test_vmxoff_vmexit_handler(VCPU * vcpu, struct regs *r,
 
 		/* VMCLEAR current VMCS */
 		ASSERT(__vmx_vmclear(hva2spa(vcpu->my_vmcs)));
+		/* The shadow VMCS also needs to be cleared before VMXOFF */
+		if (test_vmxoff && vcpu->my_shadow_vmcs) {
+			ASSERT(__vmx_vmclear(hva2spa(vcpu->my_shadow_vmcs)));
+		}
 		/* Make sure that VMWRITE fails */
 		ASSERT(!__vmx_vmwrite(0x0000, 0x0000));
 
@@ -409,20 +410,21 @@ static void shv_guest_test_vmxoff_vmexit_handler(VCPU * vcpu, struct regs *r,
 			struct _vmx_vmcsfields a;
 			memcpy(&a, &vcpu->vmcs, sizeof(a));
 			vmcs_dump(vcpu, 0);
-			ASSERT(memcmp(&a, &vcpu->vmcs, sizeof(a)) == 0);
+			ASSERT(simd_memcmp(&a, &vcpu->vmcs, sizeof(a)) == 0);
 		}
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
 	/* Hardware thinks VMCS is not launched, so VMLAUNCH instead of VMRESUME */
+	vmcs_cache_flush(vcpu);
 	vmlaunch_asm(r);
 }
 
 static void shv_guest_test_vmxoff(VCPU * vcpu, bool test_vmxoff)
 {
 	if (g_shv_opt & SHV_USE_VMXOFF) {
-		vcpu->vmexit_handler_override = shv_guest_test_vmxoff_vmexit_handler;
+		vmcall_register(vcpu, 22, shv_guest_test_vmxoff_vmexit_handler);
 		asm volatile ("vmcall"::"a" (22), "b"((u32) test_vmxoff));
-		vcpu->vmexit_handler_override = NULL;
+		vmcall_deregister(vcpu, 22, shv_guest_test_vmxoff_vmexit_handler);
 	}
 }
 
@@ -430,9 +432,6 @@ static void shv_guest_test_vmxoff(VCPU * vcpu, bool test_vmxoff)
 static void shv_guest_test_vpid_vmexit_handler(VCPU * vcpu, struct regs *r,
 											   vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	ASSERT(r->eax == 19);
 	{
 		/* VPID will always be odd */
@@ -460,15 +459,51 @@ static void shv_guest_test_vpid_vmexit_handler(VCPU * vcpu, struct regs *r,
 		__vmx_vmwrite16(VMCS_control_vpid, vpid);
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void shv_guest_test_vpid(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_USE_VPID) {
-		vcpu->vmexit_handler_override = shv_guest_test_vpid_vmexit_handler;
+		vmcall_register(vcpu, 19, shv_guest_test_vpid_vmexit_handler);
 		asm volatile ("vmcall"::"a" (19));
-		vcpu->vmexit_handler_override = NULL;
+		vmcall_deregister(vcpu, 19, shv_guest_test_vpid_vmexit_handler);
+	}
+}
+
+/* Test VMCS shadowing, guest VMREAD / VMWRITE should not cause VMEXIT */
+static void shv_guest_test_vmcs_shadowing_vmexit_handler(VCPU * vcpu,
+														 struct regs *r,
+														 vmexit_info_t * info)
+{
+	ASSERT(r->eax == 43);
+	{
+		spa_t shadow = hva2spa(vcpu->my_shadow_vmcs);
+		/* Check and modify the value written by the guest in shadow VMCS */
+		ASSERT(__vmx_vmclear(shadow));
+		ASSERT(__vmx_vmptrld(shadow));
+		ASSERT(__vmx_vmread32(VMCS_guest_ES_limit) == r->ebx);
+		__vmx_vmwrite32(VMCS_guest_ES_limit, ~r->ebx);
+		ASSERT(__vmx_vmclear(shadow));
+		ASSERT(__vmx_vmptrld(hva2spa(vcpu->my_vmcs)));
+	}
+	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
+}
+
+static void shv_guest_test_vmcs_shadowing(VCPU * vcpu)
+{
+	if (g_shv_opt & SHV_USE_VMCS_SHADOWING) {
+		u32 val = 0x3c5a0000U | vcpu->id;
+		unsigned long result;
+		vmcall_register(vcpu, 43, shv_guest_test_vmcs_shadowing_vmexit_handler);
+		/* VMEXIT due to VMREAD / VMWRITE will fail in vmexit_handle_unknown() */
+		ASSERT(__vmx_vmwrite(VMCS_guest_ES_limit, val));
+		ASSERT(__vmx_vmread(VMCS_guest_ES_limit, &result));
+		ASSERT(result == val);
+		asm volatile ("vmcall"::"a" (43), "b"(val));
+		ASSERT(__vmx_vmread(VMCS_guest_ES_limit, &result));
+		ASSERT(result == (u32) ~val);
+		vmcall_deregister(vcpu, 43,
+						  shv_guest_test_vmcs_shadowing_vmexit_handler);
 	}
 }
 
@@ -479,22 +514,18 @@ static void shv_guest_test_vpid(VCPU * vcpu)
 static void shv_guest_wait_int_vmexit_handler(VCPU * vcpu, struct regs *r,
 											  vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	ASSERT(r->eax == 25);
 	if (!(g_shv_opt & (SHV_NO_EFLAGS_IF | SHV_NO_INTERRUPT))) {
 		asm volatile ("sti; hlt; cli;");
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void shv_guest_wait_int(VCPU * vcpu)
 {
-	vcpu->vmexit_handler_override = shv_guest_wait_int_vmexit_handler;
+	vmcall_register(vcpu, 25, shv_guest_wait_int_vmexit_handler);
 	asm volatile ("vmcall"::"a" (25));
-	vcpu->vmexit_handler_override = NULL;
+	vmcall_deregister(vcpu, 25, shv_guest_wait_int_vmexit_handler);
 }
 
 /* Test unrestricted guest by disabling paging */
@@ -541,22 +572,18 @@ static void shv_guest_test_large_page(VCPU * vcpu)
 static void shv_guest_test_user_vmexit_handler(VCPU * vcpu, struct regs *r,
 											   vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	ASSERT(r->eax == 33);
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
 	enter_user_mode(vcpu, 0);
-	vmresume_asm(r);
 }
 
 static void shv_guest_test_user(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_USER_MODE) {
 		ASSERT(!(g_shv_opt & SHV_NO_EFLAGS_IF));
-		vcpu->vmexit_handler_override = shv_guest_test_user_vmexit_handler;
+		vmcall_register(vcpu, 33, shv_guest_test_user_vmexit_handler);
 		asm volatile ("vmcall"::"a" (33));
-		vcpu->vmexit_handler_override = NULL;
+		vmcall_deregister(vcpu, 33, shv_guest_test_user_vmexit_handler);
 	}
 }
 
@@ -565,11 +592,9 @@ static void shv_guest_test_nested_user_vmexit_handler(VCPU * vcpu,
 													  struct regs *r,
 													  vmexit_info_t * info)
 {
-	if (info->vmexit_reason != VMX_VMEXIT_VMCALL) {
-		return;
-	}
 	(void)vcpu;
 	(void)r;
+	(void)info;
 	ASSERT(0 && "VMEXIT not allowed");
 }
 
@@ -577,11 +602,12 @@ static void shv_guest_test_nested_user(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_NESTED_USER_MODE) {
 		ASSERT(!(g_shv_opt & SHV_NO_EFLAGS_IF));
-		vcpu->vmexit_handler_override =
-			shv_guest_test_nested_user_vmexit_handler;
+		vmexit_register(vcpu, VMX_VMEXIT_VMCALL,
+						shv_guest_test_nested_user_vmexit_handler);
 		// asm volatile ("vmcall" : : "a"(0x4c4150ffU));
 		enter_user_mode(vcpu, 0x4c415000U);
-		vcpu->vmexit_handler_override = NULL;
+		vmexit_deregister(vcpu, VMX_VMEXIT_VMCALL,
+						  shv_guest_test_nested_user_vmexit_handler);
 	}
 }
 
@@ -590,6 +616,9 @@ static void shv_guest_test_nested_user(VCPU * vcpu)
 #define MSR_TEST_VMEXIT	0xf6d7a004
 #define MSR_TEST_EXCEPT	0xc23a16e5
 
+/* VMCALL numbers used by MSR bitmap test */
+static const u32 msr_bitmap_vmcalls[] = { 34, 37, 38, 39, 41, 42 };
+
 static void shv_guest_msr_bitmap_vmexit_handler(VCPU * vcpu, struct regs *r,
 												vmexit_info_t * info)
 {
@@ -639,11 +668,13 @@ static void shv_guest_msr_bitmap_vmexit_handler(VCPU * vcpu, struct regs *r,
 			msr_bitmap[r->ebx / 8] &= ~(1 << (r->ebx % 8));
 			break;
 		case 41:
-			/* Prepare for FS / GS check */
+			/* Prepare for FS / GS check, GS base points to per-CPU data */
 			ASSERT(rdmsr64(IA32_MSR_FS_BASE) == 0ULL);
-			ASSERT(rdmsr64(IA32_MSR_GS_BASE) == 0ULL);
+			ASSERT(rdmsr64(IA32_MSR_GS_BASE) ==
+				   (uintptr_t) & g_percpu[vcpu->idx]);
 			ASSERT(__vmx_vmreadNW(VMCS_guest_FS_base) == 0UL);
-			ASSERT(__vmx_vmreadNW(VMCS_guest_GS_base) == 0UL);
+			ASSERT(__vmx_vmreadNW(VMCS_guest_GS_base) ==
+				   (uintptr_t) & g_percpu[vcpu->idx]);
 			__vmx_vmwriteNW(VMCS_guest_FS_base, 0x680effffUL);
 			__vmx_vmwriteNW(VMCS_guest_GS_base, 0x6810ffffUL);
 			break;
@@ -652,9 +683,11 @@ static void shv_guest_msr_bitmap_vmexit_handler(VCPU * vcpu, struct regs *r,
 			ASSERT(__vmx_vmreadNW(VMCS_guest_FS_base) == 0xffff680eUL);
 			ASSERT(__vmx_vmreadNW(VMCS_guest_GS_base) == 0xffff6810UL);
 			ASSERT(rdmsr64(IA32_MSR_FS_BASE) == 0ULL);
-			ASSERT(rdmsr64(IA32_MSR_GS_BASE) == 0ULL);
+			ASSERT(rdmsr64(IA32_MSR_GS_BASE) ==
+				   (uintptr_t) & g_percpu[vcpu->idx]);
 			__vmx_vmwriteNW(VMCS_guest_FS_base, 0UL);
-			__vmx_vmwriteNW(VMCS_guest_GS_base, 0UL);
+			__vmx_vmwriteNW(VMCS_guest_GS_base,
+							(uintptr_t) & g_percpu[vcpu->idx]);
 			break;
 		}
 		break;
@@ -665,6 +698,7 @@ static void shv_guest_msr_bitmap_vmexit_handler(VCPU * vcpu, struct regs *r,
 		switch (r->ecx) {
 		case MSR_APIC_BASE:	/* fallthrough */
 		case IA32_X2APIC_APICID:
+			vmexit_handle_default(vcpu, r, info);
 			return;
 		default:
 			ASSERT(r->ebx == MSR_TEST_NORMAL);
@@ -672,13 +706,10 @@ static void shv_guest_msr_bitmap_vmexit_handler(VCPU * vcpu, struct regs *r,
 			break;
 		}
 		break;
-	case VMX_VMEXIT_CPUID:
-		return;
 	default:
 		ASSERT(0 && "Unknown exit reason");
 	}
 	__vmx_vmwriteNW(VMCS_guest_RIP, info->guest_rip + info->inst_len);
-	vmresume_asm(r);
 }
 
 static void _test_rdmsr(u32 ecx, u32 expected_ebx)
@@ -724,7 +755,14 @@ static void _test_wrmsr(u32 ecx, u32 expected_ebx, u64 val)
 static void shv_guest_msr_bitmap(VCPU * vcpu)
 {
 	if (g_shv_opt & SHV_USE_MSRBITMAP) {
-		vcpu->vmexit_handler_override = shv_guest_msr_bitmap_vmexit_handler;
+		for (u32 i = 0; i < sizeof(msr_bitmap_vmcalls) / sizeof(u32); i++) {
+			vmcall_register(vcpu, msr_bitmap_vmcalls[i],
+							shv_guest_msr_bitmap_vmexit_handler);
+		}
+		vmexit_register(vcpu, VMX_VMEXIT_RDMSR,
+						shv_guest_msr_bitmap_vmexit_handler);
+		vmexit_register(vcpu, VMX_VMEXIT_WRMSR,
+						shv_guest_msr_bitmap_vmexit_handler);
 		/* Enable MSR bitmap */
 		asm volatile ("vmcall"::"a" (34));
 		/* Initial: ignore everything */
@@ -783,7 +821,7 @@ static void shv_guest_msr_bitmap(VCPU * vcpu)
 		/*
 		 * Test read / write IA32_FS_BASE / IA32_GS_BASE (will not VMEXIT)
 		 * Interrupts need to be disabled, because xcph will move to FS and GS,
-		 * which clears the base to 0.
+		 * which resets the base. get_vcpu() cannot be used until VMCALL 42.
 		 */
 		asm volatile ("cli");
 		asm volatile ("vmcall"::"a" (41));
@@ -802,7 +840,14 @@ static void shv_guest_msr_bitmap(VCPU * vcpu)
 		_test_rdmsr(0xc0001fff, MSR_TEST_VMEXIT);
 		_test_wrmsr(0x00001fff, MSR_TEST_VMEXIT, 0x1234567890abcdefULL);
 		_test_wrmsr(0xc0001fff, MSR_TEST_VMEXIT, 0x1234567890abcdefULL);
-		vcpu->vmexit_handler_override = NULL;
+		vmexit_deregister(vcpu, VMX_VMEXIT_RDMSR,
+						  shv_guest_msr_bitmap_vmexit_handler);
+		vmexit_deregister(vcpu, VMX_VMEXIT_WRMSR,
+						  shv_guest_msr_bitmap_vmexit_handler);
+		for (u32 i = 0; i < sizeof(msr_bitmap_vmcalls) / sizeof(u32); i++) {
+			vmcall_deregister(vcpu, msr_bitmap_vmcalls[i],
+							  shv_guest_msr_bitmap_vmexit_handler);
+		}
 	}
 }
 
@@ -840,10 +885,21 @@ void shv_guest_main(VCPU * vcpu)
 	if (!(g_shv_opt & SHV_NO_EFLAGS_IF)) {
 		asm volatile ("sti");
 	}
+	if (g_shv_opt & (SHV_BENCH_VMEXIT | SHV_BENCH_FAST_PATH |
+					 SHV_BENCH_VMCS_SHADOW | SHV_BENCH_VMCS_FIELDS |
+					 SHV_BENCH_GET_VCPU | SHV_BENCH_SPINLOCK |
+					 SHV_BENCH_BARRIER | SHV_BENCH_SERIAL |
+					 SHV_BENCH_TRACE | SHV_BENCH_LIBC |
+					 SHV_BENCH_XSAVE | SHV_BENCH_EPT_SHOOTDOWN |
+					 SHV_BENCH_EPT_SWITCH | SHV_BENCH_PML)) {
+		shv_bench_main(vcpu);
+	}
 	while (1) {
 		/* Assume that iter never wraps around */
 		ASSERT(++iter > 0);
-		if (in_xmhf) {
+		if (g_trace & TRACE_ENABLE) {
+			trace_event(TRACE_SHV_TEST_ITER, iter, 0, 0);
+		} else if (in_xmhf) {
 			printf("CPU(0x%02x): SHV in XMHF test iter %lld\n", vcpu->id, iter);
 		} else {
 			printf("CPU(0x%02x): SHV test iter %lld\n", vcpu->id, iter);
@@ -860,16 +916,10 @@ void shv_guest_main(VCPU * vcpu)
 			if (iter < 3) {
 				shv_guest_test_msr_ls(vcpu);
 			} else if (iter == 3) {
-				/* Implement a barrier and make sure all CPUs arrive */
-				static spin_lock_t lock;
-				static volatile u32 arrived = 0;
+				/* Make sure all CPUs arrive */
+				static smp_barrier_t barrier;
 				printf("CPU(0x%02x): enter SHV barrier\n", vcpu->id);
-				spin_lock(&lock);
-				arrived++;
-				spin_unlock(&lock);
-				while (arrived < g_midtable_numentries) {
-					cpu_relax();
-				}
+				smp_barrier_wait(&barrier, vcpu);
 				printf("CPU(0x%02x): leave SHV barrier\n", vcpu->id);
 			} else {
 				shv_guest_test_user(vcpu);
@@ -884,12 +934,16 @@ void shv_guest_main(VCPU * vcpu)
 		shv_guest_test_ept(vcpu);
 		shv_guest_switch_ept(vcpu);
 		shv_guest_test_vpid(vcpu);
+		shv_guest_test_vmcs_shadowing(vcpu);
 		if (iter % 5 == 0) {
 			shv_guest_test_vmxoff(vcpu, iter % 3 == 0);
 		}
 		shv_guest_test_unrestricted_guest(vcpu);
 		shv_guest_test_large_page(vcpu);
 		shv_guest_msr_bitmap(vcpu);
+		if ((g_shv_opt & SHV_PRINT_EXIT_STATS) && iter % 16 == 0) {
+			asm volatile ("vmcall"::"a" (SHV_VMCALL_EXIT_STATS));
+		}
 		shv_guest_wait_int(vcpu);
 	}
 }
@@ -78,6 +78,19 @@ static volatile bool disable_cpuid = false;
 		} \
 	} while (0)
 
+/*
+ * Print a progress message, or record a trace event instead when tracing is
+ * enabled. printf() dominates the run time of random experiments.
+ */
+#define NMI_LOG(event, arg0, arg1, ...) \
+	do { \
+		if (g_trace & TRACE_ENABLE) { \
+			trace_event(event, arg0, arg1, 0); \
+		} else { \
+			printf(__VA_ARGS__); \
+		} \
+	} while (0)
+
 extern void idt_stub_guest_11(void);
 extern void idt_stub_guest_hh1(void);
 
@@ -100,8 +113,9 @@ void handle_interrupt_cpu1(u32 source, uintptr_t rip)
 		break;
 	case EXIT_MEASURE:
 		if (!quiet) {
-			printf("      Interrupt recorded:       %s\n",
-				   exit_source_str[source]);
+			NMI_LOG(TRACE_NMI_INTERRUPT, source, rip,
+					"      Interrupt recorded:       %s\n",
+					exit_source_str[source]);
 #if 0
 			if (source == EXIT_NMI_H) {
 				ulong_t reason = __vmx_vmread32(VMCS_info_vmexit_reason);
@@ -251,6 +265,7 @@ void shv_nmi_vmexit_handler(VCPU * vcpu, struct regs *r, vmexit_info_t * info)
 		}
 	}
 
+	vmcs_cache_flush(vcpu);
 	vmresume_asm(r);
 }
 
@@ -433,12 +448,20 @@ static void assert_measure_2(u32 source1, uintptr_t rip1, u32 source2,
 	exit_rip_old = 0;
 }
 
+/* Start an experiment */
+static void experiment_begin(u32 no)
+{
+	experiment_no = no;
+	NMI_LOG(TRACE_NMI_EXPERIMENT, no, 0, "Experiment: %d\n", no);
+}
+
 /* Execute HLT and expect interrupt to hit on the instruction */
 void hlt_wait(u32 source)
 {
 	uintptr_t rip;
 	if (!quiet) {
-		printf("    hlt_wait() begin, source =  %s\n", exit_source_str[source]);
+		NMI_LOG(TRACE_NMI_HLT_WAIT, source, 0,
+				"    hlt_wait() begin, source =  %s\n", exit_source_str[source]);
 	}
 	prepare_measure();
 	exit_source = EXIT_MEASURE;
@@ -457,7 +480,7 @@ void hlt_wait(u32 source)
 	ASSERT(!l2_ready);
 	assert_measure(source, rip);
 	if (!quiet) {
-		printf("    hlt_wait() end\n");
+		NMI_LOG(TRACE_NMI_HLT_WAIT, source, 1, "    hlt_wait() end\n");
 	}
 }
 
@@ -466,14 +489,15 @@ void iret_wait(u32 source)
 {
 	uintptr_t rip;
 	if (!quiet) {
-		printf("    iret_wait() begin, source = %s\n", exit_source_str[source]);
+		NMI_LOG(TRACE_NMI_IRET_WAIT, source, 0,
+				"    iret_wait() begin, source = %s\n", exit_source_str[source]);
 	}
 	prepare_measure();
 	exit_source = EXIT_MEASURE;
 	rip = unblock_nmi_with_rip();
 	assert_measure(source, rip);
 	if (!quiet) {
-		printf("    iret_wait() end\n");
+		NMI_LOG(TRACE_NMI_IRET_WAIT, source, 1, "    iret_wait() end\n");
 	}
 }
 
@@ -483,7 +507,7 @@ void iret_wait(u32 source)
  */
 static void experiment_1(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 1));
+	experiment_begin(1);
 	state_no = 0;
 	asm volatile ("vmcall");
 	/* Make sure NMI hits HLT */
@@ -513,7 +537,7 @@ static void experiment_1_vmcall(void)
  */
 static void experiment_2(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 2));
+	experiment_begin(2);
 	state_no = 0;
 	asm volatile ("vmcall");
 	/* An NMI should be blocked, then a timer hits HLT */
@@ -555,7 +579,7 @@ static void experiment_2_vmcall(void)
 static void experiment_3(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 3));
+	experiment_begin(3);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -588,7 +612,7 @@ static void experiment_3_vmcall(void)
  */
 static void experiment_4(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 4));
+	experiment_begin(4);
 	state_no = 0;
 	asm volatile ("vmcall");
 	state_no = 1;
@@ -620,7 +644,7 @@ static void experiment_4_vmcall(void)
  */
 static void experiment_5(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 5));
+	experiment_begin(5);
 	state_no = 0;
 	asm volatile ("vmcall");
 	hlt_wait(EXIT_VMEXIT);
@@ -653,7 +677,7 @@ static void experiment_5_vmcall(void)
  */
 static void experiment_6(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 6));
+	experiment_begin(6);
 	state_no = 0;
 	asm volatile ("vmcall");
 	hlt_wait(EXIT_TIMER_G);
@@ -688,7 +712,7 @@ static void experiment_6_vmcall(void)
 static void experiment_7(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 7));
+	experiment_begin(7);
 	state_no = 0;
 	prepare_measure();
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
@@ -724,7 +748,7 @@ static void experiment_7_vmcall(void)
  */
 static void experiment_8(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 8));
+	experiment_begin(8);
 	state_no = 0;
 	asm volatile ("vmcall");
 	hlt_wait(EXIT_VMEXIT);
@@ -754,7 +778,7 @@ static void experiment_8_vmcall(void)
  */
 static void experiment_9(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 9));
+	experiment_begin(9);
 	state_no = 0;
 	asm volatile ("vmcall");
 	hlt_wait(EXIT_VMEXIT);
@@ -787,7 +811,7 @@ static void experiment_9_vmcall(void)
 static void experiment_10(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 10));
+	experiment_begin(10);
 	state_no = 0;
 	prepare_measure();
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
@@ -823,7 +847,7 @@ static void experiment_10_vmcall(void)
 static void experiment_11(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 11));
+	experiment_begin(11);
 	state_no = 0;
 	prepare_measure();
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
@@ -858,7 +882,7 @@ static void experiment_11_vmcall(void)
  */
 static void experiment_12(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 12));
+	experiment_begin(12);
 	state_no = 0;
 	asm volatile ("vmcall");
 	iret_wait(EXIT_MEASURE);
@@ -892,7 +916,7 @@ static void experiment_12_vmcall(void)
  */
 static void experiment_13(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 13));
+	experiment_begin(13);
 	state_no = 0;
 	asm volatile ("vmcall");
 	state_no = 1;
@@ -927,7 +951,7 @@ static void experiment_13_vmcall(void)
  */
 static void experiment_14(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 14));
+	experiment_begin(14);
 	state_no = 0;
 	asm volatile ("vmcall");
 	state_no = 1;
@@ -962,7 +986,7 @@ static void experiment_14_vmcall(void)
  */
 static void experiment_15(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 15));
+	experiment_begin(15);
 	state_no = 0;
 	asm volatile ("vmcall");
 	assert_measure(EXIT_NMI_G, (uintptr_t) idt_stub_guest_hh1);
@@ -1001,7 +1025,7 @@ static void experiment_15_vmcall(void)
  */
 static void experiment_16(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 16));
+	experiment_begin(16);
 	state_no = 0;
 	asm volatile ("vmcall");
 	assert_measure(EXIT_VMEXIT, (uintptr_t) idt_stub_guest_hh1);
@@ -1040,7 +1064,7 @@ static void experiment_16_vmcall(void)
  */
 static void experiment_17(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 17));
+	experiment_begin(17);
 	state_no = 0;
 	asm volatile ("vmcall");
 	assert_measure(EXIT_VMEXIT, (uintptr_t) idt_stub_guest_hh1);
@@ -1081,7 +1105,7 @@ static void experiment_17_vmcall(void)
 static void experiment_18(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 18));
+	experiment_begin(18);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -1121,7 +1145,7 @@ static void experiment_18_vmcall(void)
 static void experiment_19(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 19));
+	experiment_begin(19);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -1160,7 +1184,7 @@ static void experiment_19_vmcall(void)
 static void experiment_20(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 20));
+	experiment_begin(20);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -1198,7 +1222,7 @@ static void experiment_20_vmcall(void)
 static void experiment_21(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 21));
+	experiment_begin(21);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMIWIND, rip);
@@ -1235,7 +1259,7 @@ static void experiment_21_vmcall(void)
 static void experiment_22(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 22));
+	experiment_begin(22);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_MEASURE, rip);
@@ -1272,7 +1296,7 @@ static void experiment_22_vmcall(void)
  */
 static void experiment_23(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 23));
+	experiment_begin(23);
 	state_no = 0;
 	asm volatile ("vmcall");
 	assert_measure(EXIT_MEASURE, 0);
@@ -1312,7 +1336,7 @@ static void experiment_23_vmcall(void)
 static void experiment_24(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 24));
+	experiment_begin(24);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	/*
@@ -1357,7 +1381,7 @@ static void experiment_24_vmcall(void)
 static void experiment_25(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 25));
+	experiment_begin(25);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -1397,7 +1421,7 @@ static void experiment_25_vmcall(void)
 static void experiment_26(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 26));
+	experiment_begin(26);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	/*
@@ -1443,7 +1467,7 @@ static void experiment_26_vmcall(void)
 static void experiment_27(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 27));
+	experiment_begin(27);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_NMI_G, rip);
@@ -1484,7 +1508,7 @@ static void experiment_27_vmcall(void)
 static void experiment_28(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 28));
+	experiment_begin(28);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_VMEXIT, rip);
@@ -1523,7 +1547,7 @@ static void experiment_28_vmcall(void)
  */
 static void experiment_29(void)
 {
-	printf("Experiment: %d\n", (experiment_no = 29));
+	experiment_begin(29);
 	state_no = 0;
 	asm volatile ("vmcall");
 }
@@ -1558,7 +1582,7 @@ static void experiment_29_vmcall(void)
 static void experiment_30(void)
 {
 	uintptr_t rip;
-	printf("Experiment: %d\n", (experiment_no = 30));
+	experiment_begin(30);
 	state_no = 0;
 	asm volatile ("vmcall; 1: lea 1b, %0":"=g" (rip));
 	assert_measure(EXIT_VMEXIT, rip);
@@ -1653,7 +1677,10 @@ void run_experiment(u32 i)
 
 void shv_nmi_guest_main(VCPU * vcpu)
 {
-	vcpu->vmexit_handler_override = shv_nmi_vmexit_handler;
+	/* NMI experiments handle all VMEXITs */
+	for (u32 i = 0; i < VMX_VMEXIT_COUNT; i++) {
+		vmexit_register(vcpu, i, shv_nmi_vmexit_handler);
+	}
 	printf("g_nmi_opt: 0x%llx\n", (u64) (g_nmi_opt));
 	printf("g_nmi_exp: 0x%llx\n", (u64) (g_nmi_exp));
 
@@ -1761,9 +1788,10 @@ void shv_nmi_guest_main(VCPU * vcpu)
 
 void shv_nmi_vmcall_dispatcher(void)
 {
-	printf("  Enter host, exp=%d, state=%d\n", experiment_no, state_no);
+	NMI_LOG(TRACE_NMI_ENTER_HOST, experiment_no, state_no,
+			"  Enter host, exp=%d, state=%d\n", experiment_no, state_no);
 	TEST_ASSERT(experiment_no < nexperiments);
 	TEST_ASSERT(experiments[experiment_no].vmcall);
 	experiments[experiment_no].vmcall();
-	printf("  Leave host\n");
+	NMI_LOG(TRACE_NMI_LEAVE_HOST, 0, 0, "  Leave host\n");
 }
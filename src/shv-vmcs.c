@@ -19,15 +19,21 @@
 #include <xmhf.h>
 #include <shv.h>
 
+/*
+ * Out-of-line VMCS accessors used by the inline accessors in shv.h when the
+ * encoding is not a compile-time constant. The width of the encoding is
+ * checked at runtime.
+ */
+
 /* Write 16-bit VMCS field, never fails */
-void __vmx_vmwrite16(u16 encoding, u16 value)
+void __vmx_vmwrite16_checked(u16 encoding, u16 value)
 {
 	ASSERT((encoding >> 12) == 0UL);
 	ASSERT(__vmx_vmwrite(encoding, value));
 }
 
 /* Write 64-bit VMCS field, never fails */
-void __vmx_vmwrite64(u16 encoding, u64 value)
+void __vmx_vmwrite64_checked(u16 encoding, u64 value)
 {
 	ASSERT((encoding >> 12) == 2UL);
 	ASSERT((encoding & 0x1) == 0x0);
@@ -42,21 +48,21 @@ void __vmx_vmwrite64(u16 encoding, u64 value)
 }
 
 /* Write 32-bit VMCS field, never fails */
-void __vmx_vmwrite32(u16 encoding, u32 value)
+void __vmx_vmwrite32_checked(u16 encoding, u32 value)
 {
 	ASSERT((encoding >> 12) == 4UL);
 	ASSERT(__vmx_vmwrite(encoding, value));
 }
 
 /* Write natural width (NW) VMCS field, never fails */
-void __vmx_vmwriteNW(u16 encoding, ulong_t value)
+void __vmx_vmwriteNW_checked(u16 encoding, ulong_t value)
 {
 	ASSERT((encoding >> 12) == 6UL);
 	ASSERT(__vmx_vmwrite(encoding, value));
 }
 
 /* Read 16-bit VMCS field, return whether succeed */
-bool __vmx_vmread16_safe(u16 encoding, u16 * result)
+bool __vmx_vmread16_checked(u16 encoding, u16 * result)
 {
 	unsigned long value;
 	ASSERT((encoding >> 12) == 0UL);
@@ -68,16 +74,8 @@ bool __vmx_vmread16_safe(u16 encoding, u16 * result)
 	return true;
 }
 
-/* Read 16-bit VMCS field, never fails */
-u16 __vmx_vmread16(u16 encoding)
-{
-	u16 value;
-	ASSERT(__vmx_vmread16_safe(encoding, &value));
-	return value;
-}
-
 /* Read 64-bit VMCS field, return whether succeed */
-bool __vmx_vmread64_safe(u16 encoding, u64 * result)
+bool __vmx_vmread64_checked(u16 encoding, u64 * result)
 {
 #ifdef __amd64__
 	unsigned long value;
@@ -109,16 +107,8 @@ bool __vmx_vmread64_safe(u16 encoding, u64 * result)
 #endif							/* !defined(__i386__) && !defined(__amd64__) */
 }
 
-/* Read 64-bit VMCS field, never fails */
-u64 __vmx_vmread64(u16 encoding)
-{
-	u64 value;
-	ASSERT(__vmx_vmread64_safe(encoding, &value));
-	return value;
-}
-
 /* Read 32-bit VMCS field, return whether succeed */
-bool __vmx_vmread32_safe(u16 encoding, u32 * result)
+bool __vmx_vmread32_checked(u16 encoding, u32 * result)
 {
 	unsigned long value;
 	ASSERT((encoding >> 12) == 4UL);
@@ -130,16 +120,8 @@ bool __vmx_vmread32_safe(u16 encoding, u32 * result)
 	return true;
 }
 
-/* Read 32-bit VMCS field, never fails */
-u32 __vmx_vmread32(u16 encoding)
-{
-	u32 value;
-	ASSERT(__vmx_vmread32_safe(encoding, &value));
-	return value;
-}
-
 /* Read natural width (NW) VMCS field, return whether succeed */
-bool __vmx_vmreadNW_safe(u16 encoding, ulong_t * result)
+bool __vmx_vmreadNW_checked(u16 encoding, ulong_t * result)
 {
 	unsigned long value;
 	ASSERT((encoding >> 12) == 6UL);
@@ -151,14 +133,6 @@ bool __vmx_vmreadNW_safe(u16 encoding, ulong_t * result)
 	return true;
 }
 
-/* Read natural width (NW) VMCS field, never fails */
-ulong_t __vmx_vmreadNW(u16 encoding)
-{
-	ulong_t value;
-	ASSERT(__vmx_vmreadNW_safe(encoding, &value));
-	return value;
-}
-
 /* Read all VMCS fields defined in SDM from CPU and print. */
 void vmcs_print_all(VCPU * vcpu)
 {
@@ -222,13 +196,171 @@ void vmcs_print_all(VCPU * vcpu)
 #undef DECLARE_FIELD_NW
 }
 
-/* Read all existing VMCS fields from CPU to vcpu->vmcs, print if verbose. */
+/*
+ * VMCS field cache. vcpu->vmcs holds a copy of the current VMCS. A field is
+ * read from the CPU on first access (vmcs_cache_fetch()) and is written back
+ * to the CPU only if it is modified (vmcs_cache_mark_dirty()). vmexit_handler()
+ * invalidates the cache at every VMEXIT and writes dirty fields back with
+ * vmcs_cache_flush() before VMRESUME. Handlers that enter the guest
+ * themselves must call vmcs_cache_flush() first. The VMEXIT fast path in
+ * vmexit_asm does not use the cache. Code that uses VMREAD / VMWRITE directly
+ * on a field must not access the same field through the cache during the same
+ * VMEXIT.
+ */
+
+/* Read a VMCS field from CPU to vcpu->vmcs. */
+static void vmcs_cache_read_field(VCPU * vcpu, u32 index)
+{
+	switch (index) {
+#define DECLARE_FIELD_16(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		vcpu->vmcs.name = __vmx_vmread16(encoding); \
+		break;
+#define DECLARE_FIELD_64(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		vcpu->vmcs.name = __vmx_vmread64(encoding); \
+		break;
+#define DECLARE_FIELD_32(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		vcpu->vmcs.name = __vmx_vmread32(encoding); \
+		break;
+#define DECLARE_FIELD_NW(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		vcpu->vmcs.name = __vmx_vmreadNW(encoding); \
+		break;
+#include <_vmx_vmcs_fields.h>
+#undef DECLARE_FIELD_16
+#undef DECLARE_FIELD_64
+#undef DECLARE_FIELD_32
+#undef DECLARE_FIELD_NW
+	default:
+		ASSERT(0 && "Unknown VMCS field");
+		break;
+	}
+	vcpu->vmcs_cache.vmread++;
+}
+
+/* Write a VMCS field from vcpu->vmcs to CPU. */
+static void vmcs_cache_write_field(VCPU * vcpu, u32 index)
+{
+	switch (index) {
+#define DECLARE_FIELD_16(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		__vmx_vmwrite16(encoding, vcpu->vmcs.name); \
+		break;
+#define DECLARE_FIELD_64(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		__vmx_vmwrite64(encoding, vcpu->vmcs.name); \
+		break;
+#define DECLARE_FIELD_32(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		__vmx_vmwrite32(encoding, vcpu->vmcs.name); \
+		break;
+#define DECLARE_FIELD_NW(encoding, name, ...) \
+	case VMCS_INDEX_##name: \
+		__vmx_vmwriteNW(encoding, vcpu->vmcs.name); \
+		break;
+#include <_vmx_vmcs_fields.h>
+#undef DECLARE_FIELD_16
+#undef DECLARE_FIELD_64
+#undef DECLARE_FIELD_32
+#undef DECLARE_FIELD_NW
+	default:
+		ASSERT(0 && "Unknown VMCS field");
+		break;
+	}
+	vcpu->vmcs_cache.vmwrite++;
+}
+
+/* Write all dirty fields to CPU, return number of fields written. */
+static u32 vmcs_cache_writeback(VCPU * vcpu)
+{
+	struct vmcs_cache *cache = &vcpu->vmcs_cache;
+	u32 ans = 0;
+	for (u32 i = 0; i < VMCS_CACHE_WORDS; i++) {
+		while (cache->dirty[i]) {
+			u32 bit = __builtin_ctz(cache->dirty[i]);
+			vmcs_cache_write_field(vcpu, i * 32 + bit);
+			cache->dirty[i] &= ~(1U << bit);
+			ans++;
+		}
+	}
+	return ans;
+}
+
+/* Initialize VMCS cache, called after the current VMCS is set up. */
+void vmcs_cache_init(VCPU * vcpu)
+{
+	memset(&vcpu->vmcs_cache, 0, sizeof(vcpu->vmcs_cache));
+}
+
+/*
+ * Mark all fields as not cached. Called when the VMCS may be changed by the
+ * CPU (e.g. at VMEXIT, after VMPTRLD). There should be no dirty fields.
+ */
+void vmcs_cache_invalidate(VCPU * vcpu)
+{
+	struct vmcs_cache *cache = &vcpu->vmcs_cache;
+	for (u32 i = 0; i < VMCS_CACHE_WORDS; i++) {
+		ASSERT(cache->dirty[i] == 0);
+		cache->valid[i] = 0;
+	}
+}
+
+/* Make sure that a field in vcpu->vmcs is up to date. */
+void vmcs_cache_fetch(VCPU * vcpu, u32 index)
+{
+	struct vmcs_cache *cache = &vcpu->vmcs_cache;
+	u32 mask = 1U << (index % 32);
+	ASSERT(index < VMCS_FIELD_COUNT);
+	if (cache->valid[index / 32] & mask) {
+		cache->vmread_saved++;
+	} else {
+		vmcs_cache_read_field(vcpu, index);
+		cache->valid[index / 32] |= mask;
+	}
+}
+
+/* Record that a field in vcpu->vmcs is modified. */
+void vmcs_cache_mark_dirty(VCPU * vcpu, u32 index)
+{
+	struct vmcs_cache *cache = &vcpu->vmcs_cache;
+	u32 mask = 1U << (index % 32);
+	ASSERT(index < VMCS_FIELD_COUNT);
+	if (cache->dirty[index / 32] & mask) {
+		/* Multiple writes to the same field result in one VMWRITE */
+		cache->vmwrite_saved++;
+	}
+	cache->valid[index / 32] |= mask;
+	cache->dirty[index / 32] |= mask;
+}
+
+/* Write dirty fields to CPU, called before VMENTRY if fields are modified. */
+void vmcs_cache_flush(VCPU * vcpu)
+{
+	vmcs_cache_writeback(vcpu);
+}
+
+/* Print VMCS cache statistics of the current CPU. */
+void vmcs_cache_print(VCPU * vcpu)
+{
+	struct vmcs_cache *cache = &vcpu->vmcs_cache;
+	printf("VMCS_CACHE: cpu=0x%02x vmread=%lld vmread_saved=%lld "
+		   "vmwrite=%lld vmwrite_saved=%lld\n", vcpu->id, cache->vmread,
+		   cache->vmread_saved, cache->vmwrite, cache->vmwrite_saved);
+}
+
+/*
+ * Read all existing VMCS fields from CPU to vcpu->vmcs, print if verbose.
+ * The fields are then valid in VMCS cache until the next VMEXIT.
+ */
 void vmcs_dump(VCPU * vcpu, int verbose)
 {
+	vmcs_cache_invalidate(vcpu);
 #define FIELD_CTLS_ARG (&vcpu->vmx_caps)
 #define DECLARE_FIELD_16(encoding, name, exist, ...) \
 	if (exist) { \
-		vcpu->vmcs.name = __vmx_vmread16(encoding); \
+		vmcs_cache_fetch(vcpu, VMCS_INDEX_##name); \
 		if (verbose) { \
 			printf("CPU(0x%02x): vcpu->vmcs." #name " = %04hx\n", vcpu->id, \
 				   vcpu->vmcs.name); \
@@ -236,7 +368,7 @@ void vmcs_dump(VCPU * vcpu, int verbose)
 	}
 #define DECLARE_FIELD_64(encoding, name, exist, ...) \
 	if (exist) { \
-		vcpu->vmcs.name = __vmx_vmread64(encoding); \
+		vmcs_cache_fetch(vcpu, VMCS_INDEX_##name); \
 		if (verbose) { \
 			printf("CPU(0x%02x): vcpu->vmcs." #name " = %016llx\n", vcpu->id, \
 				   vcpu->vmcs.name); \
@@ -244,7 +376,7 @@ void vmcs_dump(VCPU * vcpu, int verbose)
 	}
 #define DECLARE_FIELD_32(encoding, name, exist, ...) \
 	if (exist) { \
-		vcpu->vmcs.name = __vmx_vmread32(encoding); \
+		vmcs_cache_fetch(vcpu, VMCS_INDEX_##name); \
 		if (verbose) { \
 			printf("CPU(0x%02x): vcpu->vmcs." #name " = %08x\n", vcpu->id, \
 				   vcpu->vmcs.name); \
@@ -252,7 +384,7 @@ void vmcs_dump(VCPU * vcpu, int verbose)
 	}
 #define DECLARE_FIELD_NW(encoding, name, exist, ...) \
 	if (exist) { \
-		vcpu->vmcs.name = __vmx_vmreadNW(encoding); \
+		vmcs_cache_fetch(vcpu, VMCS_INDEX_##name); \
 		if (verbose) { \
 			printf("CPU(0x%02x): vcpu->vmcs." #name " = %08lx\n", vcpu->id, \
 				   vcpu->vmcs.name); \
@@ -290,4 +422,56 @@ void vmcs_load(VCPU * vcpu)
 #undef DECLARE_FIELD_64
 #undef DECLARE_FIELD_32
 #undef DECLARE_FIELD_NW
+	/* All fields are written, including dirty fields in VMCS cache */
+	memset(vcpu->vmcs_cache.dirty, 0, sizeof(vcpu->vmcs_cache.dirty));
+}
+
+/*
+ * Build VMREAD and VMWRITE bitmaps for VMCS shadowing. A set bit causes
+ * VMEXIT. Guest VMREAD / VMWRITE of fields that exist in the CPU access the
+ * shadow VMCS without VMEXIT. VMWRITE to read-only fields still causes VMEXIT
+ * unless the CPU allows VMWRITE to all fields (IA32_VMX_MISC bit 29).
+ */
+void vmcs_shadow_build_bitmaps(VCPU * vcpu, u8 * vmread_bitmap,
+							   u8 * vmwrite_bitmap)
+{
+	bool write_ro = vcpu->vmx_msrs[INDEX_IA32_VMX_MISC_MSR] & (1ULL << 29);
+	memset(vmread_bitmap, 0xff, PAGE_SIZE_4K);
+	memset(vmwrite_bitmap, 0xff, PAGE_SIZE_4K);
+#define VMCS_BITMAP_CLEAR(bitmap, encoding) \
+	((bitmap)[(encoding) / 8] &= ~(1U << ((encoding) % 8)))
+#define FIELD_CTLS_ARG (&vcpu->vmx_caps)
+#define DECLARE_FIELD_16_RW(encoding, name, exist, ...) \
+	if (exist) { \
+		VMCS_BITMAP_CLEAR(vmread_bitmap, encoding); \
+		VMCS_BITMAP_CLEAR(vmwrite_bitmap, encoding); \
+	}
+#define DECLARE_FIELD_16_RO(encoding, name, exist, ...) \
+	if (exist) { \
+		VMCS_BITMAP_CLEAR(vmread_bitmap, encoding); \
+		if (write_ro) { \
+			VMCS_BITMAP_CLEAR(vmwrite_bitmap, encoding); \
+		} \
+	}
+/* 64-bit fields also have a high part, encoding + 1 */
+#define DECLARE_FIELD_64_RW(encoding, name, ...) \
+	DECLARE_FIELD_16_RW(encoding, name, __VA_ARGS__) \
+	DECLARE_FIELD_16_RW(encoding + 1, name, __VA_ARGS__)
+#define DECLARE_FIELD_64_RO(encoding, name, ...) \
+	DECLARE_FIELD_16_RO(encoding, name, __VA_ARGS__) \
+	DECLARE_FIELD_16_RO(encoding + 1, name, __VA_ARGS__)
+#define DECLARE_FIELD_32_RW(...) DECLARE_FIELD_16_RW(__VA_ARGS__)
+#define DECLARE_FIELD_32_RO(...) DECLARE_FIELD_16_RO(__VA_ARGS__)
+#define DECLARE_FIELD_NW_RW(...) DECLARE_FIELD_16_RW(__VA_ARGS__)
+#define DECLARE_FIELD_NW_RO(...) DECLARE_FIELD_16_RO(__VA_ARGS__)
+#include <_vmx_vmcs_fields.h>
+#undef DECLARE_FIELD_16_RO
+#undef DECLARE_FIELD_64_RO
+#undef DECLARE_FIELD_32_RO
+#undef DECLARE_FIELD_NW_RO
+#undef DECLARE_FIELD_16_RW
+#undef DECLARE_FIELD_64_RW
+#undef DECLARE_FIELD_32_RW
+#undef DECLARE_FIELD_NW_RW
+#undef VMCS_BITMAP_CLEAR
 }
@@ -32,6 +32,12 @@ static u8 all_vmcs[MAX_VCPU_ENTRIES][MAX_GUESTS][PAGE_SIZE_4K]
 static u8 all_guest_stack[MAX_VCPU_ENTRIES][MAX_GUESTS][PAGE_SIZE_4K]
  ALIGNED_PAGE;
 
+static u8 all_shadow_vmcs[MAX_VCPU_ENTRIES][PAGE_SIZE_4K] ALIGNED_PAGE;
+
+static u8 all_vmread_bitmap[MAX_VCPU_ENTRIES][PAGE_SIZE_4K] ALIGNED_PAGE;
+
+static u8 all_vmwrite_bitmap[MAX_VCPU_ENTRIES][PAGE_SIZE_4K] ALIGNED_PAGE;
+
 static msr_entry_t
 	vmexit_msrstore_entries[MAX_VCPU_ENTRIES][MAX_GUESTS][MAX_MSR_LS]
 	__attribute__((aligned(16)));
@@ -42,6 +48,12 @@ static msr_entry_t
 	vmentry_msrload_entries[MAX_VCPU_ENTRIES][MAX_GUESTS][MAX_MSR_LS]
 	__attribute__((aligned(16)));
 
+static vmexit_stats_t all_vmexit_stats[MAX_VCPU_ENTRIES];
+
+static const char *vmexit_stats_ept_class_names[VMEXIT_STATS_EPT_CLASSES] = {
+	"read-np", "read-perm", "write-np", "write-perm", "fetch-np", "fetch-perm",
+};
+
 extern u64 x_gdt_start[MAX_VCPU_ENTRIES][GDT_NELEMS];
 
 static void shv_vmx_vmcs_init(VCPU * vcpu)
@@ -71,7 +83,7 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 	__vmx_vmwriteNW(VMCS_host_SYSENTER_ESP, rdmsr64(IA32_SYSENTER_ESP_MSR));
 	__vmx_vmwriteNW(VMCS_host_SYSENTER_EIP, rdmsr64(IA32_SYSENTER_EIP_MSR));
 	__vmx_vmwriteNW(VMCS_host_FS_base, rdmsr64(IA32_MSR_FS_BASE));
-	__vmx_vmwriteNW(VMCS_host_GS_base, rdmsr64(IA32_MSR_GS_BASE));
+	__vmx_vmwriteNW(VMCS_host_GS_base, (uintptr_t) & g_percpu[vcpu->idx]);
 
 	//setup default VMX controls
 	__vmx_vmwrite32(VMCS_control_VMX_pin_based,
@@ -130,7 +142,35 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 		seccpu = __vmx_vmread32(VMCS_control_VMX_seccpu_based);
 		seccpu |= (1U << VMX_SECPROCBASED_ENABLE_EPT);
 		__vmx_vmwrite32(VMCS_control_VMX_seccpu_based, seccpu);
-		__vmx_vmwrite64(VMCS_control_EPT_pointer, eptp | 0x1eULL);
+		__vmx_vmwrite64(VMCS_control_EPT_pointer, shv_ept_eptp(vcpu, eptp));
+		if ((g_shv_opt & SHV_USE_PML) && vcpu->ept_ad) {
+			if (_vmx_hasctl_enable_pml(&vcpu->vmx_caps)) {
+				seccpu |= (1U << VMX_SECPROCBASED_ENABLE_PML);
+				__vmx_vmwrite32(VMCS_control_VMX_seccpu_based, seccpu);
+				__vmx_vmwrite64(VMCS_control_PML_address,
+								shv_ept_pml_log(vcpu));
+				__vmx_vmwrite16(VMCS_guest_PML_index,
+								SHV_EPT_PML_ENTRIES - 1);
+				vcpu->ept_pml = true;
+			} else {
+				printf("CPU(0x%02x): PML not supported\n", vcpu->id);
+			}
+		}
+		if (g_shv_opt & SHV_USE_VMFUNC) {
+			/* IA32_VMX_VMFUNC bit 0: EPTP switching */
+			if (_vmx_hasctl_enable_vm_functions(&vcpu->vmx_caps) &&
+				(rdmsr64(IA32_VMX_VMFUNC_MSR) & 1ULL)) {
+				seccpu |= (1U << VMX_SECPROCBASED_ENABLE_VM_FUNCTIONS);
+				__vmx_vmwrite32(VMCS_control_VMX_seccpu_based, seccpu);
+				__vmx_vmwrite64(VMCS_control_VM_function_controls, 1ULL);
+				__vmx_vmwrite64(VMCS_control_EPTP_list_address,
+								shv_ept_build_eptp_list(vcpu));
+				vcpu->ept_vmfunc = true;
+			} else {
+				printf("CPU(0x%02x): VMFUNC EPTP switching not supported\n",
+					   vcpu->id);
+			}
+		}
 #ifdef __i386__
 #if I386_PAE
 		/* For old SHV code, which uses PAE paging. SHV uses 32-bit paging. */
@@ -184,6 +224,8 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 		cr4 |= CR4_PSE;
 #endif							/* I386_PAE */
 #endif							/* __amd64__ */
+		/* Extended state enabled by xsave_init() */
+		cr4 |= read_cr4() & (CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_OSXSAVE);
 		__vmx_vmwriteNW(VMCS_guest_CR4, cr4);
 	}
 	//CR3 set to 0, does not matter
@@ -237,8 +279,8 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 	__vmx_vmwriteNW(VMCS_guest_FS_base, 0);
 	__vmx_vmwrite32(VMCS_guest_FS_limit, 0xffffffff);
 	__vmx_vmwrite32(VMCS_guest_FS_access_rights, 0xc093);
-	__vmx_vmwrite16(VMCS_guest_GS_selector, __DS);
-	__vmx_vmwriteNW(VMCS_guest_GS_base, 0);
+	__vmx_vmwrite16(VMCS_guest_GS_selector, __PCPU);
+	__vmx_vmwriteNW(VMCS_guest_GS_base, (uintptr_t) & g_percpu[vcpu->idx]);
 	__vmx_vmwrite32(VMCS_guest_GS_limit, 0xffffffff);
 	__vmx_vmwrite32(VMCS_guest_GS_access_rights, 0xc093);
 	__vmx_vmwrite16(VMCS_guest_SS_selector, __DS);
@@ -249,6 +291,25 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 	//setup VMCS link pointer
 	__vmx_vmwrite64(VMCS_guest_VMCS_link_pointer, (u64) 0xFFFFFFFFFFFFFFFFULL);
 
+	//VMCS shadowing, guest VMREAD / VMWRITE access the shadow VMCS
+	if (g_shv_opt & SHV_USE_VMCS_SHADOWING) {
+		u64 basic_msr = vcpu->vmx_msrs[INDEX_IA32_VMX_BASIC_MSR];
+		u8 *vmread_bitmap = all_vmread_bitmap[vcpu->idx];
+		u8 *vmwrite_bitmap = all_vmwrite_bitmap[vcpu->idx];
+		ASSERT(_vmx_hasctl_vmcs_shadowing(&vcpu->vmx_caps));
+		vcpu->my_shadow_vmcs = all_shadow_vmcs[vcpu->idx];
+		ASSERT(__vmx_vmclear(hva2spa(vcpu->my_shadow_vmcs)));
+		/* Bit 31 is the shadow-VMCS indicator */
+		*((u32 *) vcpu->my_shadow_vmcs) =
+			((u32) basic_msr & 0x7fffffffU) | 0x80000000U;
+		vmcs_shadow_build_bitmaps(vcpu, vmread_bitmap, vmwrite_bitmap);
+		__vmx_vmwrite64(VMCS_control_VMREAD_bitmap_address,
+						hva2spa(vmread_bitmap));
+		__vmx_vmwrite64(VMCS_control_VMWRITE_bitmap_address,
+						hva2spa(vmwrite_bitmap));
+		vmcs_shadowing_set(vcpu, true);
+	}
+
 	//trap access to CR0 fixed 1-bits
 	{
 		ulong_t cr0_mask = vcpu->vmx_msrs[INDEX_IA32_VMX_CR0_FIXED0_MSR];
@@ -266,6 +327,334 @@ static void shv_vmx_vmcs_init(VCPU * vcpu)
 	__vmx_vmwriteNW(VMCS_control_CR0_shadow, 0);
 }
 
+/*
+ * VMEXIT reasons whose exit qualification is read for the flight recorder.
+ * VMREAD may be a VMEXIT to L0, so other reasons record 0.
+ */
+#define VMEXIT_STATS_QUAL_REASONS \
+	((1ULL << VMX_VMEXIT_EXCEPTION) | \
+	 (1ULL << VMX_VMEXIT_INVLPG) | \
+	 (1ULL << VMX_VMEXIT_CRX_ACCESS) | \
+	 (1ULL << VMX_VMEXIT_MOV_DR) | \
+	 (1ULL << VMX_VMEXIT_IOIO) | \
+	 (1ULL << VMX_VMEXIT_APIC_ACCESS) | \
+	 (1ULL << VMX_VMEXIT_EPT_VIOLATION))
+
+/*
+ * Start accounting the current VMEXIT and record it in the flight recorder.
+ * Cycles spent in the hypervisor are added by vmexit_stats_end() when
+ * vmresume_asm() is called.
+ */
+static void vmexit_stats_begin(VCPU * vcpu, u32 vmexit_reason,
+							   ulong_t guest_rip, u64 exit_tsc)
+{
+	vmexit_stats_t *stats = vcpu->vmexit_stats;
+	u32 index = vmexit_reason & 0xffffU;
+	ulong_t qual = 0;
+	if (index < 64 && (VMEXIT_STATS_QUAL_REASONS & (1ULL << index))) {
+		qual = vmcs_cache_get(vcpu, info_exit_qualification);
+	}
+	stats->flight = flight_record(vcpu, FLIGHT_VMEXIT, vmexit_reason,
+								  guest_rip, qual, exit_tsc);
+	ASSERT(index < VMX_VMEXIT_COUNT);
+	stats->exit_tsc = exit_tsc;
+	stats->exit_reason = index;
+	stats->ept_class = VMEXIT_STATS_EPT_CLASSES;
+	stats->count[index]++;
+	if (index == VMX_VMEXIT_EPT_VIOLATION) {
+		ulong_t q = qual;
+		u32 ept_class;
+		/* Bits 0 - 2: access type; bits 3 - 5: permissions in EPT */
+		if (q & 0x2UL) {
+			ept_class = 2;
+		} else if (q & 0x4UL) {
+			ept_class = 4;
+		} else {
+			ept_class = 0;
+		}
+		if (q & 0x38UL) {
+			ept_class++;
+		}
+		stats->ept_class = ept_class;
+		stats->ept_count[ept_class]++;
+	}
+}
+
+/* Called by vmresume_asm(), finish accounting the current VMEXIT. */
+void vmexit_stats_end(VCPU * vcpu)
+{
+	vmexit_stats_t *stats = vcpu->vmexit_stats;
+	u64 now = rdtsc();
+	u64 cycles = now - stats->exit_tsc;
+	flight_record_end(stats->flight, stats->exit_tsc, now);
+	stats->cycles[stats->exit_reason] += cycles;
+	if (stats->ept_class < VMEXIT_STATS_EPT_CLASSES) {
+		stats->ept_cycles[stats->ept_class] += cycles;
+	}
+}
+
+/* Print VMEXIT statistics of the current CPU. */
+void vmexit_stats_print(VCPU * vcpu)
+{
+	vmexit_stats_t *stats = vcpu->vmexit_stats;
+	for (u32 i = 0; i < VMX_VMEXIT_COUNT; i++) {
+		if (stats->count[i]) {
+			printf("EXIT_STATS: cpu=0x%02x reason=%u count=%lld cycles=%lld\n",
+				   vcpu->id, i, stats->count[i], stats->cycles[i]);
+		}
+	}
+	for (u32 i = 0; i < VMEXIT_STATS_EPT_CLASSES; i++) {
+		if (stats->ept_count[i]) {
+			printf("EXIT_STATS: cpu=0x%02x reason=%u class=%s count=%lld "
+				   "cycles=%lld\n", vcpu->id, VMX_VMEXIT_EPT_VIOLATION,
+				   vmexit_stats_ept_class_names[i], stats->ept_count[i],
+				   stats->ept_cycles[i]);
+		}
+	}
+	vmcs_cache_print(vcpu);
+}
+
+/* Default handler for VMEXITs not handled by SHV */
+static void vmexit_handle_unknown(VCPU * vcpu, struct regs *r,
+								  vmexit_info_t * info)
+{
+	(void)r;
+	ASSERT(vcpu == get_vcpu());
+	printf("CPU(0x%02x): unknown vmexit %u\n", vcpu->id, info->vmexit_reason);
+	printf("CPU(0x%02x): rip = 0x%x\n", vcpu->id, info->guest_rip);
+	vmcs_dump(vcpu, 0);
+	ASSERT(0 && "Unknown VMEXIT");
+}
+
+static void vmexit_handle_cpuid(VCPU * vcpu, struct regs *r,
+								vmexit_info_t * info)
+{
+	u32 old_eax = r->eax;
+	ASSERT(vcpu == get_vcpu());
+	cpuid_raw(&r->eax, &r->ebx, &r->ecx, &r->edx);
+	if (old_eax == 0x1) {
+		/* Clear VMX capability */
+		r->ecx &= ~(1U << 5);
+	}
+	vmcs_cache_set(vcpu, guest_RIP, info->guest_rip + info->inst_len);
+}
+
+static void vmexit_handle_rdmsr(VCPU * vcpu, struct regs *r,
+								vmexit_info_t * info)
+{
+	ASSERT(vcpu == get_vcpu());
+	rdmsr(r->ecx, &r->eax, &r->edx);
+	vmcs_cache_set(vcpu, guest_RIP, info->guest_rip + info->inst_len);
+}
+
+/*
+ * Let the guest retry the access that caused an EPT violation or PML full
+ * VMEXIT (exit qualification q). Re-inject the event being delivered if any.
+ */
+static void vmexit_retry_access(VCPU * vcpu, vmexit_info_t * info, ulong_t q)
+{
+	u32 idt_info = vmcs_cache_get(vcpu, info_IDT_vectoring_information);
+	if (idt_info & 0x80000000U) {
+		__vmx_vmwrite32(VMCS_control_VM_entry_interruption_information,
+						idt_info & ~0x1000U);
+		if (idt_info & 0x800U) {
+			__vmx_vmwrite32(VMCS_control_VM_entry_exception_errorcode,
+							__vmx_vmread32(VMCS_info_IDT_vectoring_error_code));
+		}
+		__vmx_vmwrite32(VMCS_control_VM_entry_instruction_length,
+						info->inst_len);
+	} else if (q & (1UL << 12)) {
+		/* NMI unblocking due to IRET, block NMI again */
+		u32 intr = __vmx_vmread32(VMCS_guest_interruptibility);
+		__vmx_vmwrite32(VMCS_guest_interruptibility, intr | 0x8U);
+	}
+}
+
+static void vmexit_handle_ept_violation(VCPU * vcpu, struct regs *r,
+										vmexit_info_t * info)
+{
+	ulong_t q = vmcs_cache_get(vcpu, info_exit_qualification);
+	u64 paddr = vmcs_cache_get(vcpu, guest_paddr);
+	(void)r;
+	ASSERT(g_shv_opt & SHV_USE_EPT);
+	ASSERT(vcpu == get_vcpu());
+	if (shv_ept_handle_violation(vcpu, paddr, q)) {
+		vmexit_retry_access(vcpu, info, q);
+		return;
+	}
+	/* Unknown EPT violation */
+	printf("CPU(0x%02x): ept: 0x%08lx\n", vcpu->id, q);
+	printf("CPU(0x%02x): paddr: 0x%016llx\n", vcpu->id, paddr);
+	printf("CPU(0x%02x): vaddr: 0x%08lx\n", vcpu->id,
+		   vmcs_cache_get(vcpu, info_guest_linear_address));
+	vmcs_dump(vcpu, 0);
+	ASSERT(0 && "Unknown EPT violation");
+}
+
+/* Drain the page-modification log and let the guest retry the write */
+static void vmexit_handle_pml_full(VCPU * vcpu, struct regs *r,
+								   vmexit_info_t * info)
+{
+	(void)r;
+	shv_ept_handle_pml_full(vcpu);
+	vmexit_retry_access(vcpu, info,
+						vmcs_cache_get(vcpu, info_exit_qualification));
+}
+
+/* Dispatch VMCALL using the VMCALL number in EAX */
+static void vmexit_handle_vmcall(VCPU * vcpu, struct regs *r,
+								 vmexit_info_t * info)
+{
+	if (r->eax < SHV_VMCALL_COUNT && vcpu->vmcall_handlers[r->eax]) {
+		vcpu->vmcall_handlers[r->eax] (vcpu, r, info);
+		return;
+	}
+	printf("CPU(0x%02x): unknown vmcall\n", vcpu->id);
+	vmexit_handle_unknown(vcpu, r, info);
+}
+
+static void vmexit_handle_vmcall_exit_stats(VCPU * vcpu, struct regs *r,
+											vmexit_info_t * info)
+{
+	(void)r;
+	vmexit_stats_print(vcpu);
+	if (g_shv_opt & SHV_USE_EPT) {
+		shv_ept_print_stats(vcpu);
+	}
+	vmcs_cache_set(vcpu, guest_RIP, info->guest_rip + info->inst_len);
+}
+
+static void vmexit_handle_vmcall_nop(VCPU * vcpu, struct regs *r,
+									 vmexit_info_t * info)
+{
+	(void)r;
+	vmcs_cache_set(vcpu, guest_RIP, info->guest_rip + info->inst_len);
+}
+
+static const vmexit_handler_t vmexit_default_handlers[VMX_VMEXIT_COUNT] = {
+	[0 ... VMX_VMEXIT_COUNT - 1] = vmexit_handle_unknown,
+	[VMX_VMEXIT_CPUID] = vmexit_handle_cpuid,
+	[VMX_VMEXIT_VMCALL] = vmexit_handle_vmcall,
+	[VMX_VMEXIT_RDMSR] = vmexit_handle_rdmsr,
+	[VMX_VMEXIT_EPT_VIOLATION] = vmexit_handle_ept_violation,
+	[VMX_VMEXIT_PAGE_MODIF_LOG_FULL] = vmexit_handle_pml_full,
+};
+
+/* Initialize VMEXIT and VMCALL dispatch tables of the current CPU. */
+static void vmexit_handlers_init(VCPU * vcpu)
+{
+	memcpy(vcpu->vmexit_handlers, vmexit_default_handlers,
+		   sizeof(vcpu->vmexit_handlers));
+	memset(vcpu->vmcall_handlers, 0, sizeof(vcpu->vmcall_handlers));
+	vmcall_register(vcpu, SHV_VMCALL_NOP, vmexit_handle_vmcall_nop);
+	vmcall_register(vcpu, SHV_VMCALL_EXIT_STATS,
+					vmexit_handle_vmcall_exit_stats);
+	/* vmexit_handler() acknowledges EPT shootdowns for this VMCALL */
+	vmcall_register(vcpu, SHV_VMCALL_EPT_SHOOTDOWN,
+					vmexit_handle_vmcall_nop);
+}
+
+/*
+ * VMEXITs that vmexit_asm can handle without calling vmexit_handler(). The
+ * fast path does the same thing as the default handlers, so an exit reason is
+ * only handled by the fast path when its default handler is in use.
+ */
+#define VMEXIT_FAST_PATH_REASONS \
+	((1U << VMX_VMEXIT_CPUID) | (1U << VMX_VMEXIT_VMCALL) | \
+	 (1U << VMX_VMEXIT_RDMSR))
+
+_Static_assert(offsetof(VCPU, vmexit_fast_mask) == VCPU_VMEXIT_FAST_MASK,
+			   "VCPU_VMEXIT_FAST_MASK incorrect");
+
+/* Compute vcpu->vmexit_fast_mask, called when VMEXIT handlers change. */
+static void vmexit_fast_path_update(VCPU * vcpu)
+{
+	u32 mask = 0;
+	if (vcpu->vmexit_fast_path) {
+		for (u32 i = 0; i < 32; i++) {
+			if ((VMEXIT_FAST_PATH_REASONS & (1U << i)) &&
+				vcpu->vmexit_handlers[i] == vmexit_default_handlers[i]) {
+				mask |= 1U << i;
+			}
+		}
+	}
+	vcpu->vmexit_fast_mask = mask;
+}
+
+/* Enable or disable VMEXIT fast path in vmexit_asm for the current CPU. */
+void vmexit_fast_path_set(VCPU * vcpu, bool enable)
+{
+	vcpu->vmexit_fast_path = enable;
+	vmexit_fast_path_update(vcpu);
+}
+
+/*
+ * Enable or disable VMCS shadowing for the current VMCS. When disabled, guest
+ * VMREAD / VMWRITE cause VMEXIT. The shadow VMCS is only linked while VMCS
+ * shadowing is enabled, because VMENTRY requires the shadow-VMCS indicator in
+ * the linked VMCS to match the control.
+ */
+void vmcs_shadowing_set(VCPU * vcpu, bool enable)
+{
+	u32 seccpu = __vmx_vmread32(VMCS_control_VMX_seccpu_based);
+	ASSERT(vcpu->my_shadow_vmcs);
+	if (enable) {
+		seccpu |= (1U << VMX_SECPROCBASED_VMCS_SHADOWING);
+		__vmx_vmwrite64(VMCS_guest_VMCS_link_pointer,
+						hva2spa(vcpu->my_shadow_vmcs));
+	} else {
+		seccpu &= ~(1U << VMX_SECPROCBASED_VMCS_SHADOWING);
+		__vmx_vmwrite64(VMCS_guest_VMCS_link_pointer,
+						(u64) 0xFFFFFFFFFFFFFFFFULL);
+		/* Write data cached by the CPU to the shadow VMCS region */
+		ASSERT(__vmx_vmclear(hva2spa(vcpu->my_shadow_vmcs)));
+	}
+	__vmx_vmwrite32(VMCS_control_VMX_seccpu_based, seccpu);
+}
+
+/*
+ * Handle VMEXIT using the default handler for the exit reason. This can be
+ * called by registered handlers for VMEXITs they do not handle.
+ */
+void vmexit_handle_default(VCPU * vcpu, struct regs *r, vmexit_info_t * info)
+{
+	vmexit_default_handlers[info->vmexit_reason & 0xffffU] (vcpu, r, info);
+}
+
+/* Replace the default handler of a VMEXIT reason. */
+void vmexit_register(VCPU * vcpu, u32 reason, vmexit_handler_t handler)
+{
+	ASSERT(reason < VMX_VMEXIT_COUNT);
+	ASSERT(vcpu->vmexit_handlers[reason] == vmexit_default_handlers[reason]);
+	vcpu->vmexit_handlers[reason] = handler;
+	vmexit_fast_path_update(vcpu);
+}
+
+/* Restore the default handler of a VMEXIT reason. */
+void vmexit_deregister(VCPU * vcpu, u32 reason, vmexit_handler_t handler)
+{
+	ASSERT(reason < VMX_VMEXIT_COUNT);
+	ASSERT(vcpu->vmexit_handlers[reason] == handler);
+	vcpu->vmexit_handlers[reason] = vmexit_default_handlers[reason];
+	vmexit_fast_path_update(vcpu);
+}
+
+/* Register handler for VMCALLs with EAX = number. */
+void vmcall_register(VCPU * vcpu, u32 number, vmexit_handler_t handler)
+{
+	ASSERT(number < SHV_VMCALL_COUNT);
+	ASSERT(vcpu->vmcall_handlers[number] == NULL);
+	vcpu->vmcall_handlers[number] = handler;
+}
+
+/* Deregister handler for VMCALLs with EAX = number. */
+void vmcall_deregister(VCPU * vcpu, u32 number, vmexit_handler_t handler)
+{
+	ASSERT(number < SHV_VMCALL_COUNT);
+	ASSERT(vcpu->vmcall_handlers[number] == handler);
+	vcpu->vmcall_handlers[number] = NULL;
+}
+
 void shv_vmx_main(VCPU * vcpu)
 {
 	u32 vmcs_revision_identifier;
@@ -367,8 +756,13 @@ void shv_vmx_main(VCPU * vcpu)
 
 	/* Modify VMCS */
 	shv_vmx_vmcs_init(vcpu);
+	vmcs_cache_init(vcpu);
 	vmcs_dump(vcpu, 0);
 
+	vcpu->vmexit_stats = &all_vmexit_stats[vcpu->idx];
+	vmexit_handlers_init(vcpu);
+	vmexit_fast_path_set(vcpu, g_shv_opt & SHV_VMEXIT_FAST_PATH);
+
 	/* VMLAUNCH */
 	{
 		struct regs r;
@@ -380,66 +774,28 @@ void shv_vmx_main(VCPU * vcpu)
 	ASSERT(0 && "vmlaunch_asm() should never return");
 }
 
-void vmexit_handler(ulong_t guest_rip, VCPU * vcpu, struct regs *r)
+/*
+ * Called by vmexit_asm. Handlers may call vmresume_asm() (or vmlaunch_asm())
+ * themselves after vmcs_cache_flush(). If they return, the guest is resumed
+ * here.
+ */
+void vmexit_handler(ulong_t guest_rip, VCPU * vcpu, struct regs *r,
+					u64 exit_tsc)
 {
-	u32 vmexit_reason = __vmx_vmread32(VMCS_info_vmexit_reason);
-	u32 inst_len = __vmx_vmread32(VMCS_info_vmexit_instruction_length);
-	ASSERT(guest_rip == __vmx_vmreadNW(VMCS_guest_RIP));
-
-	if (vcpu->vmexit_handler_override) {
-		vmexit_info_t vmexit_info = {
-			.vmexit_reason = vmexit_reason,
-			.guest_rip = guest_rip,
-			.inst_len = inst_len,
-		};
-		vcpu->vmexit_handler_override(vcpu, r, &vmexit_info);
-	}
-
-	ASSERT(vcpu == get_vcpu());
-	switch (vmexit_reason) {
-	case VMX_VMEXIT_CPUID:
-		{
-			u32 old_eax = r->eax;
-			cpuid_raw(&r->eax, &r->ebx, &r->ecx, &r->edx);
-			if (old_eax == 0x1) {
-				/* Clear VMX capability */
-				r->ecx &= ~(1U << 5);
-			}
-			__vmx_vmwriteNW(VMCS_guest_RIP, guest_rip + inst_len);
-			break;
-		}
-	case VMX_VMEXIT_RDMSR:
-		{
-			rdmsr(r->ecx, &r->eax, &r->edx);
-			__vmx_vmwriteNW(VMCS_guest_RIP, guest_rip + inst_len);
-			break;
-		}
-	case VMX_VMEXIT_EPT_VIOLATION:
-		ASSERT(g_shv_opt & SHV_USE_EPT);
-		{
-			ulong_t q = __vmx_vmreadNW(VMCS_info_exit_qualification);
-			u64 paddr = __vmx_vmread64(VMCS_guest_paddr);
-			ulong_t vaddr = __vmx_vmreadNW(VMCS_info_guest_linear_address);
-			/* Unknown EPT violation */
-			printf("CPU(0x%02x): ept: 0x%08lx\n", vcpu->id, q);
-			printf("CPU(0x%02x): paddr: 0x%016llx\n", vcpu->id, paddr);
-			printf("CPU(0x%02x): vaddr: 0x%08lx\n", vcpu->id, vaddr);
-			vmcs_dump(vcpu, 0);
-			ASSERT(0 && "Unknown EPT violation");
-			break;
-		}
-	case VMX_VMEXIT_VMCALL:
-		printf("CPU(0x%02x): unknown vmcall\n", vcpu->id);
-		/* fallthrough */
-	default:
-		{
-			printf("CPU(0x%02x): unknown vmexit %u\n", vcpu->id, vmexit_reason);
-			printf("CPU(0x%02x): rip = 0x%x\n", vcpu->id, guest_rip);
-			vmcs_dump(vcpu, 0);
-			ASSERT(0 && "Unknown VMEXIT");
-			break;
-		}
+	vmexit_info_t info;
+	vmcs_cache_invalidate(vcpu);
+	info.vmexit_reason = vmcs_cache_get(vcpu, info_vmexit_reason);
+	info.guest_rip = guest_rip;
+	info.inst_len = vmcs_cache_get(vcpu, info_vmexit_instruction_length);
+	ASSERT(guest_rip == vmcs_cache_get(vcpu, guest_RIP));
+	trace_event(TRACE_VMEXIT, info.vmexit_reason, guest_rip, 0);
+	vmexit_stats_begin(vcpu, info.vmexit_reason, guest_rip, exit_tsc);
+	xsave_vmexit(vcpu);
+	if (g_shv_opt & SHV_USE_SHARED_EPT) {
+		shv_ept_shootdown_poll(vcpu);
 	}
+	vcpu->vmexit_handlers[info.vmexit_reason & 0xffffU] (vcpu, r, &info);
+	vmcs_cache_flush(vcpu);
 	vmresume_asm(r);
 }
 
@@ -19,6 +19,24 @@
 #include <xmhf.h>
 #include <shv.h>
 
+#ifdef __amd64__
+extern void shv_disable_enable_paging_asm(char *s, u64 sinks);
+
+/*
+ * Disable paging, print a string directly to the serial port and port 0xe9
+ * (if enabled in g_console_sinks), and enable paging again. The console lock
+ * and the UART lock are taken here, so that the assembly code does not
+ * interleave with other output.
+ */
+void shv_disable_enable_paging(char *s)
+{
+	u64 sinks;
+	ulong_t flags = emhfc_putchar_direct_begin(&sinks);
+	shv_disable_enable_paging_asm(s, sinks);
+	emhfc_putchar_direct_end(flags, sinks);
+}
+#endif							/* __amd64__ */
+
 void shv_main(VCPU * vcpu)
 {
 	if (vcpu->isbsp) {
@@ -33,11 +51,8 @@ void shv_main(VCPU * vcpu)
 
 	/* Barrier */
 	{
-		static u32 count = 0;
-		lock_incl(&count);
-		while (count < g_midtable_numentries) {
-			cpu_relax();
-		}
+		static smp_barrier_t barrier;
+		smp_barrier_wait(&barrier, vcpu);
 	}
 
 	/* When testing NMI, we need exactly 2 CPUs. */
@@ -92,6 +107,12 @@ void shv_main(VCPU * vcpu)
 		}
 	}
 
+	if ((g_shv_opt & SHV_USE_SERIAL_IRQ) && !(g_nmi_opt & SHV_NMI_ENABLE)) {
+		if (vcpu->isbsp) {
+			dbg_x86_uart_enable_irq();
+		}
+	}
+
 	/* When testing NMI, CPU 0 only forwards interrupts (does not enter VMX). */
 	if (g_nmi_opt & SHV_NMI_ENABLE) {
 		if (vcpu->isbsp) {
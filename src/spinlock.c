@@ -18,22 +18,175 @@
 
 #include <xmhf.h>
 
-void spin_lock(spin_lock_t * lock)
+/*
+ * Spinlocks. The implementation is selected at build time with SPINLOCK_IMPL
+ * ("./configure --with-spinlock="):
+ * * SPINLOCK_TAS: test-and-set. Unfair, a CPU may starve.
+ * * SPINLOCK_TICKET: ticket lock. CPUs acquire the lock in FIFO order, but
+ *   all waiters spin on the same cache line.
+ * * SPINLOCK_MCS: MCS queue lock. CPUs acquire the lock in FIFO order and
+ *   each waiter spins on its own queue node. The K42 variant is used, so the
+ *   queue node only lives on the waiter's stack while waiting and the API is
+ *   the same as other implementations.
+ *
+ * When SPINLOCK_STATS is set ("./configure --enable-spinlock-stats"), each
+ * lock records the number of acquisitions, contended acquisitions, spin
+ * iterations and cycles held.
+ */
+
+#if SPINLOCK_STATS
+static inline u64 spin_lock_rdtsc(void)
 {
+	u32 eax, edx;
+	asm volatile ("rdtsc":"=a" (eax), "=d"(edx));
+	return ((u64) edx << 32) | eax;
+}
+#endif							/* SPINLOCK_STATS */
+
+#if SPINLOCK_IMPL == SPINLOCK_MCS
+/* Compare and swap pointer, return whether succeed. */
+static inline bool spin_lock_cas(struct spin_lock_qnode *volatile *ptr,
+								 struct spin_lock_qnode *old,
+								 struct spin_lock_qnode *new)
+{
+	return __sync_bool_compare_and_swap(ptr, old, new);
+}
+
+/* Value of qnode->tail when the waiter does not own the lock yet */
+#define SPIN_LOCK_WAITING ((struct spin_lock_qnode *) 1)
+#endif							/* SPINLOCK_IMPL == SPINLOCK_MCS */
+
+/* Acquire lock, return number of spin iterations. */
+static u64 spin_lock_acquire(spin_lock_t * lock)
+{
+	u64 spins = 0;
+#if SPINLOCK_IMPL == SPINLOCK_TAS
 	while (1) {
-		if (*lock == 0) {
-			spin_lock_t val = 1;
-			asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(*lock));
+		if (lock->locked == 0) {
+			u32 val = 1;
+			asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(lock->locked));
 			if (val == 0) {
 				break;
 			}
+		}
+		cpu_relax();
+		spins++;
+	}
+#elif SPINLOCK_IMPL == SPINLOCK_TICKET
+	u32 ticket = 1;
+	asm volatile ("lock xadd %0, %1":"+r" (ticket), "+m"(lock->next)::"memory");
+	while (lock->owner != ticket) {
+		cpu_relax();
+		spins++;
+	}
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+	struct spin_lock_qnode *l = &lock->q;
+	while (1) {
+		struct spin_lock_qnode *prev = l->tail;
+		if (prev == NULL) {
+			/* Lock is free, acquire it without a queue node */
+			if (spin_lock_cas(&l->tail, NULL, l)) {
+				break;
+			}
+		} else {
+			struct spin_lock_qnode n = { SPIN_LOCK_WAITING, NULL };
+			struct spin_lock_qnode *succ;
+			if (!spin_lock_cas(&l->tail, prev, &n)) {
+				spins++;
+				continue;
+			}
+			prev->next = &n;
+			while (n.tail == SPIN_LOCK_WAITING) {
+				cpu_relax();
+				spins++;
+			}
+			/* Own the lock, move successor from n to lock */
+			succ = n.next;
+			if (succ == NULL) {
+				l->next = NULL;
+				if (!spin_lock_cas(&l->tail, &n, l)) {
+					/* A new waiter is linking itself after n */
+					while ((succ = n.next) == NULL) {
+						cpu_relax();
+					}
+					l->next = succ;
+				}
+			} else {
+				l->next = succ;
+			}
+			break;
+		}
+	}
+#else							/* SPINLOCK_IMPL */
+#error "Unknown SPINLOCK_IMPL"
+#endif							/* SPINLOCK_IMPL */
+	asm volatile ("":::"memory");
+	return spins;
+}
+
+/* Release lock. */
+static void spin_lock_release(spin_lock_t * lock)
+{
+	asm volatile ("":::"memory");
+#if SPINLOCK_IMPL == SPINLOCK_TAS
+	u32 val = 0;
+	asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(lock->locked));
+#elif SPINLOCK_IMPL == SPINLOCK_TICKET
+	/* Only the owner writes lock->owner */
+	lock->owner = lock->owner + 1;
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+	struct spin_lock_qnode *l = &lock->q;
+	struct spin_lock_qnode *succ = l->next;
+	if (succ == NULL) {
+		if (spin_lock_cas(&l->tail, l, NULL)) {
+			return;
+		}
+		/* A new waiter is linking itself after lock */
+		while ((succ = l->next) == NULL) {
 			cpu_relax();
 		}
 	}
+	succ->tail = NULL;
+#else							/* SPINLOCK_IMPL */
+#error "Unknown SPINLOCK_IMPL"
+#endif							/* SPINLOCK_IMPL */
+}
+
+void spin_lock(spin_lock_t * lock)
+{
+	u64 spins = spin_lock_acquire(lock);
+#if SPINLOCK_STATS
+	lock->acquired++;
+	if (spins) {
+		lock->contended++;
+		lock->spins += spins;
+	}
+	lock->acquire_tsc = spin_lock_rdtsc();
+#else							/* !SPINLOCK_STATS */
+	(void)spins;
+#endif							/* SPINLOCK_STATS */
 }
 
 void spin_unlock(spin_lock_t * lock)
 {
-	spin_lock_t val = 0;
-	asm volatile ("lock xchg %0, %1":"+r" (val), "+m"(*lock));
+#if SPINLOCK_STATS
+	lock->hold_cycles += spin_lock_rdtsc() - lock->acquire_tsc;
+#endif							/* SPINLOCK_STATS */
+	spin_lock_release(lock);
+}
+
+/*
+ * Print statistics of a lock. The statistics are read without holding the
+ * lock, so they may be slightly inconsistent.
+ */
+void spin_lock_print_stats(spin_lock_t * lock, const char *name)
+{
+#if SPINLOCK_STATS
+	printf("SPINLOCK: name=%s impl=%d acquired=%lld contended=%lld spins=%lld "
+		   "hold_cycles=%lld\n", name, SPINLOCK_IMPL, lock->acquired,
+		   lock->contended, lock->spins, lock->hold_cycles);
+#else							/* !SPINLOCK_STATS */
+	(void)lock;
+	printf("SPINLOCK: name=%s impl=%d stats=disabled\n", name, SPINLOCK_IMPL);
+#endif							/* SPINLOCK_STATS */
 }
@@ -0,0 +1,158 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * Binary event trace. trace_event() (in xmhf.h) writes fixed-size records to
+ * a per-CPU buffer, which costs tens of cycles instead of the thousands of
+ * cycles of printf(). trace_flush() prints the records of all CPUs to the
+ * console sinks that accept binary data, in frames of
+ *   u8 magic[4] = TRACE_FRAME_MAGIC
+ *   u16 nrec                    number of records
+ *   u16 rec_size                sizeof(trace_record_t)
+ *   u32 checksum                Adler-32 of the records
+ *   trace_record_t rec[nrec]
+ * (little endian, no padding). Frames are mixed with text output, and are
+ * decoded by tools/trace/decode.py.
+ *
+ * With TRACE_STREAM, trace_event() calls trace_flush() while the buffer is at
+ * least half full. Otherwise records are printed at explicit trace_flush()
+ * calls and by HALT() (trace_flush_halt()); records are dropped when the
+ * buffer is full.
+ */
+
+#define TRACE_FRAME_MAGIC	"\xa5TRC"
+#define TRACE_FRAME_RECORDS	64
+
+/* Number of cpu_relax() trace_flush_halt() waits for the console lock */
+#define TRACE_HALT_SPINS	100000000
+
+typedef struct {
+	u8 magic[4];
+	u16 nrec;
+	u16 rec_size;
+	u32 checksum;
+} __attribute__((packed)) trace_frame_t;
+
+trace_buf_t g_trace_bufs[MAX_VCPU_ENTRIES];
+
+/* Frame being printed, protected by emhfc_putchar_linelock_arg */
+static struct {
+	trace_frame_t hdr;
+	trace_record_t rec[TRACE_FRAME_RECORDS];
+} __attribute__((packed)) trace_frame;
+
+static u32 trace_adler32(const void *data, size_t len)
+{
+	const u8 *p = data;
+	u32 a = 1;
+	u32 b = 0;
+	for (size_t i = 0; i < len; i++) {
+		a = (a + p[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+/* Move up to TRACE_FRAME_RECORDS records of buf to trace_frame and print. */
+static void trace_flush_frame(trace_buf_t * buf)
+{
+	u32 head = buf->head;
+	u32 n = buf->tail - head;
+	size_t size;
+
+	if (n > TRACE_FRAME_RECORDS) {
+		n = TRACE_FRAME_RECORDS;
+	}
+	for (u32 i = 0; i < n; i++) {
+		trace_frame.rec[i] = buf->rec[(head + i) % TRACE_RECORDS];
+	}
+	asm volatile ("":::"memory");
+	buf->head = head + n;
+
+	size = n * sizeof(trace_record_t);
+	memcpy(trace_frame.hdr.magic, TRACE_FRAME_MAGIC, 4);
+	trace_frame.hdr.nrec = n;
+	trace_frame.hdr.rec_size = sizeof(trace_record_t);
+	trace_frame.hdr.checksum = trace_adler32(trace_frame.rec, size);
+	emhfc_putbin(&trace_frame, sizeof(trace_frame_t) + size);
+}
+
+/* Return whether any CPU has trace records that are not printed. */
+static bool trace_pending(void)
+{
+	for (u32 i = 0; i < MAX_VCPU_ENTRIES; i++) {
+		if (g_trace_bufs[i].head != g_trace_bufs[i].tail) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Print all trace records, the console lock must be held. */
+static void trace_flush_locked(void)
+{
+	for (u32 i = 0; i < MAX_VCPU_ENTRIES; i++) {
+		trace_buf_t *buf = &g_trace_bufs[i];
+		while (buf->head != buf->tail) {
+			trace_flush_frame(buf);
+		}
+	}
+	emhfc_putchar_flush();
+}
+
+/*
+ * Print all trace records. Return immediately if another CPU holds the
+ * console lock, because the records will be printed by the next call.
+ */
+void trace_flush(void)
+{
+	if (!emhfc_putchar_linetrylock(emhfc_putchar_linelock_arg)) {
+		return;
+	}
+	trace_flush_locked();
+	emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+}
+
+/*
+ * Print all trace records before HALT(). Wait for the console lock, but give
+ * up after TRACE_HALT_SPINS because the holder may never release it (e.g. it
+ * is halted, or it is the current CPU). Then print a marker without the lock,
+ * so that the records are not lost silently.
+ */
+void trace_flush_halt(void)
+{
+	u32 spins = 0;
+	if (!trace_pending()) {
+		return;
+	}
+	while (!emhfc_putchar_linetrylock(emhfc_putchar_linelock_arg)) {
+		if (++spins >= TRACE_HALT_SPINS) {
+			const char *p = "\nTRACE: records dropped, console lock busy\n";
+			while (*p) {
+				emhfc_putchar(*p++, NULL);
+			}
+			emhfc_putchar_flush();
+			return;
+		}
+		cpu_relax();
+	}
+	trace_flush_locked();
+	emhfc_putchar_lineunlock(emhfc_putchar_linelock_arg);
+}
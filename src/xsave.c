@@ -0,0 +1,270 @@
+/*
+ * SHV - Small HyperVisor for testing nested virtualization in hypervisors
+ * Copyright (C) 2023  Eric Li
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xmhf.h>
+
+/*
+ * Extended state (x87, SSE, AVX) management. SHV is compiled with -mno-sse,
+ * so only code between xsave_fpu_begin() and xsave_fpu_end() may use SIMD
+ * registers, e.g. simd_memset() and simd_memcmp(). Extended state is enabled
+ * (CR4.OSFXSR, CR4.OSXSAVE, XCR0) when "xsave=" on the multiboot command line
+ * selects a policy other than XSAVE_POLICY_NONE. The guest shares XCR0 with
+ * the host (XSETBV always causes VMEXIT, but SHV's guest does not execute it).
+ *
+ * Host code in a VMEXIT handler must not clobber the guest's extended state.
+ * With XSAVE_POLICY_EAGER, vmexit_handler() saves the guest state to a
+ * per-VCPU area at every VMEXIT. With XSAVE_POLICY_LAZY, xsave_fpu_begin()
+ * saves it at the first use in a VMEXIT, so VMEXITs that do not use SIMD cost
+ * nothing. In both cases the state is restored by vmlaunch_asm() or
+ * vmresume_asm(). The fast path in vmexit_asm does not touch extended state.
+ *
+ * Interrupt and exception handlers (in the host or in the guest) must not
+ * clobber the state of the code they interrupt. Instead of saving the state
+ * on the IDT path, xsave_fpu_begin() fails when it interrupts another
+ * xsave_fpu_begin() / xsave_fpu_end() section, and callers fall back to code
+ * that only uses general purpose registers. Host and guest (outside VMEXIT
+ * handlers) are tracked separately.
+ */
+
+/* XCR0 bits enabled by SHV: x87, SSE, AVX */
+#define XSAVE_XCR0_MASK		0x7ULL
+
+typedef struct {
+	u8 area[XSAVE_AREA_SIZE];	/* Guest state, must be 64-byte aligned */
+	u32 policy;					/* XSAVE_POLICY_* */
+	bool in_vmexit;				/* Between xsave_vmexit() and xsave_vmentry() */
+	bool guest_saved;			/* Guest state is in area */
+	volatile bool busy[2];		/* Indexed by in_vmexit */
+} __attribute__((aligned(64))) xsave_vcpu_t;
+
+static xsave_vcpu_t xsave_vcpus[MAX_VCPU_ENTRIES];
+
+/*
+ * XCR0 value, 0 if extended state is not enabled. Bit 0 is always set when
+ * enabled, so vmlaunch_asm() and vmresume_asm() only check the low 32 bits.
+ */
+u64 xsave_xcr0;
+
+const char *g_xsave_policy_names[XSAVE_POLICIES] = {
+	[XSAVE_POLICY_NONE] = "none",
+	[XSAVE_POLICY_EAGER] = "eager",
+	[XSAVE_POLICY_LAZY] = "lazy",
+};
+
+static inline void xsave_save(u8 * area)
+{
+#ifdef __amd64__
+	asm volatile ("xsave64 %0":"+m" (*(u8(*)[XSAVE_AREA_SIZE]) area)
+				  :"a"((u32) xsave_xcr0), "d"((u32) (xsave_xcr0 >> 32)));
+#elif defined(__i386__)
+	asm volatile ("xsave %0":"+m" (*(u8(*)[XSAVE_AREA_SIZE]) area)
+				  :"a"((u32) xsave_xcr0), "d"((u32) (xsave_xcr0 >> 32)));
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+}
+
+static inline void xsave_restore(u8 * area)
+{
+#ifdef __amd64__
+	asm volatile ("xrstor64 %0"::"m" (*(u8(*)[XSAVE_AREA_SIZE]) area),
+				  "a"((u32) xsave_xcr0), "d"((u32) (xsave_xcr0 >> 32)));
+#elif defined(__i386__)
+	asm volatile ("xrstor %0"::"m" (*(u8(*)[XSAVE_AREA_SIZE]) area),
+				  "a"((u32) xsave_xcr0), "d"((u32) (xsave_xcr0 >> 32)));
+#else							/* !defined(__i386__) && !defined(__amd64__) */
+#error "Unsupported Arch"
+#endif							/* !defined(__i386__) && !defined(__amd64__) */
+}
+
+/*
+ * Enable extended state on the current CPU, called by all CPUs before
+ * setting up VMCS. The BSP checks CPUID and decides XCR0.
+ */
+void xsave_init(VCPU * vcpu)
+{
+	xsave_vcpu_t *xs = &xsave_vcpus[vcpu->idx];
+
+	if (vcpu->isbsp && g_xsave_policy != XSAVE_POLICY_NONE) {
+		if (g_xsave_policy >= XSAVE_POLICIES) {
+			printf("CPU(0x%02x): Unknown xsave policy %lld\n", vcpu->id,
+				   g_xsave_policy);
+			HALT();
+		}
+		/* CPUID.01H:ECX.XSAVE[bit 26] */
+		if (!(cpuid_ecx(1, 0) & (1U << 26))) {
+			printf("CPU(0x%02x): XSAVE not supported, xsave policy ignored\n",
+				   vcpu->id);
+			g_xsave_policy = XSAVE_POLICY_NONE;
+		} else {
+			xsave_xcr0 = cpuid_eax(0xd, 0) & XSAVE_XCR0_MASK;
+			ASSERT(xsave_xcr0 & 0x1ULL);
+		}
+	}
+
+	xs->policy = g_xsave_policy;
+	if (xs->policy == XSAVE_POLICY_NONE) {
+		return;
+	}
+	write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+	write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_OSXSAVE);
+	xsetbv(0, xsave_xcr0);
+	/* CPUID.(EAX=0DH, ECX=0):EBX is the area size for current XCR0 */
+	ASSERT(cpuid_ebx(0xd, 0) <= XSAVE_AREA_SIZE);
+	if (vcpu->isbsp) {
+		printf("CPU(0x%02x): xsave policy=%s xcr0=0x%llx size=%u\n", vcpu->id,
+			   g_xsave_policy_names[g_xsave_policy], xsave_xcr0,
+			   cpuid_ebx(0xd, 0));
+	}
+}
+
+u32 xsave_get_policy(VCPU * vcpu)
+{
+	return xsave_vcpus[vcpu->idx].policy;
+}
+
+/*
+ * Change the policy of a VCPU, called in a VMEXIT handler. Extended state
+ * must have been enabled by xsave_init(). The guest state saved under the
+ * old policy is still restored at VMENTRY.
+ */
+void xsave_set_policy(VCPU * vcpu, u32 policy)
+{
+	ASSERT(xsave_xcr0 != 0);
+	ASSERT(policy < XSAVE_POLICIES);
+	xsave_vcpus[vcpu->idx].policy = policy;
+}
+
+/* Called by vmexit_handler() at every VMEXIT except the fast path. */
+void xsave_vmexit(VCPU * vcpu)
+{
+	xsave_vcpu_t *xs = &xsave_vcpus[vcpu->idx];
+	xs->in_vmexit = true;
+	if (xs->policy == XSAVE_POLICY_EAGER) {
+		xsave_save(xs->area);
+		xs->guest_saved = true;
+	}
+}
+
+/*
+ * Called by vmlaunch_asm() and vmresume_asm() before entering the guest, only
+ * if extended state is enabled.
+ */
+void xsave_vmentry(void)
+{
+	xsave_vcpu_t *xs = &xsave_vcpus[get_vcpu()->idx];
+	ASSERT(!xs->busy[1]);
+	if (xs->guest_saved) {
+		xsave_restore(xs->area);
+		xs->guest_saved = false;
+	}
+	xs->in_vmexit = false;
+}
+
+/*
+ * Start using SIMD registers. Return false if the caller must not use them:
+ * extended state is not enabled, or another section is interrupted. Must be
+ * called after init_gdt().
+ */
+bool xsave_fpu_begin(void)
+{
+	xsave_vcpu_t *xs;
+	ulong_t flags;
+	bool ans = false;
+
+	if (xsave_xcr0 == 0) {
+		return false;
+	}
+	xs = &xsave_vcpus[get_vcpu()->idx];
+	asm volatile ("pushf; pop %0; cli":"=g" (flags)::"memory");
+	if (xs->policy != XSAVE_POLICY_NONE && !xs->busy[xs->in_vmexit]) {
+		xs->busy[xs->in_vmexit] = true;
+		if (xs->in_vmexit && !xs->guest_saved) {
+			xsave_save(xs->area);
+			xs->guest_saved = true;
+		}
+		ans = true;
+	}
+	if (flags & EFLAGS_IF) {
+		asm volatile ("sti");
+	}
+	return ans;
+}
+
+/* Stop using SIMD registers, after xsave_fpu_begin() returns true. */
+void xsave_fpu_end(void)
+{
+	xsave_vcpu_t *xs = &xsave_vcpus[get_vcpu()->idx];
+	asm volatile ("":::"memory");
+	ASSERT(xs->busy[xs->in_vmexit]);
+	xs->busy[xs->in_vmexit] = false;
+}
+
+/*
+ * SIMD kernels. The compiler does not allocate XMM registers (-mno-sse), so
+ * the inline assembly below does not (and cannot) list them as clobbered.
+ */
+
+/* memset() using 16-byte SSE2 stores, for large buffers. */
+void *simd_memset(void *str, int c, size_t len)
+{
+	u8 *st = str;
+	u32 pattern = (u8) c * 0x01010101U;
+
+	if (len < 64 || !xsave_fpu_begin()) {
+		return memset(str, c, len);
+	}
+	asm volatile ("movd %0, %%xmm0\n\t"
+				  "pshufd $0, %%xmm0, %%xmm0"::"r" (pattern));
+	for (; len >= 64; len -= 64) {
+		asm volatile ("movdqu %%xmm0, 0(%0)\n\t"
+					  "movdqu %%xmm0, 16(%0)\n\t"
+					  "movdqu %%xmm0, 32(%0)\n\t"
+					  "movdqu %%xmm0, 48(%0)"::"r" (st):"memory");
+		st += 64;
+	}
+	xsave_fpu_end();
+	memset(st, c, len);
+	return str;
+}
+
+/* memcmp() comparing 16 bytes at a time with SSE2, for large buffers. */
+int simd_memcmp(const void *s1, const void *s2, size_t n)
+{
+	const u8 *p1 = s1;
+	const u8 *p2 = s2;
+
+	if (n < 64 || !xsave_fpu_begin()) {
+		return memcmp(s1, s2, n);
+	}
+	for (; n >= 16; n -= 16) {
+		u32 mask;
+		asm volatile ("movdqu (%1), %%xmm0\n\t"
+					  "movdqu (%2), %%xmm1\n\t"
+					  "pcmpeqb %%xmm1, %%xmm0\n\t"
+					  "pmovmskb %%xmm0, %0":"=r" (mask):"r"(p1), "r"(p2)
+					  :"memory");
+		if (mask != 0xffffU) {
+			break;
+		}
+		p1 += 16;
+		p2 += 16;
+	}
+	xsave_fpu_end();
+	return memcmp(p1, p2, n);
+}
@@ -0,0 +1,158 @@
+#
+# SHV - Small HyperVisor for testing nested virtualization in hypervisors
+# Copyright (C) 2023  Eric Li
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+'''
+Decode binary trace frames (see src/trace.c) in SHV console output, e.g. the
+serial port output saved by QEMU "-serial file:serial.txt". Print records in
+TSC order and / or statistics.
+'''
+
+import os, re, sys, zlib, struct, argparse
+from collections import defaultdict
+
+SCRIPT_DIR = os.path.dirname(os.path.realpath(__file__))
+EVENTS_H = os.path.join(SCRIPT_DIR, '../../include/_trace_events.h')
+
+MAGIC = b'\xa5TRC'
+# trace_frame_t: magic, nrec, rec_size, checksum
+FRAME = struct.Struct('<4sHHI')
+# trace_record_t: tsc, seq, event, cpu, reserved, args[3]
+RECORD = struct.Struct('<QIHBB3Q')
+
+def parse_args():
+	parser = argparse.ArgumentParser(description=__doc__)
+	parser.add_argument('input', nargs='?', help='console output (default stdin)')
+	parser.add_argument('--events', default=EVENTS_H,
+						help='path to _trace_events.h')
+	parser.add_argument('--text', action='store_true',
+						help='also print text output between frames')
+	parser.add_argument('--stats', action='store_true',
+						help='print statistics after records')
+	parser.add_argument('--stats-only', action='store_true',
+						help='only print statistics')
+	return parser.parse_args()
+
+def read_events(path):
+	'''Return {id: (name, format)} from _trace_events.h'''
+	ans = {}
+	pattern = r'DECLARE_TRACE_EVENT\((0x[0-9a-fA-F]+), (\w+), "(.*)"\)'
+	for line in open(path):
+		matched = re.match(pattern, line)
+		if matched:
+			event_id, name, fmt = matched.groups()
+			ans[int(event_id, 16)] = (name, fmt)
+	return ans
+
+def parse_stream(data, stats):
+	'''Yield ('text', bytes) and ('record', tuple) in stream order'''
+	i = 0
+	while True:
+		j = data.find(MAGIC, i)
+		if j == -1:
+			if i < len(data):
+				yield 'text', data[i:]
+			return
+		if j > i:
+			yield 'text', data[i:j]
+		if j + FRAME.size > len(data):
+			stats['truncated_frames'] += 1
+			return
+		_, nrec, rec_size, checksum = FRAME.unpack_from(data, j)
+		begin = j + FRAME.size
+		end = begin + nrec * rec_size
+		if rec_size < RECORD.size or end > len(data) or \
+			zlib.adler32(data[begin:end]) & 0xffffffff != checksum:
+			# Not a valid frame, skip the magic and resynchronize
+			stats['bad_frames'] += 1
+			yield 'text', data[j:j + 1]
+			i = j + 1
+			continue
+		stats['frames'] += 1
+		for k in range(begin, end, rec_size):
+			yield 'record', RECORD.unpack_from(data, k)
+		i = end
+
+def format_record(record, events):
+	tsc, seq, event, cpu, _, *args = record
+	name, fmt = events.get(event, ('UNKNOWN_0x%04x' % event, '{0} {1} {2}'))
+	try:
+		msg = fmt.format(*args)
+	except (ValueError, IndexError):
+		msg = ' '.join(map(hex, args))
+	return '%d CPU(0x%02x) %s: %s' % (tsc, cpu, name, msg)
+
+def print_stats(records, events, stats):
+	print('Frames: %d, bad frames: %d, truncated frames: %d' %
+		  (stats['frames'], stats['bad_frames'], stats['truncated_frames']))
+	# Dropped records are gaps in per-CPU sequence numbers
+	dropped = 0
+	last_seq = {}
+	for tsc, seq, event, cpu, *_ in sorted(records, key=lambda x: (x[3], x[1])):
+		if cpu in last_seq and seq > last_seq[cpu] + 1:
+			dropped += seq - last_seq[cpu] - 1
+		last_seq[cpu] = seq
+	print('Records: %d, dropped: %d' % (len(records), dropped))
+	if records:
+		tscs = [i[0] for i in records]
+		print('TSC span: %d cycles' % (max(tscs) - min(tscs)))
+	# Per event: count per CPU and interval between records on the same CPU
+	count = defaultdict(lambda: defaultdict(int))
+	intervals = defaultdict(list)
+	last_tsc = {}
+	for tsc, seq, event, cpu, *_ in records:
+		count[event][cpu] += 1
+		if (event, cpu) in last_tsc:
+			intervals[event].append(tsc - last_tsc[(event, cpu)])
+		last_tsc[(event, cpu)] = tsc
+	print('%-24s %8s %12s %12s %12s  %s' %
+		  ('event', 'count', 'min_gap', 'avg_gap', 'max_gap', 'per_cpu'))
+	for event in sorted(count):
+		name = events.get(event, ('UNKNOWN_0x%04x' % event,))[0]
+		total = sum(count[event].values())
+		gaps = intervals[event]
+		if gaps:
+			gap = (min(gaps), sum(gaps) // len(gaps), max(gaps))
+		else:
+			gap = ('-', '-', '-')
+		per_cpu = ' '.join('0x%02x:%d' % (cpu, n)
+						   for cpu, n in sorted(count[event].items()))
+		print('%-24s %8d %12s %12s %12s  %s' % ((name, total) + gap +
+												(per_cpu,)))
+
+def main():
+	args = parse_args()
+	events = read_events(args.events)
+	if args.input:
+		data = open(args.input, 'rb').read()
+	else:
+		data = sys.stdin.buffer.read()
+	stats = defaultdict(int)
+	records = []
+	for kind, value in parse_stream(data, stats):
+		if kind == 'record':
+			records.append(value)
+		elif args.text and not args.stats_only:
+			sys.stdout.write(value.decode('latin-1'))
+	if not args.stats_only:
+		for record in sorted(records, key=lambda x: x[0]):
+			print(format_record(record, events))
+	if args.stats or args.stats_only:
+		print_stats(records, events, stats)
+
+if __name__ == '__main__':
+	main()